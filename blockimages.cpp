@@ -17,6 +17,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <string.h>
 
 #include "blockimages.h"
 #include "utils.h"
@@ -79,6 +80,7 @@ bool BlockImages::create(int B, const string& imgpath)
 		{
 			retouchAlphas(B);
 			checkOpacityAndTransparency(B);
+			computeSpans();
 			return true;
 		}
 		// if it's a previous version (and the correct size for that version), we'll
@@ -130,9 +132,85 @@ bool BlockImages::create(int B, const string& imgpath)
 
 	retouchAlphas(B);
 	checkOpacityAndTransparency(B);
+	computeSpans();
 	return true;
 }
 
+void BlockImages::computeSpans()
+{
+	spans.clear();
+	spanrows.clear();
+	spanrows.reserve(NUMBLOCKIMAGES*rectsize + 1);
+	for (int i = 0; i < NUMBLOCKIMAGES; i++)
+	{
+		ImageRect rect = getRect(i);
+		for (int r = 0; r < rectsize; r++)
+		{
+			spanrows.push_back(spans.size());
+			const RGBAPixel *row = &img(rect.x, rect.y + r);
+			for (int x = 0; x < rectsize; )
+			{
+				int a = ALPHA(row[x]);
+				if (a == 0)
+				{
+					x++;
+					continue;
+				}
+				// extend the run as long as the pixels stay in the same class
+				bool opaque = a == 255;
+				int start = x;
+				for (x++; x < rectsize; x++)
+				{
+					a = ALPHA(row[x]);
+					if (a == 0 || (a == 255) != opaque)
+						break;
+				}
+				spans.push_back(Span(start, x - start, opaque));
+			}
+		}
+	}
+	spanrows.push_back(spans.size());
+}
+
+void BlockImages::blitBlock(int offset, RGBAImage& dest, int32_t dxstart, int32_t dystart) const
+{
+	ImageRect rect = getRect(offset);
+	int32_t ybegin = max(0, -dystart);
+	int32_t yend = min(rectsize, dest.h - dystart);
+	for (int32_t r = ybegin, dy = dystart + ybegin; r < yend; r++, dy++)
+	{
+		const RGBAPixel *srow = &img(rect.x, rect.y + r);
+		RGBAPixel *drow = &dest.data[dy*dest.w];
+		for (int s = spanrows[offset*rectsize + r], send = spanrows[offset*rectsize + r + 1]; s < send; s++)
+		{
+			// clip the span to the dest image
+			const Span& span = spans[s];
+			int32_t sx = span.x, dx = dxstart + span.x, len = span.len;
+			if (dx < 0)
+			{
+				sx -= dx;
+				len += dx;
+				dx = 0;
+			}
+			len = min(len, dest.w - dx);
+			if (len <= 0)
+				continue;
+			if (span.opaque)
+				memcpy(drow + dx, srow + sx, len * sizeof(RGBAPixel));
+			else if (premultiplied)
+				blendRowPremultiplied(drow + dx, srow + sx, len);
+			else
+				blendRow(drow + dx, srow + sx, len);
+		}
+	}
+}
+
+void BlockImages::premultiply()
+{
+	premultiplyImage(img);
+	premultiplied = true;
+}
+
 
 
 
@@ -2065,6 +2143,30 @@ void BlockImages::checkOpacityAndTransparency(int B)
 				break;
 		}
 	}
+
+	// mark which pixels of a block image's rectangle are inside the hexagon, then look for block images
+	//  with anything outside it
+	vector<bool> hexagon(rectsize*rectsize, false);
+	int tilesize = 2*B;
+	for (FaceIterator it(0, B, 1, tilesize); !it.end; it.advance())
+		hexagon[it.y*rectsize + it.x] = true;
+	for (FaceIterator it(2*B, 2*B, -1, tilesize); !it.end; it.advance())
+		hexagon[it.y*rectsize + it.x] = true;
+	for (TopFaceIterator it(2*B-1, 0, tilesize); !it.end; it.advance())
+		hexagon[it.y*rectsize + it.x] = true;
+	overflow.clear();
+	overflow.resize(NUMBLOCKIMAGES, false);
+	for (int i = 0; i < NUMBLOCKIMAGES; i++)
+	{
+		ImageRect rect = getRect(i);
+		for (int y = 0; y < rectsize && !overflow[i]; y++)
+			for (int x = 0; x < rectsize; x++)
+				if (!hexagon[y*rectsize + x] && ALPHA(img(rect.x + x, rect.y + y)) > 0)
+				{
+					overflow[i] = true;
+					break;
+				}
+	}
 }
 
 void BlockImages::retouchAlphas(int B)
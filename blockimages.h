@@ -98,6 +98,40 @@ struct BlockImages
 	bool isTransparent(int offset) const {return transparency[offset];}
 	bool isTransparent(uint16_t blockID, uint8_t blockData) const {return transparency[getOffset(blockID, blockData)];}
 
+	// ...and whether a block image has any non-transparent pixels outside the hexagon (like ascending tracks,
+	//  which stick up above it)
+	std::vector<bool> overflow;  // size is NUMBLOCKIMAGES; indexed by offset
+	bool overflowsHexagon(int offset) const {return overflow[offset];}
+
+	// each row of each block image, broken into runs of pixels that are all opaque or all translucent (fully
+	//  transparent pixels are left out entirely), so that drawing a block image can memcpy the opaque runs,
+	//  blend only the translucent ones, and never touch the empty corners around the hexagon
+	struct Span
+	{
+		uint16_t x, len;  // start relative to the block image's left edge, and length
+		bool opaque;
+		Span(uint16_t xx, uint16_t ll, bool o) : x(xx), len(ll), opaque(o) {}
+	};
+	std::vector<Span> spans;
+	// spans for row r of block image i are spans[spanrows[i*rectsize + r]] up to (but not including)
+	//  spans[spanrows[i*rectsize + r + 1]]; size is NUMBLOCKIMAGES*rectsize + 1
+	std::vector<int> spanrows;
+
+	// fill in spans and spanrows (must be done after retouchAlphas, so the alphas are all pushed to 0 or 255
+	//  where they're going to be)
+	void computeSpans();
+
+	// alpha-blend a block image onto an image, with its top-left corner at the given position (may be partially
+	//  or completely out of bounds); same result as alphablit on the block image's rect, but uses the spans
+	// ...if the block images are premultiplied, so is the image being drawn on
+	void blitBlock(int offset, RGBAImage& dest, int32_t dxstart, int32_t dystart) const;
+
+	// whether img has been converted to premultiplied alpha (see rgba.h)
+	bool premultiplied;
+
+	// convert img to premultiplied alpha (after create; the spans etc. only depend on alpha, so they don't change)
+	void premultiply();
+
 	// get the rectangle in img corresponding to an offset
 	ImageRect getRect(int offset) const {return ImageRect((offset%16)*rectsize, (offset/16)*rectsize, rectsize, rectsize);}
 	ImageRect getRect(uint16_t blockID, uint8_t blockData) const {return getRect(getOffset(blockID, blockData));}
@@ -109,7 +143,7 @@ struct BlockImages
 	// set the offsets
 	void setOffsets();
 
-	// fill in the opacity and transparency members
+	// fill in the opacity, transparency, and overflow members
 	void checkOpacityAndTransparency(int B);
 
 	// scan the block images looking for not-quite-transparent or not-quite-opaque pixels; if they're close enough,
@@ -118,6 +152,8 @@ struct BlockImages
 
 	// build block images from terrain.png, etc.
 	bool construct(int B, const std::string& terrainfile, const std::string& firefile, const std::string& endportalfile, const std::string& chestfile, const std::string& largechestfile, const std::string& enderchestfile);
+
+	BlockImages() : premultiplied(false) {}
 };
 
 // block image offsets:
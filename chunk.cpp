@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <memory>
+#include <zlib.h>
 
 #include "chunk.h"
 #include "utils.h"
@@ -31,33 +32,164 @@ using namespace std;
 //---------------------------------------------------------------------------------------------------
 
 
-bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
+ChunkSection ChunkSection::air;
+
+static bool allZero(const uint8_t *buf, size_t len)
+{
+	uint8_t bits = 0;
+	for (size_t i = 0; i < len; i++)
+		bits |= buf[i];
+	return bits == 0;
+}
+
+void ChunkSection::pack(const uint8_t *ids, const uint8_t *data, const uint8_t *add)
+{
+	int i = 0;
+	for (int y = 0; y < 16; y++)
+		for (int z = 0; z < 16; z++)
+			for (int x = 0; x < 16; x += 2, i += 2)
+			{
+				uint8_t d = data[i/2], a = (add == NULL) ? 0 : add[i/2];
+				blocks[index(x, z, y)] = ((a & 0xf) << 12) | (ids[i] << 4) | (d & 0xf);
+				blocks[index(x + 1, z, y)] = ((a & 0xf0) << 8) | (ids[i + 1] << 4) | (d >> 4);
+			}
+}
+
+bool ChunkSection::isEmpty() const
+{
+	return allZero((const uint8_t*)blocks, sizeof(blocks));
+}
+
+SectionPool::~SectionPool()
+{
+	for (vector<ChunkSection*>::iterator it = slabs.begin(); it != slabs.end(); it++)
+		delete[] *it;
+}
+
+ChunkSection* SectionPool::get()
+{
+	MutexLocker ml(mutex);
+	if (freesections.empty())
+	{
+		ChunkSection *slab = new ChunkSection[SECTIONSLABSIZE];
+		slabs.push_back(slab);
+		for (int i = SECTIONSLABSIZE - 1; i >= 0; i--)
+			freesections.push_back(slab + i);
+	}
+	ChunkSection *section = freesections.back();
+	freesections.pop_back();
+	inuse++;
+	return section;
+}
+
+void SectionPool::put(ChunkSection *section)
+{
+	MutexLocker ml(mutex);
+	freesections.push_back(section);
+	inuse--;
+}
+
+void ChunkData::clear(SectionPool& pool)
+{
+	for (int i = 0; i < 16; i++)
+		if (sections[i] != &ChunkSection::air)
+		{
+			pool.put(sections[i]);
+			sections[i] = &ChunkSection::air;
+		}
+}
+
+ChunkSection* ChunkData::getSection(int y, SectionPool& pool)
+{
+	if (sections[y] == &ChunkSection::air)
+		sections[y] = pool.get();
+	return sections[y];
+}
+
+void ChunkData::trimSection(int y, SectionPool& pool)
+{
+	if (sections[y] != &ChunkSection::air && sections[y]->isEmpty())
+	{
+		pool.put(sections[y]);
+		sections[y] = &ChunkSection::air;
+	}
+}
+
+int ChunkData::sectionCount() const
+{
+	int count = 0;
+	for (int i = 0; i < 16; i++)
+		if (sections[i] != &ChunkSection::air)
+			count++;
+	return count;
+}
+
+bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf, SectionPool& pool)
 {
+	clear(pool);
 	anvil = false;
 	// the hell with parsing this whole godforsaken NBT format; just look for the arrays we need
 	uint8_t idsTag[13] = {7, 0, 6, 'B', 'l', 'o', 'c', 'k', 's', 0, 0, 128, 0};
 	uint8_t dataTag[11] = {7, 0, 4, 'D', 'a', 't', 'a', 0, 0, 64, 0};
-	bool foundIDs = false, foundData = false;
+	const uint8_t *ids = NULL, *data = NULL;
 	for (vector<uint8_t>::const_iterator it = filebuf.begin(); it != filebuf.end(); it++)
 	{
 		if (*it != 7)
 			continue;
-		if (!foundIDs && it + 13 + 32768 <= filebuf.end() && equal(it, it + 13, idsTag))
+		if (ids == NULL && it + 13 + 32768 <= filebuf.end() && equal(it, it + 13, idsTag))
 		{
-			copy(it + 13, it + 13 + 32768, blockIDs);
+			ids = &(*(it + 13));
 			it += 13 + 32768 - 1;  // one less because of the loop we're in
-			foundIDs = true;
 		}
-		else if (!foundData && it + 11 + 16384 <= filebuf.end() && equal(it, it + 11, dataTag))
+		else if (data == NULL && it + 11 + 16384 <= filebuf.end() && equal(it, it + 11, dataTag))
 		{
-			copy(it + 11, it + 11 + 16384, blockData);
+			data = &(*(it + 11));
 			it += 11 + 16384 - 1;  // one less because of the loop we're in
-			foundData = true;
 		}
-		if (foundIDs && foundData)
-			return true;
+		if (ids != NULL && data != NULL)
+			break;
+	}
+	if (ids == NULL || data == NULL)
+		return false;
+
+	// old-style chunks are 128 high and ordered by X, then Z, then Y; shuffle the blocks into
+	//  Anvil order, then pack them like any other section
+	uint8_t sectionids[4096], sectiondata[2048];
+	for (int sy = 0; sy < 8; sy++)
+	{
+		fill(sectiondata, sectiondata + 2048, 0);
+		for (int x = 0; x < 16; x++)
+			for (int z = 0; z < 16; z++)
+			{
+				int oldi = (x * 16 + z) * 128 + sy * 16;
+				for (int y = 0; y < 16; y++, oldi++)
+				{
+					int i = (y * 16 + z) * 16 + x;
+					sectionids[i] = ids[oldi];
+					uint8_t d = (oldi % 2 == 0) ? (data[oldi/2] & 0xf) : (data[oldi/2] >> 4);
+					sectiondata[i/2] |= (i % 2 == 0) ? d : (d << 4);
+				}
+			}
+		getSection(sy, pool)->pack(sectionids, sectiondata, NULL);
+		trimSection(sy, pool);
 	}
-	return false;
+	computeHeights(127);
+	return true;
+}
+
+void ChunkData::computeHeights(int top)
+{
+	maxheight = 0;
+	for (int z = 0; z < 16; z++)
+		for (int x = 0; x < 16; x++)
+		{
+			BlockIdx bi(x, z, top);
+			BlockOffset bo(bi);
+			while (bo.y > 0 && id(bo) == 0)
+				bo.y--;
+			heights[z * 16 + x] = bo.y;
+			maxheight = max(maxheight, (uint8_t)bo.y);
+		}
 }
 
 
@@ -79,193 +211,345 @@ bool ChunkData::loadFromOldFile(const vector<uint8_t>& filebuf)
 #define TAG_COMPOUND       10
 #define TAG_INT_ARRAY      11
 
-// although tag names are UTF8, we'll just pretend they're ASCII--we don't really care about how the
-//  actual string data breaks down into characters, as long as we know where the end of the string is
-void parseTypeAndName(const uint8_t*& ptr, uint8_t& type, string& name)
+// source of NBT bytes for the Anvil extractor: either a buffer that's already been decompressed, or compressed
+//  data that gets inflated a window at a time as the extractor asks for more
+// ...nothing here allocates anything; the window lives wherever the NBTSource does, and the z_stream (if any)
+//  belongs to the caller
+#define NBTWINDOW 16384
+struct NBTSource
 {
-	type = *ptr;
-	ptr++;
-	if (type != TAG_END)
-	{
-		uint16_t len = fromBigEndian(*((uint16_t*)ptr));
-		name.resize(len);
-		copy(ptr + 2, ptr + 2 + len, name.begin());
-		ptr += 2 + len;
-	}
-}
+	const uint8_t *ptr, *end;  // bytes ready to be consumed
+	z_stream *zs;  // if NULL, [ptr,end) is all there is
+	bool zdone;  // whether inflate has reached the end of the stream (or hit an error)
+	uint8_t window[NBTWINDOW];
 
-// structure for locating the block data for a 16x16x16 section--the compound tags on the "Sections" list will pass
-//  this down to their immediate children, so they can fill in pointers to their payloads if appropriate
-// ...after the whole structure is parsed, the block data will be copied into the ChunkData
-// (note that we can't read the block data immediately upon finding it, because we have to know the Y value
-//  for the section first, and the tags may appear in any order)
-struct chunkSection
-{
-	int y;  // or -1 for "not found yet"
-	const uint8_t *blockIDs;  // pointer into the file buffer, or NULL for "not found yet"
-	const uint8_t *blockData;  // pointer into the file buffer, or NULL for "not found yet"
-	const uint8_t *blockAdd;  // pointer into the file buffer, or NULL for "not found" (this one may not be present at all)
+	NBTSource(const uint8_t *buf, size_t len) : ptr(buf), end(buf + len), zs(NULL), zdone(true) {}
+	NBTSource(z_stream *z) : ptr(window), end(window), zs(z), zdone(false) {}
 
-	chunkSection() : y(-1), blockIDs(NULL), blockData(NULL), blockAdd(NULL) {}
-	bool complete() const {return y >= 0 && y < 16 && blockIDs != NULL && blockData != NULL;}
-	
-	void extract(ChunkData& chunkdata) const
+	// inflate up to len bytes into dest; returns the number actually produced (0 if there are no more)
+	size_t inflateTo(uint8_t *dest, size_t len)
 	{
-		copy(blockIDs, blockIDs + 4096, chunkdata.blockIDs + (y * 4096));
-		copy(blockData, blockData + 2048, chunkdata.blockData + (y * 2048));
-		if (blockAdd != NULL)
-			copy(blockAdd, blockAdd + 2048, chunkdata.blockAdd + (y * 2048));
+		if (zdone || len == 0)
+			return 0;
+		zs->next_out = dest;
+		zs->avail_out = len;
+		int result = inflate(zs, Z_SYNC_FLUSH);
+		// on an error, just stop producing data; the extractor will then fail for lack of bytes
+		if (result != Z_OK)
+			zdone = true;
+		return len - zs->avail_out;
 	}
-};
 
-bool isSection(const vector<string>& names)
-{
-	return names.size() == 4 &&
-	       names[3] == "" &&
-	       names[2] == "Sections" &&
-	       names[1] == "Level" &&
-	       names[0] == "";
-}
-
-// if section != NULL, then the immediate parent of this tag is one of the compound tags in the "Sections"
-//  list, so the block data tags will fill in their locations
-bool parsePayload(const uint8_t*& ptr, uint8_t type, vector<string>& names, chunkSection *section, vector<chunkSection>& completedSections)
-{
-	switch (type)
+	// make at least n bytes (no more than NBTWINDOW) available at ptr
+	bool need(size_t n)
 	{
-		case TAG_END:
-		{
+		if ((size_t)(end - ptr) >= n)
 			return true;
-		}
-		case TAG_BYTE:
+		if (zs == NULL || n > NBTWINDOW)
+			return false;
+		size_t have = end - ptr;
+		memmove(window, ptr, have);
+		ptr = window;
+		while (have < n)
 		{
-			if (section != NULL && names.back() == "Y")
-				section->y = *ptr;
-			ptr++;
-			return true;
+			size_t got = inflateTo(window + have, NBTWINDOW - have);
+			if (got == 0)
+				return false;
+			have += got;
 		}
-		case TAG_SHORT:
+		end = window + have;
+		return true;
+	}
+
+	// copy the next n bytes out (any that haven't been inflated yet are inflated straight into dest)
+	bool read(uint8_t *dest, size_t n)
+	{
+		size_t avail = min(n, (size_t)(end - ptr));
+		memcpy(dest, ptr, avail);
+		ptr += avail;
+		for (size_t done = avail; done < n; )
 		{
-			ptr += 2;
-			return true;
+			size_t got = inflateTo(dest + done, n - done);
+			if (got == 0)
+				return false;
+			done += got;
 		}
-		case TAG_INT:
-		case TAG_FLOAT:
+		return true;
+	}
+
+	// throw away the next n bytes
+	bool skip(uint64_t n)
+	{
+		uint64_t avail = end - ptr;
+		if (n <= avail)
 		{
-			ptr += 4;
+			ptr += n;
 			return true;
 		}
-		case TAG_LONG:
-		case TAG_DOUBLE:
+		n -= avail;
+		ptr = end = window;
+		while (n > 0)
 		{
-			ptr += 8;
-			return true;
+			size_t got = inflateTo(window, min(n, (uint64_t)NBTWINDOW));
+			if (got == 0)
+				return false;
+			n -= got;
 		}
-		case TAG_BYTE_ARRAY:
-		{
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4;
-			if (section != NULL)
-			{
-				if (names.back() == "Blocks" && len == 4096)
-					section->blockIDs = ptr;
-				else if (names.back() == "Data" && len == 2048)
-					section->blockData = ptr;
-				else if (names.back() == "Add" && len == 2048)
-					section->blockAdd = ptr;
-			}
-			ptr += len;
-			return true;
-		}
-		case TAG_INT_ARRAY:
-		{
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4 + len*4;
+		return true;
+	}
+
+	bool readByte(uint8_t& v) {if (!need(1)) return false; v = *ptr++; return true;}
+	bool readShort(uint16_t& v) {if (!need(2)) return false; v = (ptr[0] << 8) | ptr[1]; ptr += 2; return true;}
+	bool readInt(uint32_t& v)
+	{
+		if (!need(4))
+			return false;
+		v = ((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+		ptr += 4;
+		return true;
+	}
+};
+
+// walks the NBT data of an Anvil chunk in a single pass, pulling the block arrays out of the compounds
+//  in Level.Sections and skipping over everything else (entities, biomes, lighting, etc.)
+// ...tag names are only ever compared to a few short ASCII ones, so we keep just enough of each name
+//  to do that (although tag names are UTF8, we don't care how the bytes break down into characters)
+struct AnvilExtractor
+{
+	NBTSource& src;
+	ChunkData& chunkdata;
+	SectionPool& pool;
+	int top;  // highest Y-coord of any section found so far (or 0)
+
+	char name[16];  // name of the most recent tag (if it fit)
+	uint16_t namelen;
+
+	// the current section's arrays, until we pack them
+	uint8_t idsbuf[4096], databuf[2048], addbuf[2048];
+
+	AnvilExtractor(NBTSource& s, ChunkData& cd, SectionPool& p) : src(s), chunkdata(cd), pool(p), top(0), namelen(0) {}
+
+	bool nameIs(const char *s, uint16_t len) const {return namelen == len && memcmp(name, s, len) == 0;}
+
+	bool readTypeAndName(uint8_t& type)
+	{
+		if (!src.readByte(type))
+			return false;
+		if (type == TAG_END)
 			return true;
-		}
-		case TAG_STRING:
+		if (!src.readShort(namelen))
+			return false;
+		// names that won't fit can't be any of the ones we're looking for
+		if (namelen > sizeof(name))
+			return src.skip(namelen);
+		return src.read((uint8_t*)name, namelen);
+	}
+
+	bool skipPayload(uint8_t type, int depth)
+	{
+		if (depth > 64)
 		{
-			uint16_t len = fromBigEndian(*((uint16_t*)ptr));
-			ptr += 2 + len;
-			return true;
+			cerr << "NBT data nested too deeply" << endl;
+			return false;
 		}
-		case TAG_LIST:
+		uint8_t u8;
+		uint16_t u16;
+		uint32_t u32;
+		switch (type)
 		{
-			uint8_t listtype = *ptr;
-			ptr++;
-			uint32_t len = fromBigEndian(*((uint32_t*)ptr));
-			ptr += 4;
-			stackPusher<string> sp(names, "");
-			for (uint32_t i = 0; i < len; i++)
-				if (!parsePayload(ptr, listtype, names, NULL, completedSections))
+			case TAG_END:
+				return true;
+			case TAG_BYTE:
+				return src.skip(1);
+			case TAG_SHORT:
+				return src.skip(2);
+			case TAG_INT:
+			case TAG_FLOAT:
+				return src.skip(4);
+			case TAG_LONG:
+			case TAG_DOUBLE:
+				return src.skip(8);
+			case TAG_BYTE_ARRAY:
+				return src.readInt(u32) && src.skip(u32);
+			case TAG_INT_ARRAY:
+				return src.readInt(u32) && src.skip((uint64_t)u32 * 4);
+			case TAG_STRING:
+				return src.readShort(u16) && src.skip(u16);
+			case TAG_LIST:
+			{
+				if (!src.readByte(u8) || !src.readInt(u32))
 					return false;
-			return true;
+				// lists of fixed-size things can be skipped all at once
+				static const int fixedsizes[12] = {0, 1, 2, 4, 8, 4, 8, 0, 0, 0, 0, 0};
+				if (u8 < 12 && fixedsizes[u8] != 0)
+					return src.skip((uint64_t)u32 * fixedsizes[u8]);
+				for (uint32_t i = 0; i < u32; i++)
+					if (!skipPayload(u8, depth + 1))
+						return false;
+				return true;
+			}
+			case TAG_COMPOUND:
+			{
+				while (readTypeAndName(u8))
+				{
+					if (u8 == TAG_END)
+						return true;
+					if (!skipPayload(u8, depth + 1))
+						return false;
+				}
+				return false;
+			}
+			default:
+			{
+				// unknown tag--since we have no idea how large it is, we must abort
+				cerr << "unknown NBT tag: type " << (int)type << endl;
+				return false;
+			}
 		}
-		case TAG_COMPOUND:
+	}
+
+	// one compound tag from the Sections list
+	bool extractSection()
+	{
+		int y = -1;
+		bool haveIDs = false, haveData = false, haveAdd = false;
+		uint8_t type;
+		while (readTypeAndName(type))
 		{
-			chunkSection section;
-			chunkSection *sectionPtr = isSection(names) ? &section : NULL;
-			
-			uint8_t nexttype;
-			string nextname;
-			parseTypeAndName(ptr, nexttype, nextname);
-			while (nexttype != TAG_END)
+			if (type == TAG_END)
 			{
-				stackPusher<string> sp(names, nextname);
-				if (!parsePayload(ptr, nexttype, names, sectionPtr, completedSections))
+				if (y < 0 || y >= 16 || !haveIDs || !haveData)
+				{
+					cerr << "incomplete chunk section!" << endl;
 					return false;
-				parseTypeAndName(ptr, nexttype, nextname);
+				}
+				chunkdata.getSection(y, pool)->pack(idsbuf, databuf, haveAdd ? addbuf : NULL);
+				// (sections full of air do get saved sometimes)
+				chunkdata.trimSection(y, pool);
+				if (chunkdata.sections[y] != &ChunkSection::air)
+					top = max(top, y*16 + 15);
+				return true;
 			}
-			
-			if (sectionPtr != NULL)
+			if (type == TAG_BYTE && nameIs("Y", 1))
 			{
-				if (section.complete())
-					completedSections.push_back(section);
-				else
-				{
-					cerr << "incomplete chunk section!" << endl;
+				uint8_t b;
+				if (!src.readByte(b))
+					return false;
+				y = b;
+			}
+			else if (type == TAG_BYTE_ARRAY && (nameIs("Blocks", 6) || nameIs("Data", 4) || nameIs("Add", 3)))
+			{
+				uint32_t len;
+				if (!src.readInt(len))
 					return false;
+				bool okay;
+				if (name[0] == 'B' && len == 4096)
+				{
+					okay = src.read(idsbuf, len);
+					haveIDs = true;
+				}
+				else if (name[0] == 'D' && len == 2048)
+				{
+					okay = src.read(databuf, len);
+					haveData = true;
 				}
+				else if (name[0] == 'A' && len == 2048)
+				{
+					okay = src.read(addbuf, len);
+					haveAdd = true;
+				}
+				else
+					okay = src.skip(len);
+				if (!okay)
+					return false;
 			}
+			else if (!skipPayload(type, 0))
+				return false;
+		}
+		return false;
+	}
 
-			return true;
+	// the payload of the Level compound
+	bool extractLevel()
+	{
+		uint8_t type;
+		while (readTypeAndName(type))
+		{
+			if (type == TAG_END)
+				return true;
+			if (type == TAG_LIST && nameIs("Sections", 8))
+			{
+				uint8_t listtype;
+				uint32_t len;
+				if (!src.readByte(listtype) || !src.readInt(len))
+					return false;
+				for (uint32_t i = 0; i < len; i++)
+					if (!(listtype == TAG_COMPOUND ? extractSection() : skipPayload(listtype, 0)))
+						return false;
+			}
+			else if (!skipPayload(type, 0))
+				return false;
 		}
-		default:
+		return false;
+	}
+
+	// the whole chunk
+	bool extract()
+	{
+		uint8_t type = TAG_END;
+		if (!readTypeAndName(type))
 		{
-			// unknown tag--since we have no idea how large it is, we must abort
-			cerr << "unknown NBT tag: type " << type << endl;
+			cerr << "unrecognized NBT chunk file: can't read top tag" << endl;
 			return false;
 		}
+		if (type != TAG_COMPOUND || namelen != 0)
+		{
+			cerr << "unrecognized NBT chunk file: top tag has type " << (int)type << " and name length " << namelen << endl;
+			return false;
+		}
+		while (readTypeAndName(type))
+		{
+			if (type == TAG_END)
+				return true;
+			if (type == TAG_COMPOUND && nameIs("Level", 5))
+			{
+				if (!extractLevel())
+					return false;
+			}
+			else if (!skipPayload(type, 0))
+				return false;
+		}
+		return false;
 	}
-	return false;  // shouldn't be able to reach here
-}
+};
 
-bool ChunkData::loadFromAnvilFile(const vector<uint8_t>& filebuf)
+bool ChunkData::loadFromAnvil(NBTSource& src, SectionPool& pool)
 {
+	clear(pool);
 	anvil = true;
-	fill(blockIDs, blockIDs + 65536, 0);
-	fill(blockAdd, blockAdd + 32768, 0);
-	fill(blockData, blockData + 32768, 0);
 
-	const uint8_t *ptr = &(filebuf[0]);
-	uint8_t type;
-	string name;
-	parseTypeAndName(ptr, type, name);
-	if (type != TAG_COMPOUND || !name.empty())
-	{
-		cerr << "unrecognized NBT chunk file: top tag has type " << (int)type << " and name " << name << endl;
-		return false;
-	}
-
-	vector<string> names(1, name);
-	vector<chunkSection> completedSections;
-	if (!parsePayload(ptr, type, names, NULL, completedSections))
+	AnvilExtractor extractor(src, *this, pool);
+	if (!extractor.extract())
 		return false;
+	// (we only have to look for the column heights starting from the top of the highest section)
+	computeHeights(extractor.top);
+	return true;
+}
 
-	for (vector<chunkSection>::const_iterator it = completedSections.begin(); it != completedSections.end(); it++)
-		it->extract(*this);
+bool ChunkData::loadFromAnvilFile(const vector<uint8_t>& filebuf, SectionPool& pool)
+{
+	NBTSource src(filebuf.empty() ? NULL : &filebuf[0], filebuf.size());
+	return loadFromAnvil(src, pool);
+}
 
-	return true;
+bool ChunkData::loadFromCompressedAnvil(const uint8_t *compressed, size_t length, z_stream *zs, SectionPool& pool)
+{
+	if (Z_OK != inflateReset(zs))
+		return false;
+	zs->next_in = const_cast<uint8_t*>(compressed);
+	zs->avail_in = length;
+	NBTSource src(zs);
+	return loadFromAnvil(src, pool);
 }
 
 
@@ -281,12 +565,43 @@ ChunkCacheStats& ChunkCacheStats::operator+=(const ChunkCacheStats& ccs)
 	missing += ccs.missing;
 	reqmissing += ccs.reqmissing;
 	corrupt += ccs.corrupt;
+	conflict += ccs.conflict;
+	capacity += ccs.capacity;
 	return *this;
 }
 
+ChunkCache::~ChunkCache()
+{
+	releasePins();
+	delete[] entries;
+	if (inflater != NULL)
+	{
+		inflateEnd(inflater);
+		delete inflater;
+	}
+}
+
+void ChunkCache::createInflater()
+{
+	inflater = new z_stream;
+	inflater->zalloc = Z_NULL;
+	inflater->zfree = Z_NULL;
+	inflater->opaque = Z_NULL;
+	inflater->next_in = Z_NULL;
+	inflater->avail_in = 0;
+	// (accept either gzip or zlib headers)
+	if (Z_OK != inflateInit2(inflater, 15 + 32))
+	{
+		delete inflater;
+		inflater = NULL;
+	}
+}
+
 ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
 {
-	int e = getEntryNum(ci);
+	if (shared != NULL)
+		return getSharedData(ci);
+
 	int state = chunktable.getDiskState(ci);
 
 	if (state == ChunkSet::CHUNK_UNKNOWN)
@@ -301,13 +616,16 @@ ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
 	// if the chunk is in the cache, return it
 	if (state == ChunkSet::CHUNK_CACHED)
 	{
-		if (entries[e].ci != ci)
-		{
-			cerr << "grievous chunk cache failure!" << endl;
-			cerr << "[" << ci.x << "," << ci.z << "]   [" << entries[e].ci.x << "," << entries[e].ci.z << "]" << endl;
-			exit(-1);
-		}
-		return &entries[e].data;
+		ChunkCacheEntry *set = entries + geometry.setStart(ci.x, ci.z);
+		for (int i = 0; i < geometry.ways; i++)
+			if (set[i].ci == ci)
+			{
+				set[i].lastused = ++clock;
+				return &set[i].data;
+			}
+		cerr << "grievous chunk cache failure!" << endl;
+		cerr << "[" << ci.x << "," << ci.z << "]   [" << set[0].ci.x << "," << set[0].ci.z << "]" << endl;
+		exit(-1);
 	}
 
 	// if this is a full render and the chunk is not required, we already know it doesn't exist
@@ -319,14 +637,35 @@ ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
 		return &blankdata;
 	}
 
-	// okay, we actually have to read the chunk from disk
-	if (regionformat)
-		readFromRegionCache(ci);
-	else
-		readChunkFile(ci);
+	// okay, we actually have to read the chunk from disk (again, maybe)
+	int eviction = chunktable.getEviction(ci);
+	if (eviction == ChunkSet::EVICTED_CONFLICT)
+		stats.conflict++;
+	else if (eviction == ChunkSet::EVICTED_CAPACITY)
+		stats.capacity++;
+	bool anvil;
+	int e = -1;
+	state = readChunk(ci, anvil);
+	if (state == ChunkSet::CHUNK_CACHED)
+	{
+		// evict current tenant of the slot we're going to use
+		generation++;
+		e = getVictim(ci);
+		if (entries[e].ci.valid())
+			filled--;
+		entries[e].ci = PosChunkIdx(-1,-1);
+		// ...and put this chunk's data into the slot, assuming the data can actually be parsed
+		state = parseReadBuf(entries[e].data, anvil, sectionpool);
+		if (state == ChunkSet::CHUNK_CACHED)
+		{
+			entries[e].ci = ci;
+			filled++;
+			entries[e].lastused = ++clock;
+		}
+	}
+	chunktable.setDiskState(ci, state);
 
 	// check whether the read succeeded; return the data if so
-	state = chunktable.getDiskState(ci);
 	if (state == ChunkSet::CHUNK_CORRUPTED)
 	{
 		stats.corrupt++;
@@ -340,72 +679,331 @@ ChunkData* ChunkCache::getData(const PosChunkIdx& ci)
 			stats.missing++;
 		return &blankdata;
 	}
-	if (state != ChunkSet::CHUNK_CACHED || entries[e].ci != ci)
-	{
-		cerr << "grievous chunk cache failure!" << endl;
-		cerr << "[" << ci.x << "," << ci.z << "]   [" << entries[e].ci.x << "," << entries[e].ci.z << "]" << endl;
-		exit(-1);
-	}
 	stats.read++;
 	return &entries[e].data;
 }
 
-void ChunkCache::readChunkFile(const PosChunkIdx& ci)
+int ChunkCache::getVictim(const PosChunkIdx& ci)
+{
+	int start = geometry.setStart(ci.x, ci.z);
+	int victim = start;
+	for (int e = start; e < start + geometry.ways; e++)
+	{
+		if (!entries[e].ci.valid())
+			return e;
+		if (entries[e].lastused < entries[victim].lastused)
+			victim = e;
+	}
+
+	// we have to evict someone; if there's an empty entry anywhere else in the cache, or there haven't been
+	//  enough lookups since this one was used to touch as many other chunks as the cache holds, then a fully
+	//  associative cache would have kept it
+	int eviction = (filled < geometry.size() || clock - entries[victim].lastused < (uint64_t)geometry.size()) ?
+	               ChunkSet::EVICTED_CONFLICT : ChunkSet::EVICTED_CAPACITY;
+	chunktable.setDiskState(entries[victim].ci, ChunkSet::CHUNK_UNKNOWN);
+	chunktable.setEviction(entries[victim].ci, eviction);
+	return victim;
+}
+
+ChunkData* ChunkCache::getSharedData(const PosChunkIdx& ci)
+{
+	// see if we've already got this one pinned
+	int e = getPinSlot(ci);
+	if (pinslots[e] != NULL && pinslots[e]->ci == ci)
+	{
+		stats.hits++;
+		return &pinslots[e]->data;
+	}
+
+	int result;
+	SharedChunkEntry *entry = shared->acquire(ci, *this, result);
+	if (result == SharedChunkCache::ACQUIRE_HIT)
+		stats.hits++;
+	else
+		stats.misses++;
+	if (result == SharedChunkCache::ACQUIRE_READ)
+		stats.read++;
+	else if (result == SharedChunkCache::ACQUIRE_SKIPPED)
+		stats.skipped++;
+	else if (result == SharedChunkCache::ACQUIRE_CORRUPTED)
+		stats.corrupt++;
+	else if (result == SharedChunkCache::ACQUIRE_MISSING)
+	{
+		if (shared->chunktable.isRequired(ci))
+			stats.reqmissing++;
+		else
+			stats.missing++;
+	}
+	if (entry == NULL)
+		return &blankdata;
+	// (if this slot held some other entry, it stays pinned until releasePins(), since its data may still be in use)
+	pinslots[e] = entry;
+	pinned.push_back(entry);
+	return &entry->data;
+}
+
+void ChunkCache::releasePins()
+{
+	if (shared == NULL)
+		return;
+	generation++;
+	for (vector<SharedChunkEntry*>::const_iterator it = pinned.begin(); it != pinned.end(); it++)
+		shared->release(*it);
+	pinned.clear();
+	fill(pinslots.begin(), pinslots.end(), (SharedChunkEntry*)NULL);
+}
+
+int ChunkCache::readChunk(const PosChunkIdx& ci, bool& anvil)
+{
+	compresseddata = NULL;
+	// we may already know that the chunk isn't there (when using a SharedChunkCache, for example, our
+	//  RegionCache marks the chunks of missing regions in our own ChunkTable)
+	int state = chunktable.getDiskState(ci);
+	if (state == ChunkSet::CHUNK_MISSING || state == ChunkSet::CHUNK_CORRUPTED)
+		return state;
+
+	if (regionformat)
+		return readFromRegionCache(ci, anvil);
+	anvil = false;
+	return readChunkFile(ci);
+}
+
+int ChunkCache::readChunkFile(const PosChunkIdx& ci)
 {
 	// read the gzip file from disk, if it's there
 	string filename = inputpath + "/" + ci.toChunkIdx().toFilePath();
 	int result = readGzFile(filename, readbuf);
 	if (result == -1)
+		return ChunkSet::CHUNK_MISSING;
+	if (result == -2)
+		return ChunkSet::CHUNK_CORRUPTED;
+	return ChunkSet::CHUNK_CACHED;
+}
+
+int ChunkCache::readFromRegionCache(const PosChunkIdx& ci, bool& anvil)
+{
+	// try to decompress the chunk data--or, if we have an inflater, just find it
+	int result;
+	if (inflater != NULL)
 	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return;
+		result = regioncache.getCompressedChunk(ci, compresseddata, compressedlength, anvil);
+		// old-style chunks still have to be decompressed all at once
+		if (result == 0 && !anvil)
+		{
+			if (!readGzOrZlib(const_cast<uint8_t*>(compresseddata), compressedlength, readbuf))
+				result = -2;
+			compresseddata = NULL;
+		}
 	}
+	else
+		result = regioncache.getDecompressedChunk(ci, readbuf, anvil);
+	if (result == -1)
+		return ChunkSet::CHUNK_MISSING;
 	if (result == -2)
+		return ChunkSet::CHUNK_CORRUPTED;
+	return ChunkSet::CHUNK_CACHED;
+}
+
+int ChunkCache::parseReadBuf(ChunkData& data, bool anvil, SectionPool& pool)
+{
+	bool result;
+	if (compresseddata != NULL)
 	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
-		return;
+		result = data.loadFromCompressedAnvil(compresseddata, compressedlength, inflater, pool);
+		compresseddata = NULL;
 	}
-
-	// gzip read was successful; extract the data we need from the chunk
-	//  and put it in the cache
-	parseReadBuf(ci, false);
+	else
+		result = anvil ? data.loadFromAnvilFile(readbuf, pool) : data.loadFromOldFile(readbuf, pool);
+	if (!result)
+		data.clear(pool);
+	return result ? ChunkSet::CHUNK_CACHED : ChunkSet::CHUNK_CORRUPTED;
 }
 
-void ChunkCache::readFromRegionCache(const PosChunkIdx& ci)
+
+
+void ChunkUseCounts::build(ChunkTable& chunktable, const TileTable& tiletable, const MapParams& mp)
 {
-	// try to decompress the chunk data
-	bool anvil;
-	int result = regioncache.getDecompressedChunk(ci, readbuf, anvil);
-	if (result == -1)
+	chunks.clear();
+	tilechunks.clear();
+	for (RequiredChunkIterator it(chunktable); !it.end; it.advance())
+		chunks.push_back(ChunkUses(it.current));
+	sort(chunks.begin(), chunks.end());
+	for (size_t i = 0; i < chunks.size(); i++)
 	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
-		return;
+		vector<TileIdx> tiles = chunks[i].ci.toChunkIdx().getTiles(mp);
+		for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
+			if (tiletable.isRequired(*tile))
+			{
+				TileChunk tc;
+				tc.tx = tile->x;
+				tc.ty = tile->y;
+				tc.chunk = i;
+				tilechunks.push_back(tc);
+				chunks[i].remaining++;
+			}
 	}
-	if (result == -2)
+	sort(tilechunks.begin(), tilechunks.end());
+}
+
+int32_t* ChunkUseCounts::find(const PosChunkIdx& ci)
+{
+	vector<ChunkUses>::iterator it = lower_bound(chunks.begin(), chunks.end(), ChunkUses(ci));
+	if (it == chunks.end() || it->ci != ci)
+		return NULL;
+	return &it->remaining;
+}
+
+void ChunkUseCounts::tileDone(const TileIdx& ti)
+{
+	TileChunk key;
+	key.tx = ti.x;
+	key.ty = ti.y;
+	for (vector<TileChunk>::const_iterator it = lower_bound(tilechunks.begin(), tilechunks.end(), key); it != tilechunks.end() && it->tx == ti.x && it->ty == ti.y; it++)
+		__sync_fetch_and_sub(&chunks[it->chunk].remaining, 1);
+}
+
+void ChunkUseCounts::getChunks(const TileIdx& ti, vector<PosChunkIdx>& result) const
+{
+	TileChunk key;
+	key.tx = ti.x;
+	key.ty = ti.y;
+	for (vector<TileChunk>::const_iterator it = lower_bound(tilechunks.begin(), tilechunks.end(), key); it != tilechunks.end() && it->tx == ti.x && it->ty == ti.y; it++)
+		result.push_back(chunks[it->chunk].ci);
+}
+
+
+
+SharedChunkCache::SharedChunkCache(const ChunkTable& ctable, bool fullr, int64_t budget, ChunkUseCounts *uc)
+	: chunktable(&ctable), fullrender(fullr), usecounts(uc)
+{
+	stripebudget = budget / SCCSTRIPES;
+}
+
+SharedChunkCache::~SharedChunkCache()
+{
+	for (int i = 0; i < SCCSTRIPES; i++)
+		for (vector<SharedChunkEntry*>::iterator it = stripes[i].entries.begin(); it != stripes[i].entries.end(); it++)
+		{
+			(*it)->data.clear(sectionpool);
+			delete *it;
+		}
+}
+
+bool SharedChunkCache::evict(Stripe& stripe)
+{
+	// (without use counts, nothing is ever known to be unneeded, so this is plain LRU)
+	vector<SharedChunkEntry*>::iterator victim = stripe.entries.end();
+	bool victimunneeded = false;
+	for (vector<SharedChunkEntry*>::iterator it = stripe.entries.begin(); it != stripe.entries.end(); it++)
 	{
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
-		return;
+		if ((*it)->pins > 0 || (*it)->loading)
+			continue;
+		bool unneeded = (*it)->remaining != NULL && *(*it)->remaining <= 0;
+		if (victim == stripe.entries.end() || (unneeded && !victimunneeded) ||
+		    (unneeded == victimunneeded && (*it)->lastused < (*victim)->lastused))
+		{
+			victim = it;
+			victimunneeded = unneeded;
+		}
 	}
-	
-	// decompression was successful; extract the data we need from the chunk
-	//  and put it in the cache
-	parseReadBuf(ci, anvil);
+	if (victim == stripe.entries.end())
+		return false;
+	SharedChunkEntry *entry = *victim;
+	if (entry->ci.valid())
+		chunktable.setDiskState(entry->ci, ChunkSet::CHUNK_UNKNOWN);
+	stripe.bytes -= entryBytes(entry);
+	entry->data.clear(sectionpool);
+	delete entry;
+	*victim = stripe.entries.back();
+	stripe.entries.pop_back();
+	return true;
 }
 
-void ChunkCache::parseReadBuf(const PosChunkIdx& ci, bool anvil)
+SharedChunkEntry* SharedChunkCache::acquire(const PosChunkIdx& ci, ChunkCache& reader, int& result)
 {
-	// evict current tenant of chunk's cache slot
-	int e = getEntryNum(ci);
-	if (entries[e].ci.valid())
-		chunktable.setDiskState(entries[e].ci, ChunkSet::CHUNK_UNKNOWN);
-	entries[e].ci = PosChunkIdx(-1,-1);
-	// ...and put this chunk's data into the slot, assuming the data can actually be parsed
-	bool result = anvil ? entries[e].data.loadFromAnvilFile(readbuf) : entries[e].data.loadFromOldFile(readbuf);
-	if (result)
+	// if we've already tried and failed to read the chunk, don't try again
+	int state = chunktable.getDiskState(ci);
+	if (state == ChunkSet::CHUNK_CORRUPTED || state == ChunkSet::CHUNK_MISSING)
 	{
-		entries[e].ci = ci;
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CACHED);
+		result = ACQUIRE_HIT;
+		return NULL;
 	}
-	else
-		chunktable.setDiskState(ci, ChunkSet::CHUNK_CORRUPTED);
+
+	// if this is a full render and the chunk is not required, we already know it doesn't exist
+	if (fullrender && !chunktable.isRequired(ci))
+	{
+		result = ACQUIRE_SKIPPED;
+		chunktable.setDiskState(ci, ChunkSet::CHUNK_MISSING);
+		return NULL;
+	}
+
+	Stripe& stripe = stripes[getStripeNum(ci)];
+	MutexLocker ml(stripe.mutex);
+
+	// if the chunk is here (or on its way), pin it and wait for it to be ready
+	for (vector<SharedChunkEntry*>::iterator it = stripe.entries.begin(); it != stripe.entries.end(); it++)
+	{
+		SharedChunkEntry *entry = *it;
+		if (entry->ci != ci)
+			continue;
+		entry->pins++;
+		entry->lastused = ++stripe.clock;
+		while (entry->loading)
+			stripe.loaded.wait(stripe.mutex);
+		result = ACQUIRE_HIT;
+		// ...it's possible that the read failed, in which case the entry has been emptied
+		if (entry->ci != ci)
+		{
+			entry->pins--;
+			return NULL;
+		}
+		return entry;
+	}
+
+	// we'll have to read it ourselves; since chunks vary in size, we don't know how much room it needs until
+	//  we've read it, so just make sure we're under the budget beforehand by throwing out the least recently
+	//  used entries that nobody is using
+	while (stripe.bytes >= stripebudget && evict(stripe))
+		;
+	SharedChunkEntry *entry = new SharedChunkEntry;
+	stripe.entries.push_back(entry);
+	stripe.bytes += entryBytes(entry);
+	entry->ci = ci;
+	if (usecounts != NULL)
+		entry->remaining = usecounts->find(ci);
+	entry->pins = 1;
+	entry->loading = true;
+	entry->lastused = ++stripe.clock;
+
+	// do the actual reading without holding the lock
+	stripe.mutex.unlock();
+	bool anvil;
+	state = reader.readChunk(ci, anvil);
+	if (state == ChunkSet::CHUNK_CACHED)
+		state = reader.parseReadBuf(entry->data, anvil, sectionpool);
+	stripe.mutex.lock();
+
+	chunktable.setDiskState(ci, state);
+	entry->loading = false;
+	stripe.loaded.broadcast();
+	if (state == ChunkSet::CHUNK_CACHED)
+	{
+		// (the entry was counted while it was still empty)
+		stripe.bytes += entry->data.sectionCount() * (int64_t)sizeof(ChunkSection);
+		result = ACQUIRE_READ;
+		return entry;
+	}
+	result = (state == ChunkSet::CHUNK_MISSING) ? ACQUIRE_MISSING : ACQUIRE_CORRUPTED;
+	// (an empty entry is the first to go)
+	entry->ci = PosChunkIdx(-1,-1);
+	entry->lastused = 0;
+	entry->pins--;
+	return NULL;
+}
+
+void SharedChunkCache::release(SharedChunkEntry *entry)
+{
+	Stripe& stripe = stripes[getStripeNum(entry->ci)];
+	MutexLocker ml(stripe.mutex);
+	entry->pins--;
 }
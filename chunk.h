@@ -21,6 +21,7 @@
 #include <string.h>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <stdint.h>
 
 #include "map.h"
@@ -42,42 +43,95 @@ struct BlockOffset
 	}
 };
 
+struct z_stream_s;
+struct NBTSource;
+
+// one 16-block-high slice of a chunk, in the form the renderer wants: a single 16-bit value per block,
+//  in an order that keeps its lookups close together
+// ...the pseudocolumn iterator walks along (1,-1,-1), so blocks are indexed by X within rows of constant
+//  (X+Z)&15 and (X+Y)&15; each step of the walk is then the next block in memory, E/W neighbors are 32 bytes
+//  away, and U/D neighbors 512 (this is a bijection because X, Y, Z are all 0-15 within the section)
+struct ChunkSection
+{
+	uint16_t blocks[4096];  // (blockID << 4) | blockData
+
+	// all zeros; shared by every section that has no blocks in it
+	static ChunkSection air;
+
+	// (Y relative to the section)
+	static int index(int x, int z, int y) {return ((((x + y) & 0xf) * 16 + ((x + z) & 0xf)) * 16) + x;}
+
+	// fill in from the Anvil arrays, which are indexed by (Y * 16 + Z) * 16 + X; add may be NULL
+	void pack(const uint8_t *ids, const uint8_t *data, const uint8_t *add);
+
+	bool isEmpty() const;
+};
+
+// where ChunkSections come from; sections are allocated in slabs and recycled, never freed until
+//  the pool goes away
+// ...the pool is locked, since the SharedChunkCache's threads all load chunks into the same one
+#define SECTIONSLABSIZE 64
+struct SectionPool : private nocopy
+{
+	Mutex mutex;
+	std::vector<ChunkSection*> slabs;
+	std::vector<ChunkSection*> freesections;
+	int64_t inuse;  // sections currently handed out
+
+	SectionPool() : inuse(0) {}
+	~SectionPool();
+
+	// contents of the returned section are garbage
+	ChunkSection* get();
+	void put(ChunkSection *section);
+};
+
+// block data is kept per section, so the air above the terrain (and in any sections that the chunk
+//  doesn't have) costs nothing but a pointer to ChunkSection::air
+// ...old-style chunks are converted to the Anvil layout when loaded, occupying the bottom 8 sections
 struct ChunkData
 {
-	uint8_t blockIDs[65536];  // one byte per block (only half of this space used for old-style chunks)
-	uint8_t blockAdd[32768];  // only in Anvil--extra bits for block ID (4 bits per block)
-	uint8_t blockData[32768];  // 4 bits per block (only half of this space used for old-style chunks)
+	ChunkSection *sections[16];  // indexed by Y/16; never NULL
 	bool anvil;  // whether this data came from an Anvil chunk or an old-style one
+	// Y-coord of the highest non-air block in each column (indexed by Z*16 + X), and in the whole chunk; 0 for
+	//  columns (or chunks) with no blocks at all
+	uint8_t heights[256];
+	uint8_t maxheight;
 
-	// these guys assume that the BlockIdx actually points to this chunk
-	//  (so they only look at the lower bits)
-	uint16_t id(const BlockOffset& bo) const
-	{
-		if (!anvil)
-			return (bo.y > 127) ? 0 : blockIDs[(bo.x * 16 + bo.z) * 128 + bo.y];
-		int i = (bo.y * 16 + bo.z) * 16 + bo.x;
-		if ((i % 2) == 0)
-			return ((blockAdd[i/2] & 0xf) << 8) | blockIDs[i];
-		return ((blockAdd[i/2] & 0xf0) << 4) | blockIDs[i];
-	}
-	uint8_t data(const BlockOffset& bo) const
+	ChunkData() : anvil(true), maxheight(0)
 	{
-		int i;
-		if (!anvil)
-		{
-			if (bo.y > 127)
-				return 0;
-			i = (bo.x * 16 + bo.z) * 128 + bo.y;
-		}
-		else
-			i = (bo.y * 16 + bo.z) * 16 + bo.x;
-		if ((i % 2) == 0)
-			return blockData[i/2] & 0xf;
-		return (blockData[i/2] & 0xf0) >> 4;
+		std::fill(sections, sections + 16, &ChunkSection::air);
+		memset(heights, 0, 256);
 	}
 
-	bool loadFromOldFile(const std::vector<uint8_t>& filebuf);
-	bool loadFromAnvilFile(const std::vector<uint8_t>& filebuf);
+	// these guys assume that the BlockIdx actually points to this chunk
+	//  (so they only look at the lower bits)
+	uint16_t block(const BlockOffset& bo) const {return sections[bo.y >> 4]->blocks[ChunkSection::index(bo.x, bo.z, bo.y & 0xf)];}
+	uint16_t id(const BlockOffset& bo) const {return block(bo) >> 4;}
+	uint8_t data(const BlockOffset& bo) const {return block(bo) & 0xf;}
+
+	uint8_t height(const BlockOffset& bo) const {return heights[bo.z * 16 + bo.x];}
+
+	// the loaders replace whatever was here before, getting sections from the pool (and returning
+	//  the old ones to it)
+	bool loadFromOldFile(const std::vector<uint8_t>& filebuf, SectionPool& pool);
+	bool loadFromAnvilFile(const std::vector<uint8_t>& filebuf, SectionPool& pool);
+	// same as loadFromAnvilFile, but parses the data as it comes out of inflate, instead of decompressing
+	//  it all first; the z_stream must have been initialized with inflateInit2 (it gets reset here)
+	bool loadFromCompressedAnvil(const uint8_t *compressed, size_t length, z_stream_s *zs, SectionPool& pool);
+	bool loadFromAnvil(NBTSource& src, SectionPool& pool);
+
+	// return all sections to the pool, leaving nothing but air
+	void clear(SectionPool& pool);
+	// get a real (non-air) section to write into; if the section was air, the new one's contents are garbage
+	ChunkSection* getSection(int y, SectionPool& pool);
+	// give a section back to the pool if it turned out to have no blocks in it
+	void trimSection(int y, SectionPool& pool);
+	int sectionCount() const;
+
+	// fill in the heights by scanning down each column, starting from top (which must be at least as high
+	//  as the highest non-air block)
+	void computeHeights(int top);
 };
 
 
@@ -91,6 +145,9 @@ struct ChunkCacheStats
 	int64_t missing;  // non-required chunk not present on disk
 	int64_t reqmissing;  // required chunk not present on disk
 	int64_t corrupt;  // found on disk, but failed to read
+	// misses on chunks that were in the cache before, by how they were evicted (see ChunkSet); lots of
+	//  conflict misses mean more associativity would help, lots of capacity misses mean more space would
+	int64_t conflict, capacity;
 
 	// when in region mode, the miss stats have slightly different meanings:
 	//  read: chunk was successfully read from region cache (which may or may not have triggered an
@@ -99,7 +156,7 @@ struct ChunkCacheStats
 	//  corrupt: region file itself is okay, but chunk data within it is corrupt
 	//  skipped/reqmissing: unused
 
-	ChunkCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0) {}
+	ChunkCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0), conflict(0), capacity(0) {}
 
 	ChunkCacheStats& operator+=(const ChunkCacheStats& ccs);
 };
@@ -108,21 +165,35 @@ struct ChunkCacheEntry
 {
 	PosChunkIdx ci;  // or [-1,-1] if this entry is empty
 	ChunkData data;
+	uint64_t lastused;  // cache's clock value at last use, for LRU eviction within the set
 
-	ChunkCacheEntry() : ci(-1,-1) {}
+	ChunkCacheEntry() : ci(-1,-1), lastused(0) {}
 };
 
-#define CACHEBITSX 5
-#define CACHEBITSZ 5
-#define CACHEXSIZE (1 << CACHEBITSX)
-#define CACHEZSIZE (1 << CACHEBITSZ)
-#define CACHESIZE (CACHEXSIZE * CACHEZSIZE)
-#define CACHEXMASK (CACHEXSIZE - 1)
-#define CACHEZMASK (CACHEZSIZE - 1)
+// the cache is CACHEWAYS-way set-associative; the number of sets comes from the memory budget
+#define CACHEWAYS 4
+// for sizing the cache, assume every chunk is full height (most are much less, so this is pessimistic)
+#define CACHEENTRYBYTES (sizeof(ChunkCacheEntry) + 16 * sizeof(ChunkSection))
+
+// when using a SharedChunkCache, our pointers to pinned entries are kept in this many slots
+#define PINSLOTBITSX 5
+#define PINSLOTBITSZ 5
+#define PINSLOTXSIZE (1 << PINSLOTBITSX)
+#define PINSLOTZSIZE (1 << PINSLOTBITSZ)
+#define PINSLOTS (PINSLOTXSIZE * PINSLOTZSIZE)
+#define PINSLOTXMASK (PINSLOTXSIZE - 1)
+#define PINSLOTZMASK (PINSLOTZSIZE - 1)
+
+struct SharedChunkCache;
+struct SharedChunkEntry;
 
 struct ChunkCache : private nocopy
 {
-	ChunkCacheEntry entries[CACHESIZE];
+	SetGeometry geometry;
+	ChunkCacheEntry *entries;  // geometry.size() of them, or NULL if we're using a SharedChunkCache instead
+	uint64_t clock;  // ticks once per lookup
+	int filled;  // how many entries are in use
+	SectionPool sectionpool;  // for our entries (unused if we have a SharedChunkCache)
 	ChunkData blankdata;  // for use with missing chunks
 
 	ChunkTable& chunktable;
@@ -133,25 +204,182 @@ struct ChunkCache : private nocopy
 	bool fullrender;
 	bool regionformat;
 	std::vector<uint8_t> readbuf;  // buffer for decompressing into when reading
-	ChunkCache(ChunkTable& ctable, RegionTable& rtable, RegionCache& rcache, const std::string& inpath, bool fullr, bool regform, ChunkCacheStats& st)
-		: chunktable(ctable), regiontable(rtable), regioncache(rcache), inputpath(inpath), fullrender(fullr), regionformat(regform), stats(st)
+
+	// if we have an inflater, Anvil chunks from region files aren't decompressed into readbuf first; readChunk
+	//  just finds the compressed data, and parseReadBuf parses it as it inflates it
+	z_stream_s *inflater;  // NULL if we're not doing that
+	const uint8_t *compresseddata;  // set by readChunk if it left the chunk compressed (NULL otherwise)
+	size_t compressedlength;
+
+	// bumped whenever a ChunkData pointer we've handed out may have become invalid (when we read a chunk into
+	//  an entry, or release our pins on the shared cache), so that callers holding on to pointers (see
+	//  ChunkWindow) know when to look them up again
+	uint64_t generation;
+
+	// when using a SharedChunkCache, we keep pointers to the entries we've pinned since the last releasePins(),
+	//  so that most lookups never have to touch the shared cache at all
+	SharedChunkCache *shared;
+	std::vector<SharedChunkEntry*> pinslots;  // indexed by getPinSlot (may be NULL)
+	std::vector<SharedChunkEntry*> pinned;
+
+	// if a SharedChunkCache is supplied, it's used instead of a private cache; chunks that miss there are read using
+	//  our RegionCache, but their disk states go in the SharedChunkCache's ChunkTable rather than ours
+	// ...if fusedinflate is set, we get an inflater (see above)
+	// ...budget is in bytes, and determines the number of sets (see CACHEENTRYBYTES)
+	ChunkCache(ChunkTable& ctable, RegionTable& rtable, RegionCache& rcache, const std::string& inpath, bool fullr, bool regform, ChunkCacheStats& st, int64_t budget, SharedChunkCache *sh = NULL, bool fusedinflate = false)
+		: geometry(budget / (int64_t)CACHEENTRYBYTES, CACHEWAYS), clock(0), filled(0), chunktable(ctable), regiontable(rtable), regioncache(rcache), inputpath(inpath), fullrender(fullr), regionformat(regform), stats(st),
+		  inflater(NULL), compresseddata(NULL), compressedlength(0), generation(0), shared(sh)
 	{
-		memset(blankdata.blockIDs, 0, 65536);
-		memset(blankdata.blockData, 0, 32768);
-		memset(blankdata.blockAdd, 0, 32768);
-		blankdata.anvil = true;
+		entries = (shared == NULL) ? new ChunkCacheEntry[geometry.size()] : NULL;
+		if (shared != NULL)
+			pinslots.resize(PINSLOTS, NULL);
 		readbuf.reserve(262144);
+		if (fusedinflate)
+			createInflater();
 	}
+	~ChunkCache();
+
+	void createInflater();
 
 	// look up a chunk and return a pointer to its data
 	// ...for missing/corrupt chunks, return a pointer to some blank data
+	// ...if using a SharedChunkCache, the pointer is only good until the next releasePins()
 	ChunkData* getData(const PosChunkIdx& ci);
 
-	static int getEntryNum(const PosChunkIdx& ci) {return (ci.x & CACHEXMASK) * CACHEZSIZE + (ci.z & CACHEZMASK);}
+	// let go of the shared cache entries we've been using (call when done with a tile); does nothing if we aren't
+	//  using a SharedChunkCache
+	void releasePins();
+
+	static int getPinSlot(const PosChunkIdx& ci) {return (ci.x & PINSLOTXMASK) * PINSLOTZSIZE + (ci.z & PINSLOTZMASK);}
+
+	// pick the entry in a chunk's set to read it into: an empty one if there is one, otherwise the least
+	//  recently used (which we evict)
+	int getVictim(const PosChunkIdx& ci);
+
+	ChunkData* getSharedData(const PosChunkIdx& ci);
+
+	// read a chunk from disk and decompress it into readbuf (or find its compressed data, if using the inflater);
+	//  return CHUNK_CACHED for success (meaning it's ready to be parsed), CHUNK_MISSING, or CHUNK_CORRUPTED
+	int readChunk(const PosChunkIdx& ci, bool& anvil);
+	int readChunkFile(const PosChunkIdx& ci);
+	int readFromRegionCache(const PosChunkIdx& ci, bool& anvil);
+	// parse what readChunk read into some ChunkData (whose sections belong to the given pool); return
+	//  CHUNK_CACHED for success or CHUNK_CORRUPTED (in which case the ChunkData is left empty)
+	int parseReadBuf(ChunkData& data, bool anvil, SectionPool& pool);
+};
+
+
+
+// for each required chunk, how many of the required tiles it's part of haven't been drawn yet, so the
+//  SharedChunkCache can throw out chunks that no tile needs anymore before ones that will be used again
+// ...built before rendering starts; after that, the counts are decremented atomically as tiles finish
+struct ChunkUseCounts : private nocopy
+{
+	struct ChunkUses
+	{
+		PosChunkIdx ci;
+		int32_t remaining;
+
+		ChunkUses(const PosChunkIdx& c) : ci(c), remaining(0) {}
+		bool operator<(const ChunkUses& cu) const {return ci.x < cu.ci.x || (ci.x == cu.ci.x && ci.z < cu.ci.z);}
+	};
+	std::vector<ChunkUses> chunks;  // sorted by ChunkUses::operator<
+
+	// which chunks each tile uses, sorted by tile
+	struct TileChunk
+	{
+		int64_t tx, ty;
+		size_t chunk;  // index into chunks
+
+		bool operator<(const TileChunk& tc) const {return tx < tc.tx || (tx == tc.tx && ty < tc.ty);}
+	};
+	std::vector<TileChunk> tilechunks;
+
+	void build(ChunkTable& chunktable, const TileTable& tiletable, const MapParams& mp);
+
+	// get the count for a chunk; NULL if it's not a required chunk
+	int32_t* find(const PosChunkIdx& ci);
+
+	// a tile has been drawn, so its chunks have one less use left
+	void tileDone(const TileIdx& ti);
+
+	// append the required chunks a tile uses to a list
+	void getChunks(const TileIdx& ti, std::vector<PosChunkIdx>& result) const;
+};
+
+
+
+// chunk cache that all the render threads use at once, so that chunks along the borders between the threads'
+//  areas are only read and parsed once, and memory use is governed by a single budget
+// ...entries are looked up in one of several independently-locked stripes; a thread pins each entry it
+//  gets, and entries can't be evicted while pinned
+// ...whichever thread misses on a chunk reads it (with its own RegionCache), without holding the stripe lock;
+//  other threads that want the same chunk in the meantime wait for it
+struct SharedChunkEntry
+{
+	PosChunkIdx ci;  // or [-1,-1] if this entry is empty
+	ChunkData data;
+	int pins;  // how many threads are using this entry
+	bool loading;  // whether data is still being read
+	uint64_t lastused;  // stripe's clock value at last use, for LRU eviction
+	int32_t *remaining;  // uses left, if we have a ChunkUseCounts and this is a required chunk (NULL otherwise)
+
+	SharedChunkEntry() : ci(-1,-1), pins(0), loading(false), lastused(0), remaining(NULL) {}
+};
+
+#define SCCSTRIPEBITS 4
+#define SCCSTRIPESIZE (1 << SCCSTRIPEBITS)
+#define SCCSTRIPES (SCCSTRIPESIZE * SCCSTRIPESIZE)
+#define SCCSTRIPEMASK (SCCSTRIPESIZE - 1)
+
+struct SharedChunkCache : private nocopy
+{
+	// chunks are assigned to stripes by their lower coordinate bits, so that neighboring chunks (which are
+	//  likely to be wanted at the same time) are in different stripes
+	struct Stripe
+	{
+		Mutex mutex;
+		Condition loaded;  // signalled whenever an entry in this stripe finishes loading
+		std::vector<SharedChunkEntry*> entries;
+		uint64_t clock;
+		int64_t bytes;  // memory used by our entries and their sections
+
+		Stripe() : clock(0), bytes(0) {}
+	};
+	Stripe stripes[SCCSTRIPES];
+	int64_t stripebudget;  // how many bytes each stripe is allowed before evicting
+	SectionPool sectionpool;
+
+	ChunkTable chunktable;  // disk states for all threads (the required bits are the main table's)
+	bool fullrender;
+	ChunkUseCounts *usecounts;  // if non-NULL, used to pick eviction victims (see evict())
+
+	// results of acquire()
+	static const int ACQUIRE_HIT = 0;  // chunk was already cached (or already known to be missing/corrupt)
+	static const int ACQUIRE_READ = 1;  // we read it
+	static const int ACQUIRE_SKIPPED = 2;  // not required in a full render, so assumed missing
+	static const int ACQUIRE_MISSING = 3;  // we tried to read it, but it's not there
+	static const int ACQUIRE_CORRUPTED = 4;  // we tried to read it, but it's corrupt
+
+	// budget is in bytes (counting only the sections chunks actually have); it's a soft limit--if every entry
+	//  in a stripe is pinned, the stripe grows past it, and a chunk being read may take the stripe over
+	SharedChunkCache(const ChunkTable& ctable, bool fullr, int64_t budget, ChunkUseCounts *uc = NULL);
+	~SharedChunkCache();
+
+	static int getStripeNum(const PosChunkIdx& ci) {return (ci.x & SCCSTRIPEMASK) * SCCSTRIPESIZE + (ci.z & SCCSTRIPEMASK);}
+
+	// find a chunk, reading it (via the supplied ChunkCache) if necessary, and pin it; returns NULL if the
+	//  chunk is missing or corrupt
+	SharedChunkEntry* acquire(const PosChunkIdx& ci, ChunkCache& reader, int& result);
+	// unpin an entry
+	void release(SharedChunkEntry *entry);
 
-	void readChunkFile(const PosChunkIdx& ci);
-	void readFromRegionCache(const PosChunkIdx& ci);
-	void parseReadBuf(const PosChunkIdx& ci, bool anvil);
+	// (these expect the stripe to be locked)
+	static int64_t entryBytes(const SharedChunkEntry *entry) {return sizeof(SharedChunkEntry) + entry->data.sectionCount() * (int64_t)sizeof(ChunkSection);}
+	// throw out the least recently used entry that nobody is using--or, if we have use counts, the least
+	//  recently used one that no remaining tile needs, if there are any; return false if there's nothing
+	//  we can evict
+	bool evict(Stripe& stripe);
 };
 
 
@@ -24,10 +24,7 @@
 //   -proper redstone wire directions
 //   -better dragon egg
 //   -extended pistons
-// -premultiply block image alphas?
 // -dump list of corrupted chunks at end, so they can be retried later
-// -keep some space around for PNG row pointers instead of allocating every time
-// -see if it's better to have threads work together and share a cache?
 // -for the love of god, clean up blockimages.cpp!
 //
 
@@ -36,11 +33,13 @@
 #include <string>
 #include <algorithm>
 #include <set>
+#include <deque>
 #include <memory>
 #include <limits>
 #include <fstream>
 #include <sstream>
 #include <time.h>
+#include <math.h>
 #include <pthread.h>
 #include <unistd.h>
 
@@ -66,9 +65,11 @@ void printStats(int seconds, const RenderStats& stats)
 	cout << "chunk cache: " << stats.chunkcache.hits << " hits   " << stats.chunkcache.misses << " misses" << endl;
 	cout << "             " << stats.chunkcache.read << " read   " << stats.chunkcache.skipped << " skipped   " << stats.chunkcache.missing << " missing   "
 	     << stats.chunkcache.reqmissing << " reqmissing   " << stats.chunkcache.corrupt << " corrupt" << endl;
+	cout << "             " << stats.chunkcache.conflict << " conflict   " << stats.chunkcache.capacity << " capacity" << endl;
 	cout << "region cache: " << stats.regioncache.hits << " hits   " << stats.regioncache.misses << " misses" << endl;
 	cout << "              " << stats.regioncache.read << " read   " << stats.regioncache.skipped << " skipped   " << stats.regioncache.missing << " missing   "
 	     << stats.regioncache.reqmissing << " reqmissing   " << stats.regioncache.corrupt << " corrupt" << endl;
+	cout << "              " << stats.regioncache.conflict << " conflict   " << stats.regioncache.capacity << " capacity" << endl;
 #if USE_MALLINFO
 	cout << "heap usage: " << stats.heapusage << " bytes" << endl;
 #endif
@@ -78,8 +79,8 @@ void runSingleThread(RenderJob& rj)
 {
 	cout << "single thread will render " << rj.stats.reqtilecount << " base tiles" << endl;
 	// allocate storage/caches
-	rj.regioncache.reset(new RegionCache(*rj.chunktable, *rj.regiontable, rj.inputpath, rj.fullrender, rj.stats.regioncache));
-	rj.chunkcache.reset(new ChunkCache(*rj.chunktable, *rj.regiontable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache));
+	rj.regioncache.reset(new RegionCache(*rj.chunktable, *rj.regiontable, rj.inputpath, rj.fullrender, rj.stats.regioncache, rj.opts.regioncachesize, rj.opts.mmapregions));
+	rj.chunkcache.reset(new ChunkCache(*rj.chunktable, *rj.regiontable, *rj.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, rj.stats.chunkcache, rj.opts.chunkcachesize, rj.sharedchunkcache.get(), rj.opts.fusedinflate));
 	rj.tilecache.reset(new TileCache(rj.mp));
 	rj.scenegraph.reset(new SceneGraph);
 	RGBAImage topimg;
@@ -89,159 +90,249 @@ void runSingleThread(RenderJob& rj)
 	rj.stats.heapusage = getHeapUsage();
 }
 
-struct WorkerThreadParams
+// a zoom tile for one of the worker threads to render; a task that covers too many base tiles is split into
+//  its four subtiles instead, each of which is reduced into the parent (held in a PartialTileStore) as soon
+//  as it's drawn, and whichever thread finishes the last of them writes the parent out
+// ...everything starts from a single task for the top tile, so the upper zoom levels get put together by
+//  whichever threads finish their pieces, while the others are still busy elsewhere
+struct ZoomTask
 {
-	RenderJob *rj;
-	ThreadOutputCache *tocache;
-	vector<ZoomTileIdx> zoomtiles;  // tiles that this thread is responsible for
+	ZoomTileIdx zti;
+	ZoomTask *parent;  // NULL for the top tile
+	int childnum;  // which of the parent's subtiles this is (in renderZoomTile order)
+
+	// these are only used if the task gets split
+	int pending;  // subtiles not finished yet
+	bool used;  // whether any of the subtiles actually had data
+	PartialTileStore::Entry *partial;  // the image being put together (NULL in test mode)
+
+	ZoomTask(const ZoomTileIdx& z, ZoomTask *p, int c) : zti(z), parent(p), childnum(c), pending(0), used(false), partial(NULL) {}
 };
 
-void *runWorkerThread(void *arg)
+// split tasks with more required base tiles than this
+#define TASKSPLITSIZE 16
+
+// work-stealing scheduler for the worker threads: each thread has its own deque of tasks, and works from the
+//  back of it (depth-first, so its chunk cache stays warm); when it runs dry, it steals from the front of
+//  someone else's deque, where the biggest remaining tasks are
+// ...since big tasks are split as they're reached, there's always something left to steal until the very
+//  end, and the threads finish within a few small tasks of each other
+struct WorkQueues : private nocopy
 {
-	WorkerThreadParams *wtp = (WorkerThreadParams*)arg;
-	for (vector<ZoomTileIdx>::const_iterator it = wtp->zoomtiles.begin(); it != wtp->zoomtiles.end(); it++)
+	vector<deque<ZoomTask*> > deques;  // one per thread
+	Mutex *locks;  // one per deque
+	arrayDeleter<Mutex> adlocks;
+
+	Mutex statelock;  // protects the rest of this stuff
+	Condition statecond;  // signalled when tasks are pushed or everything's done
+	int64_t outstanding;  // tasks that exist but haven't finished (split tasks finish when their subtiles do)
+	int64_t generation;  // bumped whenever tasks are pushed, so idle threads know to look again
+
+	PartialTileStore& partials;  // images of the split tasks
+
+	WorkQueues(int threads, PartialTileStore& pts) : deques(threads), locks(new Mutex[threads]), adlocks(locks), outstanding(0), generation(0), partials(pts) {}
+
+	// add the task for the top tile to the first thread's deque (only before the threads start)
+	void seed();
+
+	// get the next task for a thread: from the back of its own deque if possible, otherwise from the front
+	//  of another's; if there's nothing anywhere, wait until there is, or until all tasks are done (in which
+	//  case we return NULL)
+	ZoomTask* next(int thread);
+
+	// replace a task with tasks for its required subtiles, which go on the back of the thread's deque
+	void split(ZoomTask *task, int thread, RenderJob& rj);
+
+	// record the result of a task (and delete it), reducing its image into the parent's; if it was the last
+	//  subtile of its parent, write out the parent and finish it too, and so on up
+	// ...tile is the thread's scratch image, which holds the task's image to start with
+	void finish(ZoomTask *task, bool used, RGBAImage& tile, RenderJob& rj);
+};
+
+void WorkQueues::seed()
+{
+	deques[0].push_back(new ZoomTask(ZoomTileIdx(0,0,0), NULL, 0));
+	outstanding++;
+}
+
+ZoomTask* WorkQueues::next(int thread)
+{
+	int threads = deques.size();
+	while (true)
 	{
-		int idx = wtp->tocache->getIndex(*it);
-		wtp->tocache->used[idx] = renderZoomTile(*it, *wtp->rj, wtp->tocache->images[idx]);
+		int64_t gen;
+		{
+			MutexLocker ml(statelock);
+			if (outstanding == 0)
+				return NULL;
+			gen = generation;
+		}
+		// try our own deque, then everyone else's
+		for (int i = 0; i < threads; i++)
+		{
+			int t = (thread + i) % threads;
+			MutexLocker ml(locks[t]);
+			if (deques[t].empty())
+				continue;
+			ZoomTask *task;
+			if (t == thread)
+			{
+				task = deques[t].back();
+				deques[t].pop_back();
+			}
+			else
+			{
+				task = deques[t].front();
+				deques[t].pop_front();
+			}
+			return task;
+		}
+		// nothing anywhere, but some tasks are still running and may be split; wait for something to happen
+		MutexLocker ml(statelock);
+		while (outstanding > 0 && generation == gen)
+			statecond.wait(statelock);
 	}
-	return 0;
 }
 
-// see if there's enough available memory for some number of tile images
-// (...by just attempting to allocate it!)
-//!!!!!!! better way to do this?   maybe allow user to specify max memory for
-//         ThreadOutputCache instead?
-bool memoryAvailable(int tiles, const MapParams& mp)
+void WorkQueues::split(ZoomTask *task, int thread, RenderJob& rj)
 {
-	int64_t imgsize = mp.tileSize() * mp.tileSize();  // in pixels
-	try
+	ZoomTileIdx topleft = task->zti.toZoom(task->zti.zoom + 1);
+	ZoomTileIdx subzti[4] = {topleft, topleft.add(0,1), topleft.add(1,0), topleft.add(1,1)};
+	vector<ZoomTask*> subtasks;
+	for (int i = 0; i < 4; i++)
+		if (rj.tiletable->getNumRequired(subzti[i], rj.mp) > 0)
+			subtasks.push_back(new ZoomTask(subzti[i], task, i));
+	task->pending = subtasks.size();
+	if (!rj.testmode)
+		task->partial = partials.start(task->zti, rj, subtasks.size());
 	{
-		RGBAPixel *tempbuf = new RGBAPixel[imgsize * tiles];
-		delete[] tempbuf;
+		MutexLocker ml(statelock);
+		outstanding += subtasks.size();
 	}
-	catch (bad_alloc& ba)
 	{
-		return false;
+		// push them in reverse, so the top-left one is at the back, and we'll do it next
+		MutexLocker ml(locks[thread]);
+		for (vector<ZoomTask*>::reverse_iterator it = subtasks.rbegin(); it != subtasks.rend(); it++)
+			deques[thread].push_back(*it);
 	}
-	return true;
+	MutexLocker ml(statelock);
+	generation++;
+	statecond.broadcast();
 }
 
-// returns zoom level chosen for partitioning
-int assignThreadTasks(vector<WorkerThreadParams>& wtps, const TileTable& ttable, const MapParams& mp, int threads)
+void WorkQueues::finish(ZoomTask *task, bool used, RGBAImage& tile, RenderJob& rj)
 {
-	vector<ZoomTileIdx> best_reqzoomtiles;
-	vector<int64_t> best_costs;
-	vector<int> best_assignments;
-	double best_error = 1.1;
-	// start with zoom level 1 and go up from there
-	for (int zoom = 1; zoom <= mp.baseZoom; zoom++)
-	{
-		// find all zoom tiles at this level that need to be drawn (i.e. contain > 0 required base tiles),
-		//  and their costs (number of required base tiles)
-		vector<ZoomTileIdx> reqzoomtiles;
-		vector<int64_t> costs;
-		vector<int> assignments;
-		int64_t size = (1 << zoom);
-		ZoomTileIdx zti(-1, -1, zoom);
-		for (zti.x = 0; zti.x < size; zti.x++)
-			for (zti.y = 0; zti.y < size; zti.y++)
+	while (task != NULL)
+	{
+		ZoomTask *parent = task->parent;
+		// (this has to happen before the parent's pending count goes down; a subtile that came out empty in
+		//  an incremental update still has to clear whatever was there before)
+		if (parent != NULL && parent->partial != NULL && (used || !rj.fullrender))
+			partials.add(parent->partial, task->childnum, used ? &tile : NULL);
+		bool lastsubtile = false;
+		{
+			MutexLocker ml(statelock);
+			if (parent != NULL)
 			{
-				int numreq = ttable.getNumRequired(zti, mp);
-				if (numreq > 0)
-				{
-					reqzoomtiles.push_back(zti);
-					costs.push_back(numreq);
-				}
+				parent->used = parent->used || used;
+				lastsubtile = --parent->pending == 0;
 			}
-		// if there are too many tiles at this zoom level (that is, if the ThreadOutputCache wouldn't
-		//  fit in memory), then forget it (and those above it, too)
-		if (!memoryAvailable(reqzoomtiles.size(), mp))
-			break;
-		// compute a good schedule for this level and get its "error" (difference between max thread
-		//  cost and min thread cost, as a fraction of max thread cost)
-		pair<int64_t, double> error = schedule(costs, assignments, threads);
-		// if the error is less than 5%, or under 50 tiles (for small worlds), that's good enough
-		bool stop = error.second < 0.05 || error.first < 50;
-		// if this error is the best so far, remember these tiles/assignments
-		if (error.second < best_error || stop)
+			if (--outstanding == 0)
+				statecond.broadcast();
+		}
+		delete task;
+		if (!lastsubtile)
+			return;
+
+		// we finished the parent's last subtile, so the parent is ours to write out
+		used = parent->used;
+		if (parent->partial != NULL)
 		{
-			best_reqzoomtiles = reqzoomtiles;
-			best_costs = costs;
-			best_assignments = assignments;
-			best_error = error.second;
+			partials.take(parent->partial, tile);
+			used = finishZoomTile(parent->zti, rj, tile, used);
 		}
-		if (stop)
-			break;
+		task = parent;
 	}
+}
 
-	// perform actual assignments
-	for (int i = 0; i < best_assignments.size(); i++)
+struct WorkerThreadParams
+{
+	RenderJob *rj;
+	WorkQueues *workqueues;
+	int threadnum;
+};
+
+void *runWorkerThread(void *arg)
+{
+	WorkerThreadParams *wtp = (WorkerThreadParams*)arg;
+	RenderJob& rj = *wtp->rj;
+	RGBAImage tile;
+	for (ZoomTask *task = wtp->workqueues->next(wtp->threadnum); task != NULL; task = wtp->workqueues->next(wtp->threadnum))
 	{
-		wtps[best_assignments[i]].zoomtiles.push_back(best_reqzoomtiles[i]);
-		wtps[best_assignments[i]].rj->stats.reqtilecount += best_costs[i];
+		// split big tasks (leaving the pieces where other threads can get at them); render small ones
+		int64_t numreq = rj.tiletable->getNumRequired(task->zti, rj.mp);
+		if (task->zti.zoom < rj.mp.baseZoom && numreq > TASKSPLITSIZE)
+			wtp->workqueues->split(task, wtp->threadnum, rj);
+		else
+		{
+			bool used = renderZoomTile(task->zti, rj, tile);
+			rj.stats.reqtilecount += numreq;
+			wtp->workqueues->finish(task, used, tile, rj);
+		}
 	}
-
-	return best_reqzoomtiles.front().zoom;
+	return 0;
 }
 
 void runMultithreaded(RenderJob& rj, int threads)
 {
 	// create a separate RenderJob for each thread; each one gets its own copy of the parameters,
 	//  plus its own storage (caches, scenegraph, etc.)
+	// (if we're using a SharedChunkCache, it's in our RenderJob, and the threads all use it)
+	// ...the block images and the TileTable are shared too (threads only set drawn bits, which is safe), and
+	//  the threads' Chunk/RegionTables are built on top of ours, so they only hold that thread's disk states
 	RenderJob *rjs = new RenderJob[threads];
 	arrayDeleter<RenderJob> adrj(rjs);
 	for (int i = 0; i < threads; i++)
 	{
 		rjs[i].testmode = rj.testmode;
+		rjs[i].opts = rj.opts;
+		rjs[i].pngqueue = rj.pngqueue;
+		rjs[i].usecounts = rj.usecounts;
+		rjs[i].decodepool = rj.decodepool;
 		rjs[i].fullrender = rj.fullrender;
 		rjs[i].regionformat = rj.regionformat;
 		rjs[i].mp = rj.mp;
 		rjs[i].inputpath = rj.inputpath;
 		rjs[i].outputpath = rj.outputpath;
 		rjs[i].blockimages = rj.blockimages;
-		rjs[i].chunktable.reset(new ChunkTable);
-		rjs[i].chunktable->copyFrom(*rj.chunktable);
-		rjs[i].tiletable.reset(new TileTable);
-		rjs[i].tiletable->copyFrom(*rj.tiletable);
-		rjs[i].regiontable.reset(new RegionTable);
-		rjs[i].regiontable->copyFrom(*rj.regiontable);
+		rjs[i].chunktable.reset(new ChunkTable(rj.chunktable.get()));
+		rjs[i].regiontable.reset(new RegionTable(rj.regiontable.get()));
+		rjs[i].tiletable = rj.tiletable;
 		if (!rjs[i].testmode)
 		{
-			rjs[i].regioncache.reset(new RegionCache(*rjs[i].chunktable, *rjs[i].regiontable, rjs[i].inputpath, rjs[i].fullrender, rjs[i].stats.regioncache));
-			rjs[i].chunkcache.reset(new ChunkCache(*rjs[i].chunktable, *rjs[i].regiontable, *rjs[i].regioncache, rjs[i].inputpath, rjs[i].fullrender, rjs[i].regionformat, rjs[i].stats.chunkcache));
+			rjs[i].regioncache.reset(new RegionCache(*rjs[i].chunktable, *rjs[i].regiontable, rjs[i].inputpath, rjs[i].fullrender, rjs[i].stats.regioncache, rjs[i].opts.regioncachesize, rjs[i].opts.mmapregions));
+			rjs[i].chunkcache.reset(new ChunkCache(*rjs[i].chunktable, *rjs[i].regiontable, *rjs[i].regioncache, rjs[i].inputpath, rjs[i].fullrender, rjs[i].regionformat, rjs[i].stats.chunkcache, rjs[i].opts.chunkcachesize, rj.sharedchunkcache.get(), rj.opts.fusedinflate));
 			rjs[i].scenegraph.reset(new SceneGraph);
 		}
 		rjs[i].tilecache.reset(new TileCache(rjs[i].mp));
 	}
 
-	// divide the required tiles evenly among the threads: find a zoom level that has enough tiles for us
-	//  to make a balanced assignment, then give each thread some tiles from that level
-	vector<WorkerThreadParams> wtps(threads);
-	for (int i = 0; i < threads; i++)
-		wtps[i].rj = &rjs[i];
-	int threadzoom = assignThreadTasks(wtps, *rj.tiletable, rj.mp, threads);
-	for (int i = 0; i < threads; i++)
-		cout << "thread " << i << " will render " << rjs[i].stats.reqtilecount << " base tiles" << endl;
-
-	// allocate storage for the threads to store their rendered zoom tiles into
-	// (doesn't need to be synchronized, because threads only touch the images for their own
-	//  zoom tiles)
-	auto_ptr<ThreadOutputCache> tocache(new ThreadOutputCache(threadzoom));
-	for (int i = 0; i < threads; i++)
-	{
-		wtps[i].tocache = tocache.get();
-		for (vector<ZoomTileIdx>::const_iterator it = wtps[i].zoomtiles.begin(); it != wtps[i].zoomtiles.end(); it++)
-		{
-			int idx = tocache->getIndex(*it);
-			tocache->images[idx].create(rj.mp.tileSize(), rj.mp.tileSize());  // reserve the memory
-		}
-	}
+	// the first thread starts on the top tile, splitting it up; the rest steal the pieces
+	// (the zoom tiles they're putting together are held in memory up to the budget, and in a scratch file
+	//  in the output directory past that)
+	PartialTileStore partials(rj.mp, rj.opts.partialbudget, rj.outputpath + "/pigmap.scratch", rj.opts.alphaweighted);
+	WorkQueues workqueues(threads, partials);
+	workqueues.seed();
 
-	// run the threads; each one renders all the zoom tiles assigned to it
+	// run the threads; each one renders tiles until there are none left anywhere
 	cout << "running threads..." << endl;
+	vector<WorkerThreadParams> wtps(threads);
 	vector<pthread_t> pthrs(threads);
 	for (int i = 0; i < threads; i++)
 	{
+		wtps[i].rj = &rjs[i];
+		wtps[i].workqueues = &workqueues;
+		wtps[i].threadnum = i;
 		if (0 != pthread_create(&pthrs[i], NULL, runWorkerThread, (void*)&wtps[i]))
 			cerr << "failed to create thread!" << endl;
 	}
@@ -249,12 +340,10 @@ void runMultithreaded(RenderJob& rj, int threads)
 	{
 		pthread_join(pthrs[i], NULL);
 	}
-
-	// now that the threads are done, render the final zoom levels (the ones above the ThreadOutputCache level)
-	cout << "finishing top zoom levels..." << endl;
-	rj.tilecache.reset(new TileCache(rj.mp));
-	RGBAImage topimg;
-	renderZoomTile(ZoomTileIdx(0,0,0), rj, topimg, *tocache);
+	for (int i = 0; i < threads; i++)
+		cout << "thread " << i << " rendered " << rjs[i].stats.reqtilecount << " base tiles" << endl;
+	if (partials.spilled > 0)
+		cout << "zoom tiles written to scratch file " << partials.spilled << " times" << endl;
 
 	// combine the thread stats
 	for (int i = 0; i < threads; i++)
@@ -263,20 +352,9 @@ void runMultithreaded(RenderJob& rj, int threads)
 		rj.stats.regioncache += rjs[i].stats.regioncache;
 	}
 	rj.stats.heapusage = getHeapUsage();
-
-	// copy the drawn flags over from the thread TileTables (for the double-check)
-	for (RequiredTileIterator it(*rj.tiletable); !it.end; it.advance())
-	{
-		for (int i = 0; i < threads; i++)
-			if (rjs[i].tiletable->isDrawn(it.current))
-			{
-				rj.tiletable->setDrawn(it.current);
-				break;
-			}
-	}
 }
 
-bool expandMap(const string& outputpath)
+bool expandMap(const string& outputpath, bool alphaweighted)
 {
 	// read old params
 	MapParams mp;
@@ -323,7 +401,7 @@ bool expandMap(const string& outputpath)
 	new0img.create(tileSize, tileSize);
 	if (used0)
 	{
-		reduceHalf(new0img, ImageRect(tileSize/2, tileSize/2, tileSize/2, tileSize/2), old0img);
+		reduceHalf(new0img, ImageRect(tileSize/2, tileSize/2, tileSize/2, tileSize/2), old0img, alphaweighted);
 		new0img.writePNG(outputpath + "/0.png");
 	}
 	RGBAImage old1img;
@@ -332,7 +410,7 @@ bool expandMap(const string& outputpath)
 	new1img.create(tileSize, tileSize);
 	if (used1)
 	{
-		reduceHalf(new1img, ImageRect(0, tileSize/2, tileSize/2, tileSize/2), old1img);
+		reduceHalf(new1img, ImageRect(0, tileSize/2, tileSize/2, tileSize/2), old1img, alphaweighted);
 		new1img.writePNG(outputpath + "/1.png");
 	}
 	RGBAImage old2img;
@@ -341,7 +419,7 @@ bool expandMap(const string& outputpath)
 	new2img.create(tileSize, tileSize);
 	if (used2)
 	{
-		reduceHalf(new2img, ImageRect(tileSize/2, 0, tileSize/2, tileSize/2), old2img);
+		reduceHalf(new2img, ImageRect(tileSize/2, 0, tileSize/2, tileSize/2), old2img, alphaweighted);
 		new2img.writePNG(outputpath + "/2.png");
 	}
 	RGBAImage old3img;
@@ -350,7 +428,7 @@ bool expandMap(const string& outputpath)
 	new3img.create(tileSize, tileSize);
 	if (used3)
 	{
-		reduceHalf(new3img, ImageRect(0, 0, tileSize/2, tileSize/2), old3img);
+		reduceHalf(new3img, ImageRect(0, 0, tileSize/2, tileSize/2), old3img, alphaweighted);
 		new3img.writePNG(outputpath + "/3.png");
 	}
 
@@ -358,13 +436,13 @@ bool expandMap(const string& outputpath)
 	RGBAImage newbase;
 	newbase.create(tileSize, tileSize);
 	if (used0)
-		reduceHalf(newbase, ImageRect(0, 0, tileSize/2, tileSize/2), new0img);
+		reduceHalf(newbase, ImageRect(0, 0, tileSize/2, tileSize/2), new0img, alphaweighted);
 	if (used1)
-		reduceHalf(newbase, ImageRect(tileSize/2, 0, tileSize/2, tileSize/2), new1img);
+		reduceHalf(newbase, ImageRect(tileSize/2, 0, tileSize/2, tileSize/2), new1img, alphaweighted);
 	if (used2)
-		reduceHalf(newbase, ImageRect(0, tileSize/2, tileSize/2, tileSize/2), new2img);
+		reduceHalf(newbase, ImageRect(0, tileSize/2, tileSize/2, tileSize/2), new2img, alphaweighted);
 	if (used3)
-		reduceHalf(newbase, ImageRect(tileSize/2, tileSize/2, tileSize/2, tileSize/2), new3img);
+		reduceHalf(newbase, ImageRect(tileSize/2, tileSize/2, tileSize/2, tileSize/2), new3img, alphaweighted);
 	newbase.writePNG(outputpath + "/base.png");
 
 	// write new params (with incremented baseZoom)
@@ -405,7 +483,7 @@ void writeHTML(const RenderJob& rj, const string& htmlpath)
 	copyFile(htmlpath + "/style.css", rj.outputpath + "/style.css");
 }
 
-bool performRender(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, const string& chunklist, const string& regionlist, int threads, int testworldsize, bool expand, const string& htmlpath)
+bool performRender(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, const string& chunklist, const string& regionlist, int threads, int testworldsize, bool expand, const string& htmlpath, const RenderOptions& opts)
 {
 	time_t tstart = time(NULL);
 
@@ -414,22 +492,39 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	//  will handle it
 	RenderJob rj;
 	rj.testmode = testworldsize != -1;
+	rj.opts = opts;
 	rj.mp = mp;
 	rj.inputpath = inputpath;
 	rj.outputpath = outputpath;
-	if (!rj.blockimages.create(rj.mp.B, imgpath))
+	BlockImages blockimages;
+	if (!blockimages.create(rj.mp.B, imgpath))
 	{
 		cerr << "no block images available; aborting render" << endl;
 		return false;
 	}
+	if (rj.opts.premultiplied)
+		blockimages.premultiply();
+	rj.blockimages = &blockimages;
 	rj.chunktable.reset(new ChunkTable);
-	rj.tiletable.reset(new TileTable);
+	auto_ptr<TileTable> tiletable(new TileTable);
+	rj.tiletable = tiletable.get();
 	rj.regiontable.reset(new RegionTable);
 	rj.regionformat = !rj.testmode && detectRegionFormat(rj.inputpath);
 	if (rj.regionformat)
 		cout << "region-format world detected" << endl;
 	else
 		cout << "no regions detected; assuming chunk-format world" << endl;
+	// chunk timestamps to be saved for the next automatic update (region format only), and the ones from
+	//  the last render, if this is an automatic update
+	ChunkTimestamps timestamps, oldtimestamps;
+	bool savetimestamps = false;
+	// which chunks each region file had when we last read it, so unchanged ones needn't be read again
+	//  (saved along with the timestamps)
+	RegionIndex regionindex;
+	// the required chunks and tiles from the last full render (region format only), and whether to save
+	//  them for the next one
+	TableSnapshot snapshot;
+	bool savesnapshot = false;
 
 	// test world
 	if (testworldsize != -1)
@@ -439,18 +534,22 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		makeTestWorld(testworldsize, *rj.chunktable, *rj.tiletable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount);
 	}
 	// full render
-	else if (chunklist.empty() && regionlist.empty())
+	else if (chunklist.empty() && regionlist.empty() && !rj.opts.autoupdate)
 	{
 		rj.fullrender = true;
 		cout << "scanning world data..." << endl;
 		if (rj.regionformat)
 		{
-			if (!makeAllRegionsRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount))
+			if (oldtimestamps.readFile(rj.outputpath))
+				regionindex.readFile(rj.outputpath);
+			snapshot.readFile(rj.outputpath, rj.mp);
+			if (!makeAllRegionsRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &timestamps, threads, &regionindex, &oldtimestamps, &snapshot))
 				return false;
+			savetimestamps = savesnapshot = true;
 		}
 		else
 		{
-			if (!makeAllChunksRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount))
+			if (!makeAllChunksRequired(rj.inputpath, *rj.chunktable, *rj.tiletable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, threads))
 				return false;
 		}
 	}
@@ -459,10 +558,30 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	{
 		rj.fullrender = false;
 		int rv;
-		if (rj.regionformat)
+		// (keep the index as it was, in case we have to start over)
+		RegionIndex firstindex;
+		if (rj.opts.autoupdate)
 		{
+			if (!oldtimestamps.readFile(rj.outputpath))
+			{
+				cerr << "pigmap.timestamps missing or corrupt; can't use -a until after a full render" << endl;
+				return false;
+			}
+			regionindex.readFile(rj.outputpath);
+			firstindex = regionindex;
+			cout << "checking chunk timestamps..." << endl;
+			rv = findChangedChunks(rj.inputpath, oldtimestamps, timestamps, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &regionindex);
+			savetimestamps = true;
+		}
+		else if (rj.regionformat)
+		{
+			// if we've got timestamps from before, keep them up to date for the regions that we're redoing
+			savetimestamps = timestamps.readFile(rj.outputpath);
+			if (savetimestamps)
+				regionindex.readFile(rj.outputpath);
+			firstindex = regionindex;
 			cout << "processing regionlist..." << endl;
-			rv = readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount);
+			rv = readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &timestamps, &regionindex);
 		}
 		else
 		{
@@ -474,16 +593,26 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 		// if we failed because baseZoom is too small, and -x was specified, expand the world and try once more
 		if (rv == -1 && expand)
 		{
-			if (!expandMap(rj.outputpath))
+			// (the existing tiles have straight alpha; weighting by alpha gives the same result as premultiplying)
+			if (!expandMap(rj.outputpath, rj.opts.alphaweighted || rj.opts.premultiplied))
 				return false;
 			rj.mp.baseZoom++;
 			cout << "baseZoom of output map has been increased to " << rj.mp.baseZoom << endl;
 			rj.chunktable.reset(new ChunkTable);
-			rj.tiletable.reset(new TileTable);
+			tiletable.reset(new TileTable);
+			rj.tiletable = tiletable.get();
 			rj.regiontable.reset(new RegionTable);
-			if (rj.regionformat)
+			rj.stats.reqchunkcount = 0;
+			regionindex = firstindex;
+			if (rj.opts.autoupdate)
 			{
-				if (0 != readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount))
+				timestamps.regions.clear();
+				if (0 != findChangedChunks(rj.inputpath, oldtimestamps, timestamps, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &regionindex))
+					return false;
+			}
+			else if (rj.regionformat)
+			{
+				if (0 != readRegionlist(regionlist, rj.inputpath, *rj.chunktable, *rj.tiletable, *rj.regiontable, rj.mp, rj.stats.reqchunkcount, rj.stats.reqtilecount, rj.stats.reqregioncount, &timestamps, &regionindex))
 					return false;
 			}
 			else
@@ -497,15 +626,56 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	if (rj.stats.reqtilecount == 0)
 	{
 		cout << "nothing to do!  (no required tiles)" << endl;
+		if (savetimestamps && !rj.testmode)
+		{
+			timestamps.writeFile(rj.outputpath);
+			regionindex.writeFile(rj.outputpath);
+		}
 		return true;
 	}
 
 	// render stuff
+	// (if there are PNG encoder threads, make sure they've finished writing everything before we go on)
 	cout << "rendering tiles..." << endl;
+	auto_ptr<PNGWriteQueue> pngqueue;
+	if (!rj.testmode && rj.opts.encodethreads > 0)
+	{
+		pngqueue.reset(new PNGWriteQueue(rj.opts.encodethreads, rj.opts.encodethreads * 4, rj.opts.pngprofile, rj.opts.premultiplied));
+		// (if none of its threads started, write the tiles ourselves)
+		if (pngqueue->pthrs.empty())
+			pngqueue.reset();
+		rj.pngqueue = pngqueue.get();
+	}
+	// (the decoder threads need to know which chunks each tile uses, even if the shared cache doesn't)
+	auto_ptr<ChunkUseCounts> usecounts;
+	if (!rj.testmode && (rj.opts.evictbyuse || rj.opts.decodethreads > 0))
+	{
+		usecounts.reset(new ChunkUseCounts);
+		usecounts->build(*rj.chunktable, *rj.tiletable, rj.mp);
+		if (rj.opts.evictbyuse)
+			rj.usecounts = usecounts.get();
+	}
+	if (!rj.testmode && rj.opts.sharedcachesize > 0)
+		rj.sharedchunkcache.reset(new SharedChunkCache(*rj.chunktable, rj.fullrender, rj.opts.sharedcachesize, rj.usecounts));
+	auto_ptr<ChunkDecodePool> decodepool;
+	if (!rj.testmode && rj.opts.decodethreads > 0)
+	{
+		decodepool.reset(new ChunkDecodePool(rj.opts.decodethreads, rj, *usecounts));
+		if (decodepool->pthrs.empty())
+			decodepool.reset();
+		rj.decodepool = decodepool.get();
+	}
 	if (threads >= 2)
 		runMultithreaded(rj, threads);
 	else
 		runSingleThread(rj);
+	if (decodepool.get() != NULL)
+		decodepool->addStats(rj.stats);
+	decodepool.reset();
+	rj.decodepool = NULL;
+	pngqueue.reset();
+	rj.pngqueue = NULL;
+	rj.usecounts = NULL;
 
 	// double-check that all the required tiles were drawn
 	cout << "performing double-check..." << endl;
@@ -520,6 +690,16 @@ bool performRender(const string& inputpath, const string& outputpath, const stri
 	{
 		rj.mp.writeFile(rj.outputpath);
 		writeHTML(rj, htmlpath);
+		if (savetimestamps)
+		{
+			timestamps.writeFile(rj.outputpath);
+			regionindex.writeFile(rj.outputpath);
+		}
+		if (savesnapshot)
+		{
+			snapshot.take(*rj.chunktable, *rj.tiletable, rj.mp);
+			snapshot.writeFile(rj.outputpath);
+		}
 	}
 
 	// done; print stats
@@ -793,6 +973,210 @@ void testResize()
 	}
 }
 
+void testBlend()
+{
+	// try every combination of source and dest alpha, with random colors, at an odd row length so the
+	//  leftovers get done too; each SIMD implementation must match blend() exactly
+	const char *names[] = {"scalar", "SSE2", "AVX2"};
+	int best = getBlendImpl();
+	vector<RGBAPixel> sources, dests;
+	for (int sa = 0; sa < 256; sa++)
+		for (int da = 0; da < 256; da++)
+		{
+			sources.push_back(makeRGBA(rand() % 256, rand() % 256, rand() % 256, sa));
+			dests.push_back(makeRGBA(rand() % 256, rand() % 256, rand() % 256, da));
+		}
+	// also some runs of all-transparent and all-opaque source pixels, to hit the shortcuts
+	for (int i = 0; i < 64; i++)
+	{
+		sources.push_back(makeRGBA(rand() % 256, rand() % 256, rand() % 256, (i & 16) ? 255 : 0));
+		dests.push_back(makeRGBA(rand() % 256, rand() % 256, rand() % 256, rand() % 256));
+	}
+	sources.push_back(0xff123456);
+	dests.push_back(0x80654321);
+	vector<RGBAPixel> expected = dests;
+	for (size_t i = 0; i < sources.size(); i++)
+		blend(expected[i], sources[i]);
+	for (int impl = BLEND_SCALAR; impl <= BLEND_AVX2; impl++)
+	{
+		if (!setBlendImpl(impl))
+		{
+			cout << names[impl] << ": not supported" << endl;
+			continue;
+		}
+		vector<RGBAPixel> result = dests;
+		blendRow(&result[0], &sources[0], result.size());
+		int mismatches = 0;
+		for (size_t i = 0; i < result.size(); i++)
+			if (result[i] != expected[i])
+			{
+				if (mismatches++ < 10)
+					cout << names[impl] << " mismatch: source " << hex << sources[i] << " dest " << dests[i] << " expected " << expected[i] << " got " << result[i] << dec << endl;
+			}
+		cout << names[impl] << ": " << mismatches << " mismatches out of " << result.size() << endl;
+	}
+	// ...and the same for the premultiplied versions
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		sources[i] = premultiply(sources[i]);
+		dests[i] = premultiply(dests[i]);
+	}
+	expected = dests;
+	for (size_t i = 0; i < sources.size(); i++)
+		blendPremultiplied(expected[i], sources[i]);
+	for (int impl = BLEND_SCALAR; impl <= BLEND_AVX2; impl++)
+	{
+		if (!setBlendImpl(impl))
+			continue;
+		vector<RGBAPixel> result = dests;
+		blendRowPremultiplied(&result[0], &sources[0], result.size());
+		int mismatches = 0;
+		for (size_t i = 0; i < result.size(); i++)
+			if (result[i] != expected[i])
+			{
+				if (mismatches++ < 10)
+					cout << names[impl] << " premultiplied mismatch: source " << hex << sources[i] << " dest " << dests[i] << " expected " << expected[i] << " got " << result[i] << dec << endl;
+			}
+		cout << names[impl] << " premultiplied: " << mismatches << " mismatches out of " << result.size() << endl;
+	}
+	setBlendImpl(best);
+}
+
+void testReduce()
+{
+	// random images (with lots of fully transparent and opaque pixels, and a width that leaves leftovers for
+	//  the scalar code), reduced by each implementation in both modes; everything must match a
+	//  straightforward per-channel computation exactly
+	const char *names[] = {"scalar", "SSE2", "AVX2"};
+	int best = getBlendImpl();
+	RGBAImage source;
+	source.create(2 * 45, 2 * 37);
+	for (vector<RGBAPixel>::iterator it = source.data.begin(); it != source.data.end(); it++)
+	{
+		int a = rand() % 3 == 0 ? 0 : (rand() % 3 == 0 ? 255 : rand() % 256);
+		*it = makeRGBA(rand() % 256, rand() % 256, rand() % 256, a);
+	}
+	for (int weighted = 0; weighted < 2; weighted++)
+	{
+		RGBAImage expected;
+		expected.create(45, 37);
+		for (int y = 0; y < expected.h; y++)
+			for (int x = 0; x < expected.w; x++)
+			{
+				const RGBAPixel p[4] = {source(2*x, 2*y), source(2*x+1, 2*y), source(2*x, 2*y+1), source(2*x+1, 2*y+1)};
+				int asum = 0, sums[3] = {0, 0, 0}, wsums[3] = {0, 0, 0};
+				for (int i = 0; i < 4; i++)
+				{
+					int c[3] = {(int)RED(p[i]), (int)GREEN(p[i]), (int)BLUE(p[i])};
+					asum += ALPHA(p[i]);
+					for (int j = 0; j < 3; j++)
+					{
+						sums[j] += c[j];
+						wsums[j] += c[j] * ALPHA(p[i]);
+					}
+				}
+				int c[3];
+				for (int j = 0; j < 3; j++)
+					c[j] = weighted ? (asum == 0 ? 0 : (int)floor((double)wsums[j] / asum + 0.5)) : (sums[j] + 2) / 4;
+				expected(x, y) = (weighted && asum == 0) ? 0 : makeRGBA(c[0], c[1], c[2], (asum + 2) / 4);
+			}
+		for (int impl = BLEND_SCALAR; impl <= BLEND_AVX2; impl++)
+		{
+			if (!setBlendImpl(impl))
+			{
+				cout << names[impl] << ": not supported" << endl;
+				continue;
+			}
+			RGBAImage result;
+			result.create(45 + 3, 37);
+			reduceHalf(result, ImageRect(3, 0, 45, 37), source, weighted);
+			int mismatches = 0;
+			for (int y = 0; y < expected.h; y++)
+				for (int x = 0; x < expected.w; x++)
+					if (result(x + 3, y) != expected(x, y) && mismatches++ < 10)
+						cout << names[impl] << (weighted ? " weighted" : "") << " mismatch at " << x << "," << y << ": expected " << hex << expected(x, y) << " got " << result(x + 3, y) << dec << endl;
+			cout << names[impl] << (weighted ? " weighted" : "") << ": " << mismatches << " mismatches out of " << expected.w * expected.h << endl;
+		}
+	}
+	setBlendImpl(best);
+}
+
+// draw the first few hundred required base tiles of a world both with the DAG and in depth order (-d), and
+//  report any pixels that come out different; tiles are written to outputpath (each one twice)
+void testDepthOrder(const string& inputpath, const string& outputpath, const string& imgpath)
+{
+	MapParams mp(6,1,-1);
+	BlockImages blockimages;
+	if (!blockimages.create(mp.B, imgpath))
+	{
+		cout << "no block images available" << endl;
+		return;
+	}
+	RenderJob rjs[2];
+	auto_ptr<TileTable> tiletables[2];
+	for (int i = 0; i < 2; i++)
+	{
+		rjs[i].testmode = false;
+		rjs[i].fullrender = true;
+		rjs[i].regionformat = detectRegionFormat(inputpath);
+		rjs[i].opts.depthorder = i == 1;
+		rjs[i].inputpath = inputpath;
+		rjs[i].outputpath = outputpath;
+		rjs[i].blockimages = &blockimages;
+		tiletables[i].reset(new TileTable);
+		rjs[i].tiletable = tiletables[i].get();
+	}
+	// scan the world once; the second job gets a copy of the required tiles, and builds its chunk/region
+	//  tables on top of the first one's, as the render threads do
+	rjs[0].chunktable.reset(new ChunkTable);
+	rjs[0].regiontable.reset(new RegionTable);
+	int64_t reqchunkcount = 0, reqtilecount = 0, reqregioncount = 0;
+	if (rjs[0].regionformat ? !makeAllRegionsRequired(inputpath, *rjs[0].chunktable, *rjs[0].tiletable, *rjs[0].regiontable, mp, reqchunkcount, reqtilecount, reqregioncount)
+	                        : !makeAllChunksRequired(inputpath, *rjs[0].chunktable, *rjs[0].tiletable, mp, reqchunkcount, reqtilecount))
+		return;
+	vector<uint32_t> words;
+	rjs[0].tiletable->saveRequired(words);
+	rjs[1].tiletable->loadRequired(words);
+	rjs[1].chunktable.reset(new ChunkTable(rjs[0].chunktable.get()));
+	rjs[1].regiontable.reset(new RegionTable(rjs[0].regiontable.get()));
+	for (int i = 0; i < 2; i++)
+	{
+		rjs[i].mp = mp;
+		rjs[i].regioncache.reset(new RegionCache(*rjs[i].chunktable, *rjs[i].regiontable, inputpath, true, rjs[i].stats.regioncache, rjs[i].opts.regioncachesize));
+		rjs[i].chunkcache.reset(new ChunkCache(*rjs[i].chunktable, *rjs[i].regiontable, *rjs[i].regioncache, inputpath, true, rjs[i].regionformat, rjs[i].stats.chunkcache, rjs[i].opts.chunkcachesize));
+		rjs[i].scenegraph.reset(new SceneGraph);
+	}
+
+	RGBAImage tiles[2];
+	int tilecount = 0, badtiles = 0;
+	int64_t badpixels = 0;
+	for (RequiredTileIterator it(*tiletables[0]); !it.end && tilecount < 500; it.advance(), tilecount++)
+	{
+		TileIdx ti = it.current.toTileIdx();
+		bool drawn[2];
+		for (int i = 0; i < 2; i++)
+			drawn[i] = renderTile(ti, rjs[i], tiles[i]);
+		if (drawn[0] != drawn[1])
+		{
+			cout << "tile [" << ti.x << "," << ti.y << "] was drawn only " << (drawn[0] ? "with the DAG" : "in depth order") << endl;
+			badtiles++;
+			continue;
+		}
+		if (!drawn[0])
+			continue;
+		int mismatches = 0;
+		for (size_t j = 0; j < tiles[0].data.size(); j++)
+			if (tiles[0].data[j] != tiles[1].data[j] && mismatches++ < 3)
+				cout << "tile [" << ti.x << "," << ti.y << "] mismatch at " << j % tiles[0].w << "," << j / tiles[0].w << ": DAG " << hex << tiles[0].data[j] << " depth order " << tiles[1].data[j] << dec << endl;
+		if (mismatches > 0)
+		{
+			badtiles++;
+			badpixels += mismatches;
+		}
+	}
+	cout << "depth order: " << badtiles << " of " << tilecount << " tiles differ (" << badpixels << " pixels)" << endl;
+}
+
 //-------------------------------------------------------------------------------------------------------------------
 
 bool validateParamsFull(const string& inputpath, const string& outputpath, const string& imgpath, const MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath)
@@ -855,7 +1239,7 @@ bool validateParamsFull(const string& inputpath, const string& outputpath, const
 }
 
 // also sets MapParams to values from existing map
-bool validateParamsIncremental(const string& inputpath, const string& outputpath, const string& imgpath, MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath)
+bool validateParamsIncremental(const string& inputpath, const string& outputpath, const string& imgpath, MapParams& mp, int threads, const string& chunklist, const string& regionlist, bool expand, const string& htmlpath, bool autoupdate)
 {
 	// -B, -T, -Z, -y, -Y are not allowed
 	if (mp.B != -1 || mp.T != -1 || mp.baseZoom != -1 || mp.userMinY || mp.userMaxY)
@@ -888,8 +1272,22 @@ bool validateParamsIncremental(const string& inputpath, const string& outputpath
 		return false;
 	}
 
+	// automatic updates find their own chunks, and only work for region-format worlds
+	if (autoupdate)
+	{
+		if (!chunklist.empty() || !regionlist.empty())
+		{
+			cerr << "-c, -r not allowed with -a" << endl;
+			return false;
+		}
+		if (!detectRegionFormat(inputpath))
+		{
+			cerr << "-a only works for region-format worlds; must use -c" << endl;
+			return false;
+		}
+	}
 	// if world is in region format, must use regionlist
-	if (detectRegionFormat(inputpath) && regionlist.empty())
+	else if (detectRegionFormat(inputpath) && regionlist.empty())
 	{
 		cerr << "world is in region format; must use -r, not -c" << endl;
 		return false;
@@ -969,6 +1367,61 @@ bool validateParamsTest(const string& inputpath, const string& outputpath, const
 	return true;
 }
 
+bool validateOptions(const RenderOptions& opts)
+{
+	if (opts.sharedcachesize < 0)
+	{
+		cerr << "shared chunk cache size (-s) must be at least 1 (MB)" << endl;
+		return false;
+	}
+	if (opts.chunkcachesize < 0)
+	{
+		cerr << "chunk cache size (-C) must be at least 1 (MB)" << endl;
+		return false;
+	}
+	if (opts.regioncachesize < 0)
+	{
+		cerr << "region cache size (-R) must be at least 1 (MB)" << endl;
+		return false;
+	}
+	if (opts.partialbudget < 0)
+	{
+		cerr << "zoom tile memory budget (-k) must be at least 0 (MB)" << endl;
+		return false;
+	}
+	if (opts.alphaweighted && opts.premultiplied)
+	{
+		cerr << "premultiplied tiles (-p) are already reduced with alpha weighting; -A can't be used with it" << endl;
+		return false;
+	}
+	if (opts.evictbyuse && opts.sharedcachesize == 0)
+	{
+		cerr << "use-count eviction (-b) only applies to the shared chunk cache; -s is required" << endl;
+		return false;
+	}
+	if (opts.decodethreads < 0 || opts.decodethreads > 64)
+	{
+		cerr << "number of chunk decoder threads (-j) must be in range 0-64" << endl;
+		return false;
+	}
+	if (opts.decodethreads > 0 && opts.sharedcachesize == 0)
+	{
+		cerr << "chunk decoder threads (-j) load chunks into the shared chunk cache; -s is required" << endl;
+		return false;
+	}
+	if (opts.encodethreads < 0 || opts.encodethreads > 64)
+	{
+		cerr << "number of PNG encoder threads (-e) must be in range 0-64" << endl;
+		return false;
+	}
+	if (!PNGEncoder::validProfile(opts.pngprofile))
+	{
+		cerr << "PNG profile (-z) must be default, fast, or small" << endl;
+		return false;
+	}
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	//testMath();
@@ -984,15 +1437,19 @@ int main(int argc, char **argv)
 	//testTileIdxs();
 	//testReqTileCount(inputpath);
 	//testResize();
+	//testBlend();
+	//testReduce();
+	//testDepthOrder(inputpath, outputpath, imgpath);
 
 	string inputpath, outputpath, imgpath = ".", chunklist, regionlist, htmlpath = ".";
 	MapParams mp(-1,-1,-1);
 	int threads = 1;
 	int testworldsize = -1;
 	bool expand = false;
+	RenderOptions opts;
 
 	int c;
-	while ((c = getopt(argc, argv, "i:o:g:c:B:T:Z:h:w:xm:r:y:Y:")) != -1)
+	while ((c = getopt(argc, argv, "i:o:g:c:B:T:Z:h:w:xm:r:y:Y:s:Made:z:fbC:R:j:k:Ap")) != -1)
 	{
 		switch (c)
 		{
@@ -1040,6 +1497,54 @@ int main(int argc, char **argv)
 			case 'w':
 				testworldsize = atoi(optarg);
 				break;
+			case 's':
+				opts.sharedcachesize = (int64_t)atoi(optarg) * 1048576;
+				if (opts.sharedcachesize <= 0)
+					opts.sharedcachesize = -1;  // so validateOptions will complain
+				break;
+			case 'M':
+				opts.mmapregions = true;
+				break;
+			case 'a':
+				opts.autoupdate = true;
+				break;
+			case 'd':
+				opts.depthorder = true;
+				break;
+			case 'e':
+				opts.encodethreads = atoi(optarg);
+				break;
+			case 'z':
+				opts.pngprofile = optarg;
+				break;
+			case 'f':
+				opts.fusedinflate = true;
+				break;
+			case 'b':
+				opts.evictbyuse = true;
+				break;
+			case 'j':
+				opts.decodethreads = atoi(optarg);
+				break;
+			case 'C':
+				opts.chunkcachesize = (int64_t)atoi(optarg) * 1048576;
+				if (opts.chunkcachesize <= 0)
+					opts.chunkcachesize = -1;  // so validateOptions will complain
+				break;
+			case 'R':
+				opts.regioncachesize = (int64_t)atoi(optarg) * 1048576;
+				if (opts.regioncachesize <= 0)
+					opts.regioncachesize = -1;
+				break;
+			case 'A':
+				opts.alphaweighted = true;
+				break;
+			case 'p':
+				opts.premultiplied = true;
+				break;
+			case 'k':
+				opts.partialbudget = (int64_t)atoi(optarg) * 1048576;
+				break;
 			case '?':
 				cerr << "-" << (char)optopt << ": unrecognized option or missing argument" << endl;
 				return 1;
@@ -1054,18 +1559,21 @@ int main(int argc, char **argv)
 		if (!validateParamsTest(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, testworldsize))
 			return 1;
 	}
-	else if (chunklist.empty() && regionlist.empty())
+	else if (chunklist.empty() && regionlist.empty() && !opts.autoupdate)
 	{
 		if (!validateParamsFull(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath))
 			return 1;
 	}
 	else
 	{
-		if (!validateParamsIncremental(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath))
+		if (!validateParamsIncremental(inputpath, outputpath, imgpath, mp, threads, chunklist, regionlist, expand, htmlpath, opts.autoupdate))
 			return 1;
 	}
 
-	if (!performRender(inputpath, outputpath, imgpath, mp, chunklist, regionlist, threads, testworldsize, expand, htmlpath))
+	if (!validateOptions(opts))
+		return 1;
+
+	if (!performRender(inputpath, outputpath, imgpath, mp, chunklist, regionlist, threads, testworldsize, expand, htmlpath, opts))
 		return 1;
 
 	return 0;
@@ -18,6 +18,10 @@
 #include <stdio.h>
 #include <iostream>
 #include <stdlib.h>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "region.h"
 #include "utils.h"
@@ -47,14 +51,28 @@ FILE* openRegionFile(const RegionIdx& ri, const string& inputpath, bool& anvil)
 	return fopen(filename.c_str(), "rb");
 }
 
+void RegionFileReader::unmap()
+{
+	if (mapping != NULL)
+		munmap(mapping, maplength);
+	mapping = NULL;
+	maplength = 0;
+}
+
 int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
 {
+	// forget the previous file's mapping, if it had one
+	unmap();
+
 	// open file
 	FILE *f = openRegionFile(ri, inputpath, anvil);
 	if (f == NULL)
 		return -1;
 	fcloser fc(f);
 
+	if (usemmap)
+		return mapFile(f);
+
 	// get file length
 	fseek(f, 0, SEEK_END);
 	size_t length = (size_t)ftell(f);
@@ -68,6 +86,8 @@ int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
 		return -2;
 
 	// read the rest of the file
+	if (chunkdata.capacity() < 8388608)
+		chunkdata.reserve(8388608);
 	chunkdata.resize(length - 4096);
 	if (length > 4096)
 	{
@@ -78,6 +98,26 @@ int RegionFileReader::loadFromFile(const RegionIdx& ri, const string& inputpath)
 	return 0;
 }
 
+int RegionFileReader::mapFile(FILE *f)
+{
+	// we won't be needing any read buffer
+	vector<uint8_t>().swap(chunkdata);
+
+	struct stat st;
+	if (0 != fstat(fileno(f), &st) || st.st_size < 4096)
+		return -2;
+	void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (m == MAP_FAILED)
+		return -2;
+	// (the mapping stays valid after the file is closed)
+	mapping = (uint8_t*)m;
+	maplength = (size_t)st.st_size;
+
+	// copy the header, so the offsets are accessed the same way as when reading
+	copy(mapping, mapping + 4096, (uint8_t*)&(offsets[0]));
+	return 0;
+}
+
 int RegionFileReader::loadHeaderOnly(const RegionIdx& ri, const string& inputpath)
 {
 	// open file
@@ -90,24 +130,46 @@ int RegionFileReader::loadHeaderOnly(const RegionIdx& ri, const string& inputpat
 	size_t count = fread(&(offsets[0]), 4096, 1, f);
 	if (count < 1)
 		return -2;
+	// ...and the timestamps, if they're there
+	count = fread(&(timestamps[0]), 4096, 1, f);
+	if (count < 1)
+		fill(timestamps.begin(), timestamps.end(), 0);
 
 	return 0;
 }
 
-int RegionFileReader::decompressChunk(const ChunkOffset& co, vector<uint8_t>& buf)
+int RegionFileReader::getCompressedChunk(const ChunkOffset& co, const uint8_t*& data, size_t& length)
 {
 	// see if chunk is present
 	if (!containsChunk(co))
 		return -1;
 
-	// attempt to decompress chunk data into buffer
+	// make sure the offset and length are sane before touching the data; a bad header could
+	//  otherwise send us outside the file (or the mapping)
+	// ...chunkdata (or the part of the mapping after the header) starts at sector 1
 	int idx = getIdx(co);
 	uint32_t sector = getSectorOffset(idx);
-	if ((sector - 1) * 4096 >= chunkdata.size())
+	size_t datalength = (mapping != NULL) ? maplength - 4096 : chunkdata.size();
+	if (sector < 1 || (size_t)(sector - 1) * 4096 + 5 > datalength)
 		return -2;
-	uint8_t *chunkstart = &(chunkdata[(sector - 1) * 4096]);
-	uint32_t datasize = fromBigEndian(*((uint32_t*)chunkstart));
-	bool okay = readGzOrZlib(chunkstart + 5, datasize - 1, buf);
+	const uint8_t *chunkstart = ((mapping != NULL) ? mapping + 4096 : &(chunkdata[0])) + (size_t)(sector - 1) * 4096;
+	uint32_t datasize = fromBigEndian(*((const uint32_t*)chunkstart));
+	if (datasize < 1 || datasize > datalength - (size_t)(sector - 1) * 4096 - 4)
+		return -2;
+	// (skip the length and the compression type byte)
+	data = chunkstart + 5;
+	length = datasize - 1;
+	return 0;
+}
+
+int RegionFileReader::decompressChunk(const ChunkOffset& co, vector<uint8_t>& buf)
+{
+	const uint8_t *data;
+	size_t length;
+	int result = getCompressedChunk(co, data, length);
+	if (result != 0)
+		return result;
+	bool okay = readGzOrZlib(const_cast<uint8_t*>(data), length, buf);
 	if (!okay)
 		return -2;
 	return 0;
@@ -157,14 +219,31 @@ RegionCacheStats& RegionCacheStats::operator+=(const RegionCacheStats& rcs)
 	missing += rcs.missing;
 	reqmissing += rcs.reqmissing;
 	corrupt += rcs.corrupt;
+	conflict += rcs.conflict;
+	capacity += rcs.capacity;
 	return *this;
 }
 
 
 int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& buf, bool& anvil)
+{
+	RegionFileReader *rf = findRegion(ci, anvil);
+	if (rf == NULL)
+		return -1;
+	return rf->decompressChunk(ci.toChunkIdx(), buf);
+}
+
+int RegionCache::getCompressedChunk(const PosChunkIdx& ci, const uint8_t*& data, size_t& length, bool& anvil)
+{
+	RegionFileReader *rf = findRegion(ci, anvil);
+	if (rf == NULL)
+		return -1;
+	return rf->getCompressedChunk(ci.toChunkIdx(), data, length);
+}
+
+RegionFileReader* RegionCache::findRegion(const PosChunkIdx& ci, bool& anvil)
 {
 	PosRegionIdx ri = ci.toChunkIdx().getRegionIdx();
-	int e = getEntryNum(ri);
 	int state = regiontable.getDiskState(ri);
 	
 	if (state == RegionSet::REGION_UNKNOWN)
@@ -178,26 +257,23 @@ int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& bu
 		// actually, it shouldn't even be possible to get here, since the disk state
 		//  flags for all chunks in the region should have been set the first time we failed
 		cerr << "cache invariant failure!  tried to read already-failed region" << endl;
-		return -1;
+		return NULL;
 	}
 	
 	// if the region is in the cache, try to extract the chunk from it
 	if (state == RegionSet::REGION_CACHED)
 	{
-		// try the "real" cache entry, then the extra readbuf
-		if (entries[e].ri == ri)
-		{
-			anvil = entries[e].regionfile.anvil;
-			return entries[e].regionfile.decompressChunk(ci.toChunkIdx(), buf);
-		}
-		else if (readbuf.ri == ri)
+		// try the "real" cache entries, then the extra readbuf
+		RegionCacheEntry *entry = getEntry(ri);
+		if (entry != NULL)
 		{
-			anvil = readbuf.regionfile.anvil;
-			return readbuf.regionfile.decompressChunk(ci.toChunkIdx(), buf);
+			entry->lastused = ++clock;
+			anvil = entry->regionfile.anvil;
+			return &entry->regionfile;
 		}
-		// if it wasn't in one of those two places, it shouldn't have been marked as cached
+		// if it wasn't in one of those places, it shouldn't have been marked as cached
 		cerr << "grievous region cache failure!" << endl;
-		cerr << "[" << ri.x << "," << ri.z << "]   [" << entries[e].ri.x << "," << entries[e].ri.z << "]   [" << readbuf.ri.x << "," << readbuf.ri.z << "]" << endl;
+		cerr << "[" << ri.x << "," << ri.z << "]   [" << readbuf.ri.x << "," << readbuf.ri.z << "]" << endl;
 		exit(-1);
 	}
 
@@ -209,10 +285,15 @@ int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& bu
 		regiontable.setDiskState(ri, RegionSet::REGION_MISSING);
 		for (RegionChunkIterator it(ri.toRegionIdx()); !it.end; it.advance())
 			chunktable.setDiskState(it.current, ChunkSet::CHUNK_MISSING);
-		return -1;
+		return NULL;
 	}
 	
 	// okay, we actually have to read the region from disk, if it's there
+	int eviction = regiontable.getEviction(ri);
+	if (eviction == RegionSet::EVICTED_CONFLICT)
+		stats.conflict++;
+	else if (eviction == RegionSet::EVICTED_CAPACITY)
+		stats.capacity++;
 	readRegionFile(ri);
 	
 	// check whether the read succeeded; try to extract the chunk if so
@@ -220,7 +301,7 @@ int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& bu
 	if (state == RegionSet::REGION_CORRUPTED)
 	{
 		stats.corrupt++;
-		return -1;
+		return NULL;
 	}
 	if (state == RegionSet::REGION_MISSING)
 	{
@@ -228,25 +309,58 @@ int RegionCache::getDecompressedChunk(const PosChunkIdx& ci, vector<uint8_t>& bu
 			stats.reqmissing++;
 		else
 			stats.missing++;
-		return -1;
+		return NULL;
 	}
 	// since we've actually just done a read, the region should now be in a real cache entry, not the readbuf
-	if (state != RegionSet::REGION_CACHED || entries[e].ri != ri)
+	RegionCacheEntry *entry = getEntry(ri);
+	if (state != RegionSet::REGION_CACHED || entry == NULL || entry == &readbuf)
 	{
 		cerr << "grievous region cache failure!" << endl;
-		cerr << "[" << ri.x << "," << ri.z << "]   [" << entries[e].ri.x << "," << entries[e].ri.z << "]" << endl;
+		cerr << "[" << ri.x << "," << ri.z << "]   [" << readbuf.ri.x << "," << readbuf.ri.z << "]" << endl;
 		exit(-1);
 	}
 	stats.read++;
-	anvil = entries[e].regionfile.anvil;
-	return entries[e].regionfile.decompressChunk(ci.toChunkIdx(), buf);
+	anvil = entry->regionfile.anvil;
+	return &entry->regionfile;
+}
+
+RegionCacheEntry* RegionCache::getEntry(const PosRegionIdx& ri)
+{
+	int start = geometry.setStart(ri.x, ri.z);
+	for (int e = start; e < start + geometry.ways; e++)
+		if (entries[e].ri == ri)
+			return &entries[e];
+	if (readbuf.ri == ri)
+		return &readbuf;
+	return NULL;
+}
+
+int RegionCache::getVictim(const PosRegionIdx& ri)
+{
+	int start = geometry.setStart(ri.x, ri.z);
+	int victim = start;
+	for (int e = start; e < start + geometry.ways; e++)
+	{
+		if (!entries[e].ri.valid())
+			return e;
+		if (entries[e].lastused < entries[victim].lastused)
+			victim = e;
+	}
+	return victim;
 }
 
 void RegionCache::readRegionFile(const PosRegionIdx& ri)
 {
-	// forget the data in the readbuf
+	// forget the data in the readbuf; if there's an empty entry in the cache proper, or there haven't been
+	//  enough lookups since this one was used to touch as many other regions as the cache holds, then a fully
+	//  associative cache would have kept it
 	if (readbuf.ri.valid())
+	{
+		int eviction = (filled < geometry.size() || clock - readbuf.lastused < (uint64_t)geometry.size()) ?
+		               RegionSet::EVICTED_CONFLICT : RegionSet::EVICTED_CAPACITY;
 		regiontable.setDiskState(readbuf.ri, RegionSet::REGION_UNKNOWN);
+		regiontable.setEviction(readbuf.ri, eviction);
+	}
 	readbuf.ri = PosRegionIdx(-1,-1);
 	
 	// read the region file from disk, if it's there
@@ -267,10 +381,14 @@ void RegionCache::readRegionFile(const PosRegionIdx& ri)
 	}
 	
 	// read was successful; evict current tenant of chunk's cache slot (swap it into the readbuf)
-	int e = getEntryNum(ri);
+	int e = getVictim(ri);
+	if (!entries[e].ri.valid())
+		filled++;
 	entries[e].regionfile.swap(readbuf.regionfile);
 	swap(entries[e].ri, readbuf.ri);
+	swap(entries[e].lastused, readbuf.lastused);
 	// mark the entry as vaild and the region as cached
 	entries[e].ri = ri;
+	entries[e].lastused = ++clock;
 	regiontable.setDiskState(ri, RegionSet::REGION_CACHED);
 }
@@ -18,6 +18,7 @@
 #ifndef REGION_H
 #define REGION_H
 
+#include <stdio.h>
 #include <stdint.h>
 
 #include "map.h"
@@ -51,6 +52,9 @@ struct RegionFileReader
 	//  sector offset *in region file* (one more than the offset into chunkdata)
 	// offsets are indexed by Z*32 + X
 	std::vector<uint32_t> offsets;
+	// the second sector of the header holds a big-endian last-modified time for each chunk (also indexed
+	//  by Z*32 + X; 0 for missing chunks); only loaded by loadHeaderOnly
+	std::vector<uint32_t> timestamps;
 	// each set of chunk data contains:
 	//  -a 4-byte big-endian data length (not including the length field itself)
 	//  -a single-byte version: 1 for gzip, 2 for zlib (this byte *is* included in the length)
@@ -59,38 +63,62 @@ struct RegionFileReader
 	// whether this data was read from an Anvil region file or an old-style one
 	bool anvil;
 
-	RegionFileReader()
+	// if usemmap is set, loadFromFile maps the whole file instead of reading it into chunkdata, and
+	//  chunks are decompressed straight out of the mapping; this way we only touch the pages we need,
+	//  and the data is shared with other threads (and stays in the page cache if we evict this region
+	//  and then come back for it later)
+	// ...but if the file is truncated while it's mapped, touching the pages past the new end raises SIGBUS,
+	//  so this is only safe when nothing is writing to the world
+	bool usemmap;
+	uint8_t *mapping;  // start of file (i.e. header included), or NULL
+	size_t maplength;
+
+	RegionFileReader() : usemmap(false), mapping(NULL), maplength(0)
 	{
 		offsets.resize(32 * 32);
-		chunkdata.reserve(8388608);
+		timestamps.resize(32 * 32);
 	}
+	~RegionFileReader() {unmap();}
 	
 	void swap(RegionFileReader& rfr)
 	{
 		offsets.swap(rfr.offsets);
+		timestamps.swap(rfr.timestamps);
 		chunkdata.swap(rfr.chunkdata);
 		std::swap(anvil, rfr.anvil);
+		std::swap(usemmap, rfr.usemmap);
+		std::swap(mapping, rfr.mapping);
+		std::swap(maplength, rfr.maplength);
 	}
 
+	// release the current mapping, if any
+	void unmap();
+
 	// extract values from the offsets
 	static int getIdx(const ChunkOffset& co) {return co.z*32 + co.x;}
 	uint32_t getSizeSectors(int idx) const {return fromBigEndian(offsets[idx]) & 0xff;}
 	uint32_t getSectorOffset(int idx) const {return fromBigEndian(offsets[idx]) >> 8;}
 	bool containsChunk(const ChunkOffset& co) {return offsets[getIdx(co)] != 0;}
+	uint32_t getTimestamp(int idx) const {return fromBigEndian(timestamps[idx]);}
 
 
 	// attempt to read a region file; return 0 for success, -1 for file not found, -2 for
 	//  other errors
 	// looks for an Anvil region file (.mca) first, then an old-style one (.mcr)
 	int loadFromFile(const RegionIdx& ri, const std::string& inputpath);
+	// (helper for loadFromFile when usemmap is set)
+	int mapFile(FILE *f);
 
 	// attempt to decompress a chunk into a buffer; return 0 for success, -1 for missing chunk,
-	//  -2 for other errors
+	//  -2 for other errors (including offsets or lengths that point outside the file)
 	// (this is not const only because zlib won't take const pointers for input)
 	int decompressChunk(const ChunkOffset& co, std::vector<uint8_t>& buf);
+	// same, but don't decompress; just find the compressed data (which stays valid until the
+	//  next load)
+	int getCompressedChunk(const ChunkOffset& co, const uint8_t*& data, size_t& length);
 
-	// attempt to read only the header (i.e. the chunk offsets) from a region file; return 0
-	//  for success, -1 for file not found, -2 for other errors
+	// attempt to read only the header (i.e. the chunk offsets and timestamps) from a region file;
+	//  return 0 for success, -1 for file not found, -2 for other errors
 	// looks for an Anvil region file (.mca) first, then an old-style one (.mcr)
 	int loadHeaderOnly(const RegionIdx& ri, const std::string& inputpath);
 
@@ -125,8 +153,10 @@ struct RegionCacheStats
 	int64_t missing;  // non-required region not present on disk
 	int64_t reqmissing;  // required region not present on disk
 	int64_t corrupt;  // found on disk, but failed to read
+	// misses on regions that were in the cache before, by how they were evicted (see RegionSet)
+	int64_t conflict, capacity;
 
-	RegionCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0) {}
+	RegionCacheStats() : hits(0), misses(0), read(0), skipped(0), missing(0), reqmissing(0), corrupt(0), conflict(0), capacity(0) {}
 
 	RegionCacheStats& operator+=(const RegionCacheStats& rs);
 };
@@ -135,21 +165,22 @@ struct RegionCacheEntry
 {
 	PosRegionIdx ri;  // or [-1, -1] if this entry is empty
 	RegionFileReader regionfile;
+	uint64_t lastused;  // cache's clock value at last use, for LRU eviction within the set
 	
-	RegionCacheEntry() : ri(-1,-1) {}
+	RegionCacheEntry() : ri(-1,-1), lastused(0) {}
 };
 
-#define RCACHEBITSX 1
-#define RCACHEBITSZ 1
-#define RCACHEXSIZE (1 << RCACHEBITSX)
-#define RCACHEZSIZE (1 << RCACHEBITSZ)
-#define RCACHESIZE (RCACHEXSIZE * RCACHEZSIZE)
-#define RCACHEXMASK (RCACHEXSIZE - 1)
-#define RCACHEZMASK (RCACHEZSIZE - 1)
+// the cache is RCACHEWAYS-way set-associative; the number of sets comes from the memory budget
+#define RCACHEWAYS 4
+// for sizing the cache, assume a typical region file is this big
+#define RCACHEENTRYBYTES (8 * 1024 * 1024)
 
 struct RegionCache : private nocopy
 {
-	RegionCacheEntry entries[RCACHESIZE];
+	SetGeometry geometry;
+	RegionCacheEntry *entries;  // geometry.size() of them
+	uint64_t clock;  // ticks once per lookup
+	int filled;  // how many entries are in use (not counting readbuf)
 
 	ChunkTable& chunktable;
 	RegionTable& regiontable;
@@ -160,17 +191,35 @@ struct RegionCache : private nocopy
 	//  and its storage used for the read (which might fail), but if the read succeeds, the new region is swapped
 	//  into its proper place in the cache, and the previous tenant there moves here
 	RegionCacheEntry readbuf;
-	RegionCache(ChunkTable& ctable, RegionTable& rtable, const std::string& inpath, bool fullr, RegionCacheStats& st)
-		: chunktable(ctable), regiontable(rtable), inputpath(inpath), fullrender(fullr), stats(st)
+	// budget is in bytes, and determines the number of sets (see RCACHEENTRYBYTES)
+	// if usemmap is set, region files are memory-mapped rather than read (see RegionFileReader)
+	RegionCache(ChunkTable& ctable, RegionTable& rtable, const std::string& inpath, bool fullr, RegionCacheStats& st, int64_t budget, bool usemmap = false)
+		: geometry(budget / RCACHEENTRYBYTES, RCACHEWAYS), clock(0), filled(0), chunktable(ctable), regiontable(rtable), inputpath(inpath), fullrender(fullr), stats(st)
 	{
+		entries = new RegionCacheEntry[geometry.size()];
+		for (int i = 0; i < geometry.size(); i++)
+			entries[i].regionfile.usemmap = usemmap;
+		readbuf.regionfile.usemmap = usemmap;
 	}
+	~RegionCache() {delete[] entries;}
 
 	// attempt to decompress a chunk into a buffer; return 0 for success, -1 for missing chunk,
 	//  -2 for other errors
 	// (this is not const only because zlib won't take const pointers for input)
 	int getDecompressedChunk(const PosChunkIdx& ci, std::vector<uint8_t>& buf, bool& anvil);
-
-	static int getEntryNum(const PosRegionIdx& ri) {return (ri.x & RCACHEXMASK) * RCACHEZSIZE + (ri.z & RCACHEZMASK);}
+	// attempt to find a chunk's compressed data; return values are the same as above
+	// (the data stays valid only until the region cache reads another region)
+	int getCompressedChunk(const PosChunkIdx& ci, const uint8_t*& data, size_t& length, bool& anvil);
+
+	// find the region containing a chunk, reading it from disk if necessary; return NULL if it's
+	//  missing or corrupted
+	RegionFileReader* findRegion(const PosChunkIdx& ci, bool& anvil);
+
+	// pick the entry in a region's set to swap it into: an empty one if there is one, otherwise the least
+	//  recently used (which moves to the readbuf)
+	int getVictim(const PosRegionIdx& ri);
+	// find a region's entry, which may be the readbuf; NULL if it isn't cached
+	RegionCacheEntry* getEntry(const PosRegionIdx& ri);
 
 	void readRegionFile(const PosRegionIdx& ri);
 };
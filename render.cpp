@@ -17,6 +17,11 @@
 
 #include <memory>
 #include <iostream>
+#include <algorithm>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "render.h"
 #include "utils.h"
@@ -25,16 +30,6 @@ using namespace std;
 
 
 
-int ThreadOutputCache::getIndex(const ZoomTileIdx& zti) const
-{
-	if (zti.zoom != zoom)
-		return -1;
-	return zti.y * (1 << zoom) + zti.x;
-}
-
-
-
-
 // get topmost y-coord in a column (even if column is out-of-bounds--only looks at top edge of bbox)
 int64_t topPixelY(int64_t x, int64_t bboxTop, int B)
 {
@@ -130,6 +125,75 @@ void PseudocolumnIterator::advance()
 		end = true;
 }
 
+void ChunkWindow::recenter(const PosChunkIdx& ci, ChunkData *chunkdata)
+{
+	// keep whichever chunks are still inside the window
+	ChunkData *old[9];
+	std::copy(chunks, chunks + 9, old);
+	std::fill(chunks, chunks + 9, (ChunkData*)NULL);
+	if (generation == chunkcache.generation)
+	{
+		int64_t shiftx = ci.x - center.x, shiftz = ci.z - center.z;
+		for (int dx = -1; dx <= 1; dx++)
+			for (int dz = -1; dz <= 1; dz++)
+			{
+				int64_t olddx = dx + shiftx, olddz = dz + shiftz;
+				if (olddx >= -1 && olddx <= 1 && olddz >= -1 && olddz <= 1)
+					chunks[(dx + 1) * 3 + dz + 1] = old[(olddx + 1) * 3 + olddz + 1];
+			}
+	}
+	generation = chunkcache.generation;
+	center = ci;
+	chunks[4] = chunkdata;
+}
+
+void ChunkWindow::forget()
+{
+	std::fill(chunks, chunks + 9, (ChunkData*)NULL);
+	generation = chunkcache.generation;
+}
+
+ChunkPseudocolumnIterator::ChunkPseudocolumnIterator(const Pixel& center, const MapParams& mp, ChunkCache& cc)
+	: current(0,0,0), ci(-1,-1), chunkdata(NULL), mparams(mp), chunkcache(cc)
+{
+	current = BlockIdx::topBlock(center, mp);
+	end = false;
+	skipAir();
+}
+
+void ChunkPseudocolumnIterator::advance()
+{
+	current += BlockIdx(1,-1,-1);
+	skipAir();
+}
+
+void ChunkPseudocolumnIterator::skipAir()
+{
+	while (current.y >= mparams.minY)
+	{
+		// look up chunk data (we might have it already)
+		PosChunkIdx newci = current.getChunkIdx();
+		if (newci != ci)
+		{
+			ci = newci;
+			chunkdata = chunkcache.getData(ci);
+		}
+		BlockOffset bo(current);
+		// if we're above the whole chunk, jump until we either leave it (the X offset goes up and Z goes
+		//  down) or get down to its highest block
+		if (current.y > chunkdata->maxheight)
+		{
+			int64_t steps = min(current.y - chunkdata->maxheight, min(16 - bo.x, bo.z + 1));
+			current += BlockIdx(steps, -steps, -steps);
+			continue;
+		}
+		if (current.y <= chunkdata->height(bo))
+			return;
+		current += BlockIdx(1,-1,-1);
+	}
+	end = true;
+}
+
 
 
 // travel down two neighboring pseudocolumns, setting occlusion edges between their nodes
@@ -186,14 +250,16 @@ void buildDependencies(SceneGraph& sg, int pcol1, int pcol2, int which)
 	PosChunkIdx cin = bin.getChunkIdx(); \
 	if (cin == ci) \
 	{ \
-		gnid = chunkdata->id(bin); \
-		gndata = chunkdata->data(bin); \
+		uint16_t gnblock = chunkdata->block(bin); \
+		gnid = gnblock >> 4; \
+		gndata = gnblock & 0xf; \
 	} \
 	else \
 	{ \
-		ChunkData *cdn = rj.chunkcache->getData(cin); \
-		gnid = cdn->id(bin); \
-		gndata = cdn->data(bin); \
+		ChunkData *cdn = window.getData(cin); \
+		uint16_t gnblock = cdn->block(bin); \
+		gnid = gnblock >> 4; \
+		gndata = gnblock & 0xf; \
 	} \
 }
 
@@ -202,8 +268,9 @@ void buildDependencies(SceneGraph& sg, int pcol1, int pcol2, int which)
 	BlockIdx bin = bi + gnoff; \
 	if (bin.y >= 0 && bin.y <= 255) \
 	{ \
-		gnid = chunkdata->id(bin); \
-		gndata = chunkdata->data(bin); \
+		uint16_t gnblock = chunkdata->block(bin); \
+		gnid = gnblock >> 4; \
+		gndata = gnblock & 0xf; \
 	} \
 	else \
 	{ \
@@ -212,14 +279,14 @@ void buildDependencies(SceneGraph& sg, int pcol1, int pcol2, int which)
 	} \
 }
 
-#define CONNECTFENCE(cfid, cfdata) (rj.blockimages.isOpaque(cfid, cfdata) || cfid == 85 || cfid == 107)
-#define CONNECTNETHERFENCE(cfid, cfdata) (rj.blockimages.isOpaque(cfid, cfdata) || cfid == 113 || cfid == 107)
+#define CONNECTFENCE(cfid, cfdata) (rj.blockimages->isOpaque(cfid, cfdata) || cfid == 85 || cfid == 107)
+#define CONNECTNETHERFENCE(cfid, cfdata) (rj.blockimages->isOpaque(cfid, cfdata) || cfid == 113 || cfid == 107)
 
 // given a node that must be drawn, see if we need to do anything special to it--that is, anything that
 //  doesn't depend purely on its blockID/blockData
 // examples: for nodes with no E/S neighbors, we add a little darkness on the EU/SU edge to indicate drop-off;
 //  for chests, we may need to draw half of a double chest instead if there's another chest next door; etc.
-void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, const PosChunkIdx& ci, ChunkData *chunkdata, RenderJob& rj)
+void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, const PosChunkIdx& ci, ChunkData *chunkdata, ChunkWindow& window, RenderJob& rj)
 {
 	const BlockIdx& bi = node.bi;
 	
@@ -302,7 +369,7 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 	{
 		GETNEIGHBOR(blockIDW, blockDataW, BlockIdx(0,1,0))
 		// if there's an opaque block to the W, we should face N instead
-		if (rj.blockimages.isOpaque(blockIDW, blockDataW))
+		if (rj.blockimages->isOpaque(blockIDW, blockDataW))
 			node.bimgoffset = 271;
 	}
 	else if (blockID == 101)  // iron bars
@@ -385,11 +452,11 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 
 	//!!!!!!!! for now, only fully opaque blocks can have drop-off shadows, but some others like snow could
 	//          probably use them, too
-	if (rj.blockimages.isOpaque(node.bimgoffset))
+	if (rj.blockimages->isOpaque(node.bimgoffset))
 	{
 		GETNEIGHBOR(blockIDS, blockDataS, BlockIdx(1,0,0))
 		GETNEIGHBOR(blockIDE, blockDataE, BlockIdx(0,-1,0))
-		GETNEIGHBOR(blockIDD, blockDataD, BlockIdx(0,0,-1))
+		GETNEIGHBORUD(blockIDD, blockDataD, BlockIdx(0,0,-1))
 
 		//!!!!!! neighboring blocks that aren't full height like snow and half-steps should probably produce
 		//        the drop-off effect, too
@@ -406,8 +473,17 @@ void checkSpecial(SceneGraphNode& node, uint16_t blockID, uint8_t blockData, con
 	}
 }
 
+// the shadow is translucent black, which is the same pixel whether it's premultiplied or not
+static inline void darkenPixel(RGBAPixel& p, bool premultiplied)
+{
+	if (premultiplied)
+		blendPremultiplied(p, 0x60000000);
+	else
+		blend(p, 0x60000000);
+}
+
 //!!!!!! speed these up--lots of conditionals at the moment
-void darkenEUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
+void darkenEUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B, bool premultiplied)
 {
 	// EU edge starts at [2B-1,0] and goes one step DL, then one step L, etc., for a total of 2B-1 steps
 	int32_t x = xstart + 2*B-1, y = ystart;
@@ -415,14 +491,14 @@ void darkenEUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 	for (int i = 0; i < 2*B-1; i++)
 	{
 		if (x >= 0 && x < img.w && y >= 0 && y < img.h)
-			blend(img(x, y), 0x60000000);
+			darkenPixel(img(x, y), premultiplied);
 		x--;
 		if (which)
 			y++;
 		which = !which;
 	}
 }
-void darkenSUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
+void darkenSUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B, bool premultiplied)
 {
 	// SU edge starts at [2B,0] and goes one step DR, then one step R, etc., for a total of 2B-1 steps
 	int32_t x = xstart + 2*B, y = ystart;
@@ -430,14 +506,14 @@ void darkenSUEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 	for (int i = 0; i < 2*B-1; i++)
 	{
 		if (x >= 0 && x < img.w && y >= 0 && y < img.h)
-			blend(img(x, y), 0x60000000);
+			darkenPixel(img(x, y), premultiplied);
 		x++;
 		if (which)
 			y++;
 		which = !which;
 	}
 }
-void darkenNDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
+void darkenNDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B, bool premultiplied)
 {
 	// ND edge starts at [2B-1,4B-1] and goes one step UL, then one step L, etc., for a total of 2B-1 steps
 	int32_t x = xstart + 2*B-1, y = ystart + 4*B-1;
@@ -445,14 +521,14 @@ void darkenNDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 	for (int i = 0; i < 2*B-1; i++)
 	{
 		if (x >= 0 && x < img.w && y >= 0 && y < img.h)
-			blend(img(x, y), 0x60000000);
+			darkenPixel(img(x, y), premultiplied);
 		x--;
 		if (which)
 			y--;
 		which = !which;
 	}
 }
-void darkenWDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
+void darkenWDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B, bool premultiplied)
 {
 	// WD edge starts at [2B,4B-1] and goes one step UR, then one step R, etc., for a total of 2B-1 steps
 	int32_t x = xstart + 2*B, y = ystart + 4*B-1;
@@ -460,7 +536,7 @@ void darkenWDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 	for (int i = 0; i < 2*B-1; i++)
 	{
 		if (x >= 0 && x < img.w && y >= 0 && y < img.h)
-			blend(img(x, y), 0x60000000);
+			darkenPixel(img(x, y), premultiplied);
 		x++;
 		if (which)
 			y--;
@@ -470,15 +546,15 @@ void darkenWDEdge(RGBAImage& img, int32_t xstart, int32_t ystart, int B)
 
 void drawNode(SceneGraphNode& node, RGBAImage& img, const BlockImages& blockimages)
 {
-	alphablit(blockimages.img, blockimages.getRect(node.bimgoffset), img, node.xstart, node.ystart);
+	blockimages.blitBlock(node.bimgoffset, img, node.xstart, node.ystart);
 	if (node.darkenEU)
-		darkenEUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
+		darkenEUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4, blockimages.premultiplied);
 	if (node.darkenSU)
-		darkenSUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
+		darkenSUEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4, blockimages.premultiplied);
 	if (node.darkenND)
-		darkenNDEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
+		darkenNDEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4, blockimages.premultiplied);
 	if (node.darkenWD)
-		darkenWDEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4);
+		darkenWDEdge(img, node.xstart, node.ystart, blockimages.rectsize / 4, blockimages.premultiplied);
 	node.drawn = true;
 }
 
@@ -507,6 +583,57 @@ void drawSubgraph(SceneGraph& sg, int rootnode, RGBAImage& img, const BlockImage
 	}
 }
 
+// draw all the nodes, without using the DAG edges, by sorting them by depth and drawing the farthest first
+// ...depth is x - z - y, which increases by one with each step S, E, or D (so by three with each step SED down
+//  a pseudocolumn); blocks at the same depth are always at least two pseudocolumns apart, so they never overlap,
+//  and any two blocks that do overlap are drawn in the same order the DAG would draw them (which means the
+//  results are identical, even where there's translucency)
+// ...that's only true if the block images stay within their hexagons, though; the DAG doesn't know about
+//  any overlap beyond that, so it draws such blocks in an arbitrary order, and the caller must use the DAG
+//  for those tiles to get the same results
+void drawDepthOrder(SceneGraph& sg, RGBAImage& img, const BlockImages& blockimages)
+{
+	int64_t mindepth = sg.nodes[0].bi.x - sg.nodes[0].bi.z - sg.nodes[0].bi.y, maxdepth = mindepth;
+	for (vector<SceneGraphNode>::const_iterator it = sg.nodes.begin(); it != sg.nodes.end(); it++)
+	{
+		int64_t depth = it->bi.x - it->bi.z - it->bi.y;
+		mindepth = min(mindepth, depth);
+		maxdepth = max(maxdepth, depth);
+	}
+
+	// counting sort, with bucket 0 for the greatest depth
+	vector<int>& counts = sg.depthcounts;
+	counts.assign(maxdepth - mindepth + 2, 0);
+	for (vector<SceneGraphNode>::const_iterator it = sg.nodes.begin(); it != sg.nodes.end(); it++)
+		counts[maxdepth - (it->bi.x - it->bi.z - it->bi.y) + 1]++;
+	for (int i = 1; i < (int)counts.size(); i++)
+		counts[i] += counts[i-1];
+	vector<int>& order = sg.order;
+	order.resize(sg.nodes.size());
+	for (int i = 0; i < (int)sg.nodes.size(); i++)
+	{
+		const BlockIdx& bi = sg.nodes[i].bi;
+		order[counts[maxdepth - (bi.x - bi.z - bi.y)]++] = i;
+	}
+
+	for (vector<int>::const_iterator it = order.begin(); it != order.end(); it++)
+		drawNode(sg.nodes[*it], img, blockimages);
+}
+
+// write a finished tile to disk, or hand it off to the PNG encoder threads if we have them
+void writeTile(const RGBAImage& tile, const string& tilefile, RenderJob& rj)
+{
+	if (rj.pngqueue != NULL)
+	{
+		rj.pngqueue->write(tile, tilefile);
+		return;
+	}
+	if (rj.pngencoder.get() == NULL)
+		rj.pngencoder.reset(new PNGEncoder(rj.opts.pngprofile, rj.opts.premultiplied));
+	if (!rj.pngencoder->write(tile, tilefile))
+		cerr << "failed to write " << tilefile << endl;
+}
+
 //!!!!!!!!!!!!! many opportunities for optimization in here
 bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 {
@@ -535,10 +662,14 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 	if (rj.testmode)
 		return true;
 
+	// give the decoder threads a head start on the chunks for the tiles after this one
+	if (rj.decodepool != NULL)
+		rj.decodepool->prefetch(ti, rj);
+
 	SceneGraph& sg = *rj.scenegraph;
 	sg.clear();
 	tile.create(rj.mp.tileSize(), rj.mp.tileSize());
-	const BlockImages& blockimages = rj.blockimages;
+	const BlockImages& blockimages = *rj.blockimages;
 
 	// we'll be given block center pixels in absolute coords, but for blitting, we need the block bounding box
 	//  in tile image coords; compute the translation that gives us that
@@ -547,6 +678,13 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 	int64_t xoff = -tilebb.topLeft.x - 2*rj.mp.B;
 	int64_t yoff = -tilebb.topLeft.y - 2*rj.mp.B;
 
+	// if we're supposed to draw in depth order, we won't need the DAG edges unless we find a block image
+	//  that sticks out of its hexagon
+	bool overflow = false;
+
+	// neighbors for checkSpecial
+	ChunkWindow window(*rj.chunkcache);
+
 	// step 1: build the scene graph
 	// ...we'll iterate through the pseudocolumn center pixels, starting in the top left of the image, moving down then
 	//  right; this means that by the time we reach a pseudocolumn, its N, E, and SE neighbors have already been done,
@@ -555,20 +693,19 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 	{
 		// we'll start at the top of the pseudocolumn and go down, adding any non-air blocks to the graph, stopping
 		//  at the first totally opaque block
+		// (the iterator skips any blocks that are above the tops of their chunks' columns, and looks up the
+		//  chunk data for us)
 		sg.pcols.push_back(-1);
-		PosChunkIdx lastci(-1,-1);
-		ChunkData *chunkdata = NULL;
 		int prevnode = -1;
-		for (PseudocolumnIterator pcit(tbit.current, rj.mp); !pcit.end; pcit.advance())
+		for (ChunkPseudocolumnIterator pcit(tbit.current, rj.mp, *rj.chunkcache); !pcit.end; pcit.advance())
 		{
-			// look up chunk data (we might have it already)
-			PosChunkIdx ci = pcit.current.getChunkIdx();
-			if (ci != lastci)
-				chunkdata = rj.chunkcache->getData(ci);
+			const PosChunkIdx& ci = pcit.ci;
+			ChunkData *chunkdata = pcit.chunkdata;
 
 			// get block type and data
-			uint16_t blockID = chunkdata->id(pcit.current);
-			uint8_t blockData = chunkdata->data(pcit.current);
+			uint16_t block = chunkdata->block(pcit.current);
+			uint16_t blockID = block >> 4;
+			uint8_t blockData = block & 0xf;
 			int initialoffset = blockimages.getOffset(blockID, blockData);  // we might use a different one after checkSpecial
 			
 			// if this is air, move on (we *always* consider air to be transparent; it has no block image)
@@ -580,13 +717,16 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 
 			// check out neighboring blocks to see if we need to do anything special: set the darken-edge flags,
 			//  or change the offset to a special one (one not corresponding to a plain blockID/blockData combo)
-			checkSpecial(node, blockID, blockData, ci, chunkdata, rj);
+			if (ci != window.center)
+				window.recenter(ci, chunkdata);
+			checkSpecial(node, blockID, blockData, ci, chunkdata, window, rj);
 
 			// if this is not air, but is nonetheless transparent, move on
 			if (blockimages.isTransparent(node.bimgoffset))
 				continue;
 
 			// commit the node
+			overflow = overflow || blockimages.overflowsHexagon(node.bimgoffset);
 			int thisnode = sg.nodes.size();
 			sg.nodes.push_back(node);
 
@@ -603,7 +743,9 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 				break;
 		}
 
-		// check dependencies with our N, E, and SE neighbors
+		// check dependencies with our N, E, and SE neighbors (unless we're not going to use the DAG)
+		if (rj.opts.depthorder)
+			continue;
 		if (tbit.nextN != -1)
 			buildDependencies(sg, tbit.nextN, tbit.pos, 4);
 		if (tbit.nextE != -1)
@@ -611,19 +753,44 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile)
 		if (tbit.nextSE != -1)
 			buildDependencies(sg, tbit.nextSE, tbit.pos, 6);
 	}
+
+	// we're done looking at chunk data for this tile
+	rj.chunkcache->releasePins();
+	if (rj.usecounts != NULL)
+		rj.usecounts->tileDone(ti);
 	
 	// if we didn't find anything to draw--i.e. our final image will be fully transparent--then there's
-	//  no sense saving it to disk
+	//  no sense saving it to disk (and if this is an incremental update, whatever was there before is gone)
 	if (sg.nodes.empty())
+	{
+		if (!rj.fullrender)
+			remove(tilefile.c_str());
 		return false;
+	}
 
 	// step 2: traverse the graph and draw the image
-	for (int i = 0; i < (int)sg.nodes.size(); i++)
-		drawSubgraph(sg, i, tile, blockimages);
+	if (rj.opts.depthorder && !overflow)
+		drawDepthOrder(sg, tile, blockimages);
+	else
+	{
+		// if we skipped the DAG edges but turned out to need them, go back and add them now (the iterator
+		//  visits the pseudocolumns in the same order as before)
+		if (rj.opts.depthorder)
+			for (TileBlockIterator tbit(ti, rj.mp); !tbit.end; tbit.advance())
+			{
+				if (tbit.nextN != -1)
+					buildDependencies(sg, tbit.nextN, tbit.pos, 4);
+				if (tbit.nextE != -1)
+					buildDependencies(sg, tbit.nextE, tbit.pos, 5);
+				if (tbit.nextSE != -1)
+					buildDependencies(sg, tbit.nextSE, tbit.pos, 6);
+			}
+		for (int i = 0; i < (int)sg.nodes.size(); i++)
+			drawSubgraph(sg, i, tile, blockimages);
+	}
 
 	// save the image to disk
-	if (!tile.writePNG(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	writeTile(tile, tilefile, rj);
 	return true;
 }
 
@@ -639,138 +806,257 @@ bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile)
 	if (rj.tiletable->reject(zti, rj.mp))
 		return false;
 
-	// render the four subtiles (if they're needed)
-	TileCache::ZoomLevel& zlevel = rj.tilecache->levels[rj.mp.baseZoom - zti.zoom - 1];
+	// find out which of the four subtiles are needed
 	ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
-	zlevel.used[0] = renderZoomTile(topleft, rj, zlevel.tiles[0]);
-	zlevel.used[1] = renderZoomTile(topleft.add(0,1), rj, zlevel.tiles[1]);
-	zlevel.used[2] = renderZoomTile(topleft.add(1,0), rj, zlevel.tiles[2]);
-	zlevel.used[3] = renderZoomTile(topleft.add(1,1), rj, zlevel.tiles[3]);
-
-	// if none of the subtiles are used, we have nothing to do
-	int usedcount = 0;
+	ZoomTileIdx subzti[4] = {topleft, topleft.add(0,1), topleft.add(1,0), topleft.add(1,1)};
+	bool required[4];
+	int expected = 0;
 	for (int i = 0; i < 4; i++)
-		if (zlevel.used[i])
-			usedcount++;
-	if (usedcount == 0)
+	{
+		required[i] = rj.tiletable->getNumRequired(subzti[i], rj.mp) > 0;
+		if (required[i])
+			expected++;
+	}
+	if (expected == 0)
 		return false;
 
-	// if we're in test mode, pretend we've successfully drawn
+	// render them one at a time into this level's scratch image, reducing each into this tile as it's done
+	startZoomTile(zti, rj, tile, expected);
+	RGBAImage& subtile = rj.tilecache->levels[rj.mp.baseZoom - zti.zoom - 1];
+	bool used = false;
+	for (int i = 0; i < 4; i++)
+	{
+		if (!required[i])
+			continue;
+		if (renderZoomTile(subzti[i], rj, subtile))
+		{
+			addSubtile(rj, tile, i, &subtile);
+			used = true;
+		}
+		else
+			addSubtile(rj, tile, i, NULL);
+	}
+	return finishZoomTile(zti, rj, tile, used);
+}
+
+void startZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, int expected)
+{
 	if (rj.testmode)
-		return true;
+		return;
 
-	// if some of the subtiles are unused and this is an incremental update, we need to
+	// if some of the subtiles won't be drawn and this is an incremental update, we need to
 	//  load the existing version of this tile (if there is one) to get the unchanged portions
-	string tilefile = rj.outputpath + "/" + zti.toFilePath();
-	if (usedcount < 4 && !rj.fullrender)
+	if (expected < 4 && !rj.fullrender)
 	{
 		// if it doesn't read, no big deal (it may not exist anyway)
+		string tilefile = rj.outputpath + "/" + zti.toFilePath();
 		if (!tile.readPNG(tilefile) || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
 			tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+		else if (rj.opts.premultiplied)
+			premultiplyImage(tile);
 	}
 	else
 		tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+}
 
-	// combine the four subtile images into this tile's image
+// zero a quadrant of a tile
+static void clearQuadrant(RGBAImage& tile, int childnum)
+{
+	int halfsize = tile.w / 2;
+	for (int32_t y = (childnum & 1) * halfsize; y < (childnum & 1) * halfsize + halfsize; y++)
+		std::fill(&tile((childnum >> 1) * halfsize, y), &tile((childnum >> 1) * halfsize, y) + halfsize, 0);
+}
+
+void addSubtile(RenderJob& rj, RGBAImage& tile, int childnum, const RGBAImage *subtile)
+{
+	if (rj.testmode)
+		return;
+	// (a full render starts from a blank tile, so there's nothing to clear)
+	if (subtile == NULL)
+	{
+		if (!rj.fullrender)
+			clearQuadrant(tile, childnum);
+		return;
+	}
 	int halfsize = rj.mp.tileSize() / 2;
-	if (zlevel.used[0])
-		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), zlevel.tiles[0]);
-	if (zlevel.used[1])
-		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), zlevel.tiles[1]);
-	if (zlevel.used[2])
-		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), zlevel.tiles[2]);
-	if (zlevel.used[3])
-		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), zlevel.tiles[3]);
-
-	// save to disk
-	if (!tile.writePNG(tilefile))
-		cerr << "failed to write " << tilefile << endl;
+	reduceHalf(tile, ImageRect((childnum >> 1) * halfsize, (childnum & 1) * halfsize, halfsize, halfsize), *subtile, rj.opts.alphaweighted);
+}
+
+bool finishZoomTile(const ZoomTileIdx& zti, RenderJob& rj, const RGBAImage& tile, bool used)
+{
+	if (rj.testmode)
+		return used;
+	string tilefile = rj.outputpath + "/" + zti.toFilePath();
+	// if nothing was added, the tile can only have something in it if it started from the existing one
+	if (!used)
+	{
+		if (rj.fullrender)
+			return false;
+		bool empty = true;
+		for (vector<RGBAPixel>::const_iterator it = tile.data.begin(); it != tile.data.end() && empty; it++)
+			empty = ALPHA(*it) == 0;
+		if (empty)
+		{
+			remove(tilefile.c_str());
+			return false;
+		}
+	}
+	writeTile(tile, tilefile, rj);
 	return true;
 }
 
 
 
-bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& tocache)
+PartialTileStore::PartialTileStore(const MapParams& mp, int64_t b, const string& sf, bool aw)
+	: tilesize(mp.tileSize()), tilebytes((int64_t)mp.tileSize() * mp.tileSize() * sizeof(RGBAPixel)), budget(b), scratchfile(sf),
+	  fd(-1), fileerror(false), alphaweighted(aw), memused(0), clock(0), nextslot(0), spilled(0)
 {
-	// if this is at or below the ThreadOutputCache level, abort
-	if (zti.zoom >= tocache.zoom)
-		return false;
+}
 
-	// get the four subtiles: if we're one level above the ThreadOutputCache level, they're in the
-	//  cache; otherwise, we recurse
-	// ...we use the ZoomLevel::used bits either way
-	TileCache::ZoomLevel& zlevel = rj.tilecache->levels[rj.mp.baseZoom - zti.zoom - 1];
-	ZoomTileIdx topleft = zti.toZoom(zti.zoom + 1);
-	const RGBAImage *tile0, *tile1, *tile2, *tile3;
-	if (zti.zoom == tocache.zoom - 1)
-	{
-		int idx = tocache.getIndex(topleft);
-		zlevel.used[0] = tocache.used[idx];
-		tile0 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(0,1));
-		zlevel.used[1] = tocache.used[idx];
-		tile1 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(1,0));
-		zlevel.used[2] = tocache.used[idx];
-		tile2 = &tocache.images[idx];
-		idx = tocache.getIndex(topleft.add(1,1));
-		zlevel.used[3] = tocache.used[idx];
-		tile3 = &tocache.images[idx];
+PartialTileStore::~PartialTileStore()
+{
+	for (vector<Entry*>::iterator it = entries.begin(); it != entries.end(); it++)
+		delete *it;
+	if (fd != -1)
+	{
+		close(fd);
+		remove(scratchfile.c_str());
 	}
-	else
+}
+
+PartialTileStore::Entry* PartialTileStore::start(const ZoomTileIdx& zti, RenderJob& rj, int expected)
+{
+	Entry *entry = new Entry;
 	{
-		zlevel.used[0] = renderZoomTile(topleft, rj, zlevel.tiles[0], tocache);
-		tile0 = &zlevel.tiles[0];
-		zlevel.used[1] = renderZoomTile(topleft.add(0,1), rj, zlevel.tiles[1], tocache);
-		tile1 = &zlevel.tiles[1];
-		zlevel.used[2] = renderZoomTile(topleft.add(1,0), rj, zlevel.tiles[2], tocache);
-		tile2 = &zlevel.tiles[2];
-		zlevel.used[3] = renderZoomTile(topleft.add(1,1), rj, zlevel.tiles[3], tocache);
-		tile3 = &zlevel.tiles[3];
+		MutexLocker ml(mutex);
+		makeRoom();
+		entry->busy = 1;  // don't let anyone spill it before it's initialized
+		entry->lastused = ++clock;
+		entries.push_back(entry);
+		memused += tilebytes;
 	}
+	startZoomTile(zti, rj, entry->image, expected);
+	MutexLocker ml(mutex);
+	entry->busy--;
+	return entry;
+}
 
-	// if none of the subtiles are used, we have nothing to do
-	int usedcount = 0;
-	for (int i = 0; i < 4; i++)
-		if (zlevel.used[i])
-			usedcount++;
-	if (usedcount == 0)
-		return false;
+void PartialTileStore::add(Entry *entry, int childnum, const RGBAImage *subtile)
+{
+	int halfsize = tilesize / 2;
+	int32_t x = (childnum >> 1) * halfsize, y = (childnum & 1) * halfsize;
+	int64_t slot;
+	{
+		MutexLocker ml(mutex);
+		slot = entry->slot;
+		if (slot == -1)
+		{
+			entry->busy++;
+			entry->lastused = ++clock;
+		}
+	}
+	if (slot == -1)
+	{
+		if (subtile != NULL)
+			reduceHalf(entry->image, ImageRect(x, y, halfsize, halfsize), *subtile, alphaweighted);
+		else
+			clearQuadrant(entry->image, childnum);
+		MutexLocker ml(mutex);
+		entry->busy--;
+		return;
+	}
 
-	// if we're in test mode, pretend we've successfully drawn
-	if (rj.testmode)
-		return true;
+	// the tile is in the scratch file, so reduce the subtile on its own and write its rows in place (nothing
+	//  else touches this quadrant, so we don't need the mutex)
+	RGBAImage quadrant;
+	quadrant.create(halfsize, halfsize);
+	if (subtile != NULL)
+		reduceHalf(quadrant, ImageRect(0, 0, halfsize, halfsize), *subtile, alphaweighted);
+	for (int32_t row = 0; row < halfsize; row++)
+	{
+		off_t offset = slot * tilebytes + ((int64_t)(y + row) * tilesize + x) * sizeof(RGBAPixel);
+		if (pwrite(fd, &quadrant(0, row), halfsize * sizeof(RGBAPixel), offset) != (ssize_t)(halfsize * sizeof(RGBAPixel)))
+		{
+			cerr << "failed to write to " << scratchfile << endl;
+			return;
+		}
+	}
+}
 
-	// if some of the subtiles are unused and this is an incremental update, we need to
-	//  load the existing version of this tile (if there is one) to get the unchanged portions
-	string tilefile = rj.outputpath + "/" + zti.toFilePath();
-	if (usedcount < 4 && !rj.fullrender)
+void PartialTileStore::take(Entry *entry, RGBAImage& tile)
+{
 	{
-		// if it doesn't read, no big deal (it may not exist anyway)
-		if (!tile.readPNG(tilefile) || tile.w != rj.mp.tileSize() || tile.h != rj.mp.tileSize())
-			tile.create(rj.mp.tileSize(), rj.mp.tileSize());
+		MutexLocker ml(mutex);
+		entries.erase(find(entries.begin(), entries.end(), entry));
+		if (entry->slot == -1)
+		{
+			memused -= tilebytes;
+			tile.data.swap(entry->image.data);
+			tile.w = entry->image.w;
+			tile.h = entry->image.h;
+			delete entry;
+			return;
+		}
 	}
-	else
-		tile.create(rj.mp.tileSize(), rj.mp.tileSize());
 
-	// combine the four subtile images into this tile's image
-	int halfsize = rj.mp.tileSize() / 2;
-	if (zlevel.used[0])
-		reduceHalf(tile, ImageRect(0, 0, halfsize, halfsize), *tile0);
-	if (zlevel.used[1])
-		reduceHalf(tile, ImageRect(0, halfsize, halfsize, halfsize), *tile1);
-	if (zlevel.used[2])
-		reduceHalf(tile, ImageRect(halfsize, 0, halfsize, halfsize), *tile2);
-	if (zlevel.used[3])
-		reduceHalf(tile, ImageRect(halfsize, halfsize, halfsize, halfsize), *tile3);
-
-	// save to disk
-	if (!tile.writePNG(tilefile))
-		cerr << "failed to write " << tilefile << endl;
-	return true;
+	// read it back from the scratch file
+	tile.create(tilesize, tilesize);
+	if (pread(fd, &tile.data[0], tilebytes, entry->slot * tilebytes) != (ssize_t)tilebytes)
+		cerr << "failed to read from " << scratchfile << endl;
+	MutexLocker ml(mutex);
+	freeslots.push_back(entry->slot);
+	delete entry;
 }
 
+void PartialTileStore::makeRoom()
+{
+	while (memused + tilebytes > budget && !fileerror)
+	{
+		// find the idle tile that was used least recently; if they're all busy, we'll just have to go over
+		Entry *victim = NULL;
+		for (vector<Entry*>::iterator it = entries.begin(); it != entries.end(); it++)
+			if ((*it)->slot == -1 && (*it)->busy == 0 && (victim == NULL || (*it)->lastused < victim->lastused))
+				victim = *it;
+		if (victim == NULL)
+			return;
 
+		if (fd == -1)
+		{
+			fd = open(scratchfile.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			// (the output directory may not have been created yet)
+			if (fd == -1 && errno == ENOENT)
+			{
+				makePath(scratchfile.substr(0, scratchfile.rfind('/')));
+				fd = open(scratchfile.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			}
+			if (fd == -1)
+			{
+				cerr << "failed to create " << scratchfile << "; going over tile memory budget" << endl;
+				fileerror = true;
+				return;
+			}
+		}
+		int64_t slot;
+		if (!freeslots.empty())
+		{
+			slot = freeslots.back();
+			freeslots.pop_back();
+		}
+		else
+			slot = nextslot++;
+		if (pwrite(fd, &victim->image.data[0], tilebytes, slot * tilebytes) != (ssize_t)tilebytes)
+		{
+			cerr << "failed to write to " << scratchfile << "; going over tile memory budget" << endl;
+			freeslots.push_back(slot);
+			fileerror = true;
+			return;
+		}
+		victim->slot = slot;
+		vector<RGBAPixel>().swap(victim->image.data);
+		memused -= tilebytes;
+		spilled++;
+	}
+}
 
 
 
@@ -886,3 +1172,225 @@ void testPColIterator()
 			}
 		}
 }
+
+
+
+void *runPNGWriteThread(void *arg)
+{
+	PNGWriteQueue& queue = *(PNGWriteQueue*)arg;
+	PNGEncoder encoder(queue.profile, queue.premultiplied);
+	RGBAImage *img;
+	string filename;
+	while (queue.getWork(img, filename))
+	{
+		if (!encoder.write(*img, filename))
+			cerr << "failed to write " << filename << endl;
+		queue.finished(img);
+	}
+	return 0;
+}
+
+PNGWriteQueue::PNGWriteQueue(int threads, int maxp, const string& pngprofile, bool premult)
+	: profile(pngprofile), premultiplied(premult), maxpending(maxp), outstanding(0), stopping(false)
+{
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_t pthr;
+		if (0 != pthread_create(&pthr, NULL, runPNGWriteThread, (void*)this))
+			cerr << "failed to create PNG encoder thread!" << endl;
+		else
+			pthrs.push_back(pthr);
+	}
+}
+
+PNGWriteQueue::~PNGWriteQueue()
+{
+	{
+		MutexLocker lock(mutex);
+		stopping = true;
+		workavailable.broadcast();
+	}
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		pthread_join(*it, NULL);
+	for (vector<RGBAImage*>::iterator it = allbuffers.begin(); it != allbuffers.end(); it++)
+		delete *it;
+}
+
+void PNGWriteQueue::write(const RGBAImage& img, const string& filename)
+{
+	// wait for room, and grab a buffer (or make a new one)
+	RGBAImage *buf = NULL;
+	{
+		MutexLocker lock(mutex);
+		while (outstanding >= maxpending)
+			roomavailable.wait(mutex);
+		outstanding++;
+		if (freebuffers.empty())
+		{
+			buf = new RGBAImage;
+			allbuffers.push_back(buf);
+		}
+		else
+		{
+			buf = freebuffers.back();
+			freebuffers.pop_back();
+		}
+	}
+	// copy the image without holding the lock (the buffer should already be the right size, unless it's new)
+	*buf = img;
+	MutexLocker lock(mutex);
+	pending.push_back(make_pair(buf, filename));
+	workavailable.signal();
+}
+
+bool PNGWriteQueue::getWork(RGBAImage*& img, string& filename)
+{
+	MutexLocker lock(mutex);
+	while (pending.empty() && !stopping)
+		workavailable.wait(mutex);
+	if (pending.empty())
+		return false;
+	img = pending.front().first;
+	filename.swap(pending.front().second);
+	pending.pop_front();
+	return true;
+}
+
+void PNGWriteQueue::finished(RGBAImage *img)
+{
+	MutexLocker lock(mutex);
+	freebuffers.push_back(img);
+	outstanding--;
+	roomavailable.signal();
+}
+
+
+
+struct DecodeThreadParams
+{
+	ChunkDecodePool *pool;
+	RenderJob *rj;
+};
+
+void *runDecodeThread(void *arg)
+{
+	DecodeThreadParams *dtp = (DecodeThreadParams*)arg;
+	PosChunkIdx ci(-1,-1);
+	while (dtp->pool->getWork(ci))
+	{
+		// this gets the chunk into the shared cache; we don't need to hang on to it
+		dtp->rj->chunkcache->getData(ci);
+		dtp->rj->chunkcache->releasePins();
+	}
+	delete dtp;
+	return 0;
+}
+
+ChunkDecodePool::ChunkDecodePool(int threads, const RenderJob& rj, const ChunkUseCounts& uc)
+	: usecounts(uc), workers(new RenderJob[threads]), nworkers(threads), stopping(false)
+{
+	for (int i = 0; i < threads; i++)
+	{
+		RenderJob& w = workers[i];
+		w.opts = rj.opts;
+		w.chunktable.reset(new ChunkTable(rj.chunktable.get()));
+		w.regiontable.reset(new RegionTable(rj.regiontable.get()));
+		w.regioncache.reset(new RegionCache(*w.chunktable, *w.regiontable, rj.inputpath, rj.fullrender, w.stats.regioncache, rj.opts.regioncachesize, rj.opts.mmapregions));
+		w.chunkcache.reset(new ChunkCache(*w.chunktable, *w.regiontable, *w.regioncache, rj.inputpath, rj.fullrender, rj.regionformat, w.stats.chunkcache, rj.opts.chunkcachesize, rj.sharedchunkcache.get(), rj.opts.fusedinflate));
+		DecodeThreadParams *dtp = new DecodeThreadParams;
+		dtp->pool = this;
+		dtp->rj = &w;
+		pthread_t pthr;
+		if (0 != pthread_create(&pthr, NULL, runDecodeThread, (void*)dtp))
+		{
+			cerr << "failed to create chunk decoder thread!" << endl;
+			delete dtp;
+		}
+		else
+			pthrs.push_back(pthr);
+	}
+}
+
+ChunkDecodePool::~ChunkDecodePool()
+{
+	{
+		MutexLocker lock(mutex);
+		stopping = true;
+		pending.clear();
+		workavailable.broadcast();
+	}
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		pthread_join(*it, NULL);
+	delete[] workers;
+}
+
+// index of a zoom tile in the order renderZoomTile visits them ([0,0], [0,1], [1,0], [1,1] at each level),
+//  and vice versa
+static uint64_t toDrawOrder(int64_t x, int64_t y, int zoom)
+{
+	uint64_t z = 0;
+	for (int i = 0; i < zoom; i++)
+		z |= (((uint64_t)(x >> i) & 0x1) << (2*i + 1)) | (((uint64_t)(y >> i) & 0x1) << (2*i));
+	return z;
+}
+static ZoomTileIdx fromDrawOrder(uint64_t z, int zoom)
+{
+	ZoomTileIdx zti(0, 0, zoom);
+	for (int i = 0; i < zoom; i++)
+	{
+		zti.x |= (int64_t)((z >> (2*i + 1)) & 0x1) << i;
+		zti.y |= (int64_t)((z >> (2*i)) & 0x1) << i;
+	}
+	return zti;
+}
+
+void ChunkDecodePool::prefetch(const TileIdx& ti, const RenderJob& rj)
+{
+	// walk forward from this tile in drawing order, picking out the required tiles we haven't seen yet
+	ZoomTileIdx zti = ti.toZoomTileIdx(rj.mp);
+	uint64_t start = toDrawOrder(zti.x, zti.y, zti.zoom), end = (uint64_t)1 << (2 * zti.zoom);
+	vector<PosChunkIdx> chunks;
+	MutexLocker lock(mutex);
+	size_t oldpending = pending.size();
+	for (uint64_t z = start; z < start + PREFETCHTILES && z < end && pending.size() < PREFETCHMAXPENDING; z++)
+	{
+		TileIdx t = fromDrawOrder(z, zti.zoom).toTileIdx(rj.mp);
+		// (skip tiles some other thread has already started, too; they'd never come off the queued list)
+		if (!rj.tiletable->isRequired(t) || (z != start && rj.tiletable->isDrawn(t)) || queued.count(make_pair(t.x, t.y)) != 0)
+			continue;
+		chunks.clear();
+		usecounts.getChunks(t, chunks);
+		vector<PosChunkIdx>::const_iterator it = chunks.begin();
+		for (; it != chunks.end() && pending.size() < PREFETCHMAXPENDING; it++)
+			pending.push_back(*it);
+		// (if some of the chunks didn't fit, the tile can be tried again next time)
+		if (it == chunks.end())
+			queued.insert(make_pair(t.x, t.y));
+	}
+	// this tile is being drawn now, so nobody will ask for it again
+	queued.erase(make_pair(ti.x, ti.y));
+	if (pending.size() != oldpending)
+		workavailable.broadcast();
+}
+
+void ChunkDecodePool::addStats(RenderStats& stats) const
+{
+	for (int i = 0; i < nworkers; i++)
+	{
+		stats.chunkcache += workers[i].stats.chunkcache;
+		stats.regioncache += workers[i].stats.regioncache;
+	}
+}
+
+bool ChunkDecodePool::getWork(PosChunkIdx& ci)
+{
+	MutexLocker lock(mutex);
+	while (pending.empty() && !stopping)
+		workavailable.wait(mutex);
+	if (stopping)
+		return false;
+	ci = pending.front();
+	pending.pop_front();
+	return true;
+}
+
@@ -19,7 +19,10 @@
 #define RENDER_H
 
 #include <string>
+#include <deque>
+#include <set>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "map.h"
 #include "tables.h"
@@ -40,9 +43,110 @@ struct RenderStats
 };
 
 
+// optional features and tuning knobs, from the command line
+struct RenderOptions
+{
+	int64_t sharedcachesize;  // in bytes; if nonzero, the render threads share a SharedChunkCache of this size
+	bool mmapregions;  // whether to memory-map region files instead of reading them
+	bool autoupdate;  // incremental update of the chunks whose timestamps have changed since the last render
+	bool depthorder;  // draw tiles by sorting their blocks by depth instead of building and traversing the DAG
+	int encodethreads;  // if nonzero, tiles are handed off to this many threads for PNG encoding and writing
+	std::string pngprofile;  // PNG compression settings for tiles (see PNGEncoder)
+	bool fusedinflate;  // parse Anvil chunks while inflating them, rather than decompressing them first
+	bool evictbyuse;  // SharedChunkCache evicts chunks that no remaining tile needs first (see ChunkUseCounts)
+	int64_t chunkcachesize;  // in bytes; memory budget for each thread's ChunkCache
+	int64_t regioncachesize;  // in bytes; memory budget for each thread's RegionCache
+	int decodethreads;  // if nonzero, this many threads read chunks into the SharedChunkCache ahead of the render threads
+	int64_t partialbudget;  // in bytes; memory budget for the zoom tiles the render threads are putting together
+	bool alphaweighted;  // weight colors by alpha when reducing subtiles into zoom tiles (see reduceHalf)
+	bool premultiplied;  // draw and reduce tiles with premultiplied alpha, converting back only when writing them
+
+	RenderOptions() : sharedcachesize(0), mmapregions(false), autoupdate(false), depthorder(false), encodethreads(0), pngprofile("default"), fusedinflate(false), evictbyuse(false), chunkcachesize(128 * 1048576), regioncachesize(32 * 1048576), decodethreads(0), partialbudget(256 * 1048576), alphaweighted(false), premultiplied(false) {}
+};
+
+
+// writes tile images to disk on a pool of background threads, so the render threads can go on to the next
+//  tile instead of waiting for the PNG compression
+// ...each image is copied into a buffer owned by the queue, and the buffers are reused once they've been
+//  written; if too many images are already waiting, write() blocks until one has been written
+struct PNGWriteQueue : private nocopy
+{
+	// start the threads (each with its own PNGEncoder using the given profile, converting from premultiplied
+	//  alpha if necessary); at most maxpending images (including the ones being encoded) are held at once
+	PNGWriteQueue(int threads, int maxpending, const std::string& pngprofile, bool premultiplied);
+	// finish all the pending writes, then stop the threads
+	~PNGWriteQueue();
+
+	// queue an image to be written to a file
+	void write(const RGBAImage& img, const std::string& filename);
+
+	// internal: called by the threads to get the next image (blocks until there is one); returns false
+	//  if there are none left and we're shutting down
+	bool getWork(RGBAImage*& img, std::string& filename);
+	// internal: called by the threads after writing an image
+	void finished(RGBAImage *img);
+
+	Mutex mutex;
+	Condition workavailable, roomavailable;
+	std::deque<std::pair<RGBAImage*, std::string> > pending;  // waiting to be encoded
+	std::vector<RGBAImage*> freebuffers;  // not in use; ready to be reused
+	std::vector<RGBAImage*> allbuffers;  // everything we've allocated
+	std::vector<pthread_t> pthrs;  // (only the ones that actually started; if none did, nothing will be written)
+	std::string profile;
+	bool premultiplied;
+	int maxpending;
+	int outstanding;  // images that have been handed to us but not yet written
+	bool stopping;
+};
+
+
+struct RenderJob;
+
+// reads and parses chunks into the SharedChunkCache on a pool of background threads, ahead of the render
+//  threads, so that they mostly find their chunks already there instead of waiting on the disk and zlib
+// ...as each render thread starts a base tile, it tells us, and we queue the chunks (from a ChunkUseCounts)
+//  of that tile and the next few required ones after it in Z-order, which is the order it draws them in;
+//  each of our threads loads chunks through its own ChunkCache/RegionCache, just as a render thread would
+// ...this is only a hint: each tile is queued only once, and if too many chunks are already waiting, the
+//  rest are dropped (the render threads will read them when they get there), though a tile that didn't get
+//  all its chunks queued can be asked for again; tiles are forgotten once they start drawing, so we only
+//  remember the few that are just ahead of each render thread
+struct ChunkDecodePool : private nocopy
+{
+	// start the threads; rj is the main RenderJob, whose SharedChunkCache the chunks go into
+	ChunkDecodePool(int threads, const RenderJob& rj, const ChunkUseCounts& uc);
+	// stop the threads (dropping anything still queued)
+	~ChunkDecodePool();
+
+	// a render thread is about to draw a base tile
+	void prefetch(const TileIdx& ti, const RenderJob& rj);
+
+	// add the threads' cache stats to some others
+	void addStats(RenderStats& stats) const;
+
+	// internal: called by the threads to get the next chunk (blocks until there is one); returns false
+	//  if we're shutting down
+	bool getWork(PosChunkIdx& ci);
+
+	Mutex mutex;
+	Condition workavailable;
+	std::deque<PosChunkIdx> pending;  // waiting to be read
+	std::set<std::pair<int64_t, int64_t> > queued;  // base tiles whose chunks we've already queued (until they're drawn)
+	const ChunkUseCounts& usecounts;
+	RenderJob *workers;  // one per thread (for its caches and stats)
+	int nworkers;
+	std::vector<pthread_t> pthrs;  // (only the ones that actually started)
+	bool stopping;
+};
+
+// how many base tiles after the current one a render thread asks the ChunkDecodePool for
+#define PREFETCHTILES 16
+// at most this many chunks are queued in a ChunkDecodePool at once
+#define PREFETCHMAXPENDING 4096
+
+
 struct SceneGraph;
 struct TileCache;
-struct ThreadOutputCache;
 
 struct RenderJob : private nocopy
 {
@@ -50,23 +154,33 @@ struct RenderJob : private nocopy
 	bool regionformat;  // whether the world is in region format (chunk format assumed if not)
 	MapParams mp;
 	std::string inputpath, outputpath;
-	BlockImages blockimages;
+	const BlockImages *blockimages;  // shared by all threads
 	std::auto_ptr<ChunkTable> chunktable;
+	std::auto_ptr<SharedChunkCache> sharedchunkcache;  // if used, only the main RenderJob has one; the threads point to it
 	std::auto_ptr<ChunkCache> chunkcache;
 	std::auto_ptr<RegionTable> regiontable;
 	std::auto_ptr<RegionCache> regioncache;
-	std::auto_ptr<TileTable> tiletable;
+	TileTable *tiletable;  // shared by all threads (owned by whoever set up the main RenderJob)
 	std::auto_ptr<TileCache> tilecache;
 	std::auto_ptr<SceneGraph> scenegraph;  // reuse this for each tile to avoid reallocation
 	RenderStats stats;
+	RenderOptions opts;
+	PNGWriteQueue *pngqueue;  // if non-NULL, tiles are written through this (one queue is shared by all threads)
+	std::auto_ptr<PNGEncoder> pngencoder;  // otherwise, tiles are written with this (created when first needed)
+	ChunkUseCounts *usecounts;  // if non-NULL, updated as tiles are drawn (one is shared by all threads)
+	ChunkDecodePool *decodepool;  // if non-NULL, told about each tile before it's drawn (shared by all threads)
 
 	// don't actually draw anything or read chunks; just iterate through the data structures
 	// ...scenegraph, chunkcache, and regioncache are not required if in test mode
 	bool testmode;
+
+	RenderJob() : blockimages(NULL), tiletable(NULL), pngqueue(NULL), usecounts(NULL), decodepool(NULL) {}
 };
 
 // render a base tile into an RGBAImage, and also write it to disk
 // ...do nothing and return false if the tile is not required or is out of range
+// ...also return false if there turns out to be nothing in the tile; for incremental updates, the existing one
+//  (if any) is deleted
 bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile);
 
 // recursively render all the required tiles that a zoom tile depends on, and then the tile itself;
@@ -74,46 +188,84 @@ bool renderTile(const TileIdx& ti, RenderJob& rj, RGBAImage& tile);
 // do nothing and return false if the tile is not required
 bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile);
 
-// for second phase of multithreaded operation: recursively render all the required tiles that a zoom tile
-//  depends on, but stop recursing at the ThreadOutputCache level rather than the base tile level
-bool renderZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, const ThreadOutputCache& tocache);
+// zoom tiles are put together one subtile at a time, so that only the tile itself has to be held while its
+//  subtiles are being drawn: startZoomTile sets up the image (blank, or for incremental updates where fewer
+//  than all four subtiles are going to be drawn, the existing tile, so the unchanged parts show through),
+//  addSubtile reduces each finished subtile into its quadrant (childnum is in the order renderZoomTile uses:
+//  [0,0], [0,1], [1,0], [1,1] relative to the top-left one), or if subtile is NULL (a required subtile that
+//  came out empty), clears the quadrant, and finishZoomTile writes it to disk
+// ...finishZoomTile returns whether the tile has anything in it (used is whether any subtiles were added); if
+//  it doesn't, it isn't written, and for incremental updates, the existing one is deleted, since everything
+//  that was in it is gone
+// ...in test mode, these do nothing (except that finishZoomTile returns used)
+void startZoomTile(const ZoomTileIdx& zti, RenderJob& rj, RGBAImage& tile, int expected);
+void addSubtile(RenderJob& rj, RGBAImage& tile, int childnum, const RGBAImage *subtile);
+bool finishZoomTile(const ZoomTileIdx& zti, RenderJob& rj, const RGBAImage& tile, bool used);
 
 
 
-// as we render tiles recursively, we need to be able to hold 4 intermediate results at each zoom level;
-//  this holds the space for those images, so we don't reallocate all the time
+// as we render tiles recursively, we need somewhere to draw each subtile before it's reduced into its
+//  parent; this holds one image per zoom level, so we don't reallocate all the time
 struct TileCache
 {
-	struct ZoomLevel
-	{
-		bool used[4];  // which of the images actually have data
-		RGBAImage tiles[4];  // actual image data for the four tiles
-	};
-
-	std::vector<ZoomLevel> levels;  // indexed by baseZoom - zoom
+	std::vector<RGBAImage> levels;  // indexed by baseZoom - zoom - 1
 
 	TileCache(const MapParams& mp) : levels(mp.baseZoom)
 	{
 		// reserve memory
 		for (int i = 0; i < mp.baseZoom; i++)
-			for (int j = 0; j < 4; j++)
-				levels[i].tiles[j].create(mp.tileSize(), mp.tileSize());
+			levels[i].create(mp.tileSize(), mp.tileSize());
 	}
 };
 
-
-// when rendering with multiple threads, the individual threads only go up to a certain zoom level, then
-//  the main thread does the last few levels on its own; the worker threads store their results in this
-struct ThreadOutputCache
+// holds the zoom tiles that the worker threads are putting together (see runMultithreaded): each one is
+//  started when its task is split, each subtile is reduced into it by whichever thread drew that subtile,
+//  and it's taken out once the last one is done
+// ...if the tiles in memory would go over the budget, the idle ones that were added to least recently are
+//  written out to a scratch file, and from then on their subtiles are reduced straight into the file; they
+//  come back into memory when they're taken
+struct PartialTileStore : private nocopy
 {
-    int zoom;  // which zoom level the threads are working at
-
-	std::vector<RGBAImage> images;  // use getIndex() to get index into this from zoom tile
-	std::vector<bool> used;  // which images actually have data
+	struct Entry
+	{
+		RGBAImage image;  // empty while spilled
+		int64_t slot;  // which tile-sized slot of the scratch file it's in, or -1 if it's in memory
+		int busy;  // threads reducing subtiles into the image right now (it can't be spilled until they're done)
+		uint64_t lastused;
 
-	int getIndex(const ZoomTileIdx& zti) const;  // get index into images, or -1 if zoom is wrong
+		Entry() : slot(-1), busy(0), lastused(0) {}
+	};
 
-	ThreadOutputCache(int z) : zoom(z), images((1 << zoom) * (1 << zoom)), used((1 << zoom) * (1 << zoom), false) {}
+	// budget is in bytes; the scratch file isn't created unless something needs to be spilled
+	PartialTileStore(const MapParams& mp, int64_t budget, const std::string& scratchfile, bool alphaweighted);
+	// deletes the scratch file
+	~PartialTileStore();
+
+	// add a tile, and initialize it with startZoomTile
+	Entry* start(const ZoomTileIdx& zti, RenderJob& rj, int expected);
+	// reduce a subtile into a tile (threads may do this at the same time for different subtiles); a NULL
+	//  subtile clears its quadrant instead
+	void add(Entry *entry, int childnum, const RGBAImage *subtile);
+	// move a tile's image out, and delete the entry (only once nothing else will be added to it)
+	void take(Entry *entry, RGBAImage& tile);
+
+	int tilesize;
+	int64_t tilebytes, budget;
+	std::string scratchfile;
+	int fd;  // -1 until the scratch file is created (or if it couldn't be)
+	bool fileerror;  // if the scratch file failed us once, we stop trying to use it
+	bool alphaweighted;  // passed to reduceHalf
+
+	Mutex mutex;  // protects everything below
+	std::vector<Entry*> entries;
+	int64_t memused;  // bytes of entries in memory
+	uint64_t clock;  // for lastused
+	std::vector<int64_t> freeslots;  // slots in the scratch file that can be reused
+	int64_t nextslot;  // first slot past the end of the file
+	int64_t spilled;  // how many times tiles have been written out
+
+	// internal: write out idle tiles until there's room for one more (mutex must be held)
+	void makeRoom();
 };
 
 
@@ -126,6 +278,7 @@ struct ThreadOutputCache
 // ...so we can build a DAG representing the blocks in the tile: each block has up to 7 pointers, each one going to
 //  the topmost occluded block in a pseudocolumn
 // a block can be drawn when all its descendents have been drawn
+// alternatively, the nodes can just be drawn in order of their depth (distance from the viewer); see drawDepthOrder
 
 struct SceneGraphNode
 {
@@ -158,6 +311,8 @@ struct SceneGraph
 
 	// scratch space for use while traversing the DAG
 	std::vector<int> nodestack;
+	// ...or, if drawing in depth order, for sorting the nodes
+	std::vector<int> order, depthcounts;
 
 	SceneGraph() {nodes.reserve(2048);}
 };
@@ -204,6 +359,64 @@ struct PseudocolumnIterator
 	void advance();
 };
 
+// same as PseudocolumnIterator, but also looks up the chunk data as it goes, and uses the chunks' height
+//  summaries to skip over blocks that are above the tops of their columns (and so must be air)
+struct ChunkPseudocolumnIterator
+{
+	bool end;  // true when we've run out of blocks
+	BlockIdx current;  // when end == false, holds current block
+	PosChunkIdx ci;  // ...and the chunk it's in
+	ChunkData *chunkdata;  // ...and that chunk's data
+
+	const MapParams& mparams;
+	ChunkCache& chunkcache;
+
+	// constructor initializes to topmost block that might not be air
+	ChunkPseudocolumnIterator(const Pixel& center, const MapParams& mp, ChunkCache& cc);
+
+	// move to the next block that might not be air, or the end
+	void advance();
+
+	// starting from the current block, move down to the first one that might not be air
+	void skipAir();
+};
+
+// the 3x3 chunks around the one the renderer is currently in, so that looking up neighboring blocks in other
+//  chunks doesn't have to go through the ChunkCache each time
+// ...chunks are looked up the first time they're needed; if the ChunkCache's generation changes, we forget
+//  them all
+struct ChunkWindow
+{
+	PosChunkIdx center;
+	ChunkData *chunks[9];  // indexed by (dx+1)*3 + (dz+1); NULL if not looked up yet
+	uint64_t generation;  // ChunkCache generation when we looked them up
+	ChunkCache& chunkcache;
+
+	ChunkWindow(ChunkCache& cc) : center(-1,-1), generation(cc.generation), chunkcache(cc)
+	{
+		std::fill(chunks, chunks + 9, (ChunkData*)NULL);
+	}
+
+	// move the window to another chunk, whose data the caller already has
+	void recenter(const PosChunkIdx& ci, ChunkData *chunkdata);
+
+	// get a chunk's data; it doesn't have to be inside the window, but it's much faster if it is
+	ChunkData* getData(const PosChunkIdx& ci)
+	{
+		int64_t dx = ci.x - center.x, dz = ci.z - center.z;
+		if (dx < -1 || dx > 1 || dz < -1 || dz > 1)
+			return chunkcache.getData(ci);
+		if (generation != chunkcache.generation)
+			forget();
+		ChunkData *& chunkdata = chunks[(dx + 1) * 3 + dz + 1];
+		if (chunkdata == NULL)
+			chunkdata = chunkcache.getData(ci);
+		return chunkdata;
+	}
+
+	void forget();
+};
+
 
 
 
@@ -16,11 +16,22 @@
 // along with pigmap.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <png.h>
+#include <zlib.h>
 #include <errno.h>
+#include <string.h>
 
 #include "rgba.h"
 #include "utils.h"
 
+// SIMD kernels are compiled with per-function target attributes, so no special compiler flags are
+//  needed, and the CPU is checked at runtime before they're used
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define USE_X86_SIMD 0
+#endif
+
 using namespace std;
 
 # ifndef UINT64_C
@@ -156,20 +167,23 @@ bool RGBAImage::readPNG(const string& filename)
 	return true;
 }
 
-bool RGBAImage::writePNG(const string& filename)
+FILE *openForWriting(const string& filename)
 {
 	FILE *f = fopen(filename.c_str(), "wb");
-	if (f == NULL)
+	// if the directory didn't exist, create it and try again
+	if (f == NULL && errno == ENOENT)
 	{
-		// if the directory didn't exist, create it and try again
-		if (errno == ENOENT)
-		{
-			makePath(filename.substr(0, filename.rfind('/')));
-			f = fopen(filename.c_str(), "wb");
-		}
-		if (f == NULL)
-			return false;
+		makePath(filename.substr(0, filename.rfind('/')));
+		f = fopen(filename.c_str(), "wb");
 	}
+	return f;
+}
+
+bool RGBAImage::writePNG(const string& filename)
+{
+	FILE *f = openForWriting(filename);
+	if (f == NULL)
+		return false;
 	fcloser fc(f);
 
 	PNGWriteCleaner cleaner;
@@ -211,6 +225,219 @@ bool RGBAImage::writePNG(const string& filename)
 
 
 
+
+
+
+bool PNGEncoder::validProfile(const string& profile)
+{
+	return profile == "default" || profile == "fast" || profile == "small";
+}
+
+PNGEncoder::PNGEncoder(const string& profile, bool premult) : premultiplied(premult)
+{
+	// libpng's defaults for RGBA images
+	level = 6;
+	strategy = Z_FILTERED;
+	filter = -1;
+	// trade some size for much quicker compression (Z_RLE is quicker still, but the block textures are
+	//  too noisy for it, and the tiles come out more than twice as big)
+	if (profile == "fast")
+	{
+		level = 1;
+		strategy = Z_DEFAULT_STRATEGY;
+		filter = 2;
+	}
+	// ...or the other way around
+	else if (profile == "small")
+	{
+		level = 9;
+		strategy = Z_DEFAULT_STRATEGY;
+		filter = -1;
+	}
+
+	zs = new z_stream;
+	zs->zalloc = Z_NULL;
+	zs->zfree = Z_NULL;
+	zs->opaque = Z_NULL;
+	if (Z_OK != deflateInit2(zs, level, Z_DEFLATED, 15, 8, strategy))
+	{
+		delete zs;
+		zs = NULL;
+	}
+}
+
+PNGEncoder::~PNGEncoder()
+{
+	if (zs != NULL)
+	{
+		deflateEnd(zs);
+		delete zs;
+	}
+}
+
+inline int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+// apply one of the PNG filters to a row of 4-byte pixels; prev is the previous row (all zeros for the
+//  first row)
+void filterRow(int filter, const uint8_t *row, const uint8_t *prev, uint8_t *out, int rowbytes)
+{
+	switch (filter)
+	{
+		case 0:
+			memcpy(out, row, rowbytes);
+			break;
+		case 1:
+			memcpy(out, row, 4);
+			for (int i = 4; i < rowbytes; i++)
+				out[i] = row[i] - row[i-4];
+			break;
+		case 2:
+			for (int i = 0; i < rowbytes; i++)
+				out[i] = row[i] - prev[i];
+			break;
+		case 3:
+			for (int i = 0; i < 4; i++)
+				out[i] = row[i] - (prev[i] >> 1);
+			for (int i = 4; i < rowbytes; i++)
+				out[i] = row[i] - ((row[i-4] + prev[i]) >> 1);
+			break;
+		case 4:
+			for (int i = 0; i < 4; i++)
+				out[i] = row[i] - prev[i];
+			for (int i = 4; i < rowbytes; i++)
+				out[i] = row[i] - paeth(row[i-4], prev[i], prev[i-4]);
+			break;
+	}
+}
+
+// libpng's heuristic for picking a filter: the sum of the filtered bytes' absolute values (treating
+//  them as signed), where smaller is better
+int filterCost(const uint8_t *out, int rowbytes)
+{
+	int cost = 0;
+	for (int i = 0; i < rowbytes; i++)
+		cost += out[i] < 128 ? out[i] : 256 - out[i];
+	return cost;
+}
+
+void putBigEndian32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+bool writePNGChunk(FILE *f, const char *type, const uint8_t *data, uint32_t length)
+{
+	uint8_t header[8], footer[4];
+	putBigEndian32(header, length);
+	memcpy(header + 4, type, 4);
+	uLong crc = crc32(0, header + 4, 4);
+	if (length > 0)
+		crc = crc32(crc, data, length);
+	putBigEndian32(footer, crc);
+	return fwrite(header, 8, 1, f) == 1 && (length == 0 || fwrite(data, length, 1, f) == 1) && fwrite(footer, 4, 1, f) == 1;
+}
+
+bool PNGEncoder::write(const RGBAImage& img, const string& filename)
+{
+	if (zs == NULL)
+		return false;
+
+	// filter the rows
+	int rowbytes = img.w * 4;
+	filtered.resize((rowbytes + 1) * img.h);
+	scratch.resize(rowbytes * 8);
+	uint8_t *zeros = &scratch[0], *trials = &scratch[rowbytes];
+	uint8_t *swapped[2] = {&scratch[rowbytes*6], &scratch[rowbytes*7]};
+	memset(zeros, 0, rowbytes);
+	bool bigendian = isBigEndian();
+	const uint8_t *prev = zeros;
+	for (int32_t y = 0; y < img.h; y++)
+	{
+		// rows need to be in RGBA byte order, which is what we already have on little-endian machines
+		// (on big-endian ones, or if we have to convert from premultiplied alpha, alternate between two
+		//  buffers, so the previous row is still around)
+		const uint8_t *row = (const uint8_t*)&img.data[y*img.w];
+		if (bigendian || premultiplied)
+		{
+			uint8_t *buf = swapped[y % 2];
+			for (int32_t x = 0; x < img.w; x++)
+			{
+				RGBAPixel p = img.data[y*img.w + x];
+				if (premultiplied)
+					p = unpremultiply(p);
+				buf[x*4] = RED(p);
+				buf[x*4+1] = GREEN(p);
+				buf[x*4+2] = BLUE(p);
+				buf[x*4+3] = ALPHA(p);
+			}
+			row = buf;
+		}
+		uint8_t *out = &filtered[y*(rowbytes + 1)];
+		if (filter >= 0)
+		{
+			out[0] = filter;
+			filterRow(filter, row, prev, out + 1, rowbytes);
+		}
+		else
+		{
+			int best = 0, bestcost = 0;
+			for (int f = 0; f < 5; f++)
+			{
+				filterRow(f, row, prev, trials + f*rowbytes, rowbytes);
+				int cost = filterCost(trials + f*rowbytes, rowbytes);
+				if (f == 0 || cost < bestcost)
+				{
+					best = f;
+					bestcost = cost;
+				}
+			}
+			out[0] = best;
+			memcpy(out + 1, trials + best*rowbytes, rowbytes);
+		}
+		prev = row;
+	}
+
+	// compress them
+	if (Z_OK != deflateReset(zs))
+		return false;
+	compressed.resize(deflateBound(zs, filtered.size()));
+	zs->next_in = &filtered[0];
+	zs->avail_in = filtered.size();
+	zs->next_out = &compressed[0];
+	zs->avail_out = compressed.size();
+	if (Z_STREAM_END != deflate(zs, Z_FINISH))
+		return false;
+
+	// write the file
+	FILE *f = openForWriting(filename);
+	if (f == NULL)
+		return false;
+	fcloser fc(f);
+	static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+	uint8_t ihdr[13];
+	putBigEndian32(ihdr, img.w);
+	putBigEndian32(ihdr + 4, img.h);
+	ihdr[8] = 8;  // bit depth
+	ihdr[9] = 6;  // color type RGBA
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;  // deflate, adaptive filtering, no interlacing
+	return fwrite(signature, 8, 1, f) == 1 && writePNGChunk(f, "IHDR", ihdr, 13) &&
+	       writePNGChunk(f, "IDAT", &compressed[0], zs->total_out) && writePNGChunk(f, "IEND", NULL, 0);
+}
+
+
+
 void fullblend(RGBAPixel& dest, const RGBAPixel& source)
 {
 	// get sa and sainv in the range 1-256; this way, the possible results of blending 8-bit color channels sc and dc
@@ -264,30 +491,436 @@ void blend(RGBAPixel& dest, const RGBAPixel& source)
 		fullblend(dest, source);
 }
 
+void blendRowScalar(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+		blend(dest[i], source[i]);
+}
+
+// x/255, rounded to nearest, for x in 0-65025 (this fits in 16 bits throughout, so the SIMD versions
+//  can do it the same way)
+static inline uint32_t div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+RGBAPixel premultiply(RGBAPixel p)
+{
+	uint32_t a = ALPHA(p);
+	if (a == 255)
+		return p;
+	return makeRGBA(div255(RED(p) * a), div255(GREEN(p) * a), div255(BLUE(p) * a), a);
+}
+
+RGBAPixel unpremultiply(RGBAPixel p)
+{
+	uint32_t a = ALPHA(p);
+	if (a == 255 || a == 0)
+		return p;
+	return makeRGBA(min<uint32_t>(255, (RED(p) * 255 + a/2) / a), min<uint32_t>(255, (GREEN(p) * 255 + a/2) / a),
+	                min<uint32_t>(255, (BLUE(p) * 255 + a/2) / a), a);
+}
+
+void premultiplyImage(RGBAImage& img)
+{
+	for (vector<RGBAPixel>::iterator it = img.data.begin(); it != img.data.end(); it++)
+		*it = premultiply(*it);
+}
+
+void blendPremultiplied(RGBAPixel& dest, const RGBAPixel& source)
+{
+	uint32_t sainv = 255 - ALPHA(source), d = dest;
+	dest = source + (div255(RED(d) * sainv) | (div255(GREEN(d) * sainv) << 8) | (div255(BLUE(d) * sainv) << 16) | (div255(ALPHA(d) * sainv) << 24));
+}
+
+void blendRowPremultipliedScalar(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+		blendPremultiplied(dest[i], source[i]);
+}
+
+#if USE_X86_SIMD
+
+// the SIMD versions don't branch per pixel; they rely on the fact that the fullblend formulas, done in
+//  16-bit lanes, give exactly the same results as the special cases in blend():
+//  -for a transparent source, the color is (d*256 + s)>>8 == d, and the alpha is
+//   255 - ((256*(256-da) - 1)>>8) == da (even for da == 0, where the product wraps to 0)
+//  -for an opaque source, the color is (s*256 + d)>>8 == s, and the alpha is 255
+//  -for an opaque dest, the alpha is 255 - (((256-sa) - 1)>>8) == 255
+// ...so the only case that needs to be patched up afterwards is a transparent dest (with a non-transparent
+//  source), where blend() just copies the source
+
+// blend pixels that have been unpacked to 16 bits per channel
+__attribute__((target("sse2"))) static inline
+__m128i blend16SSE2(__m128i s16, __m128i d16)
+{
+	const __m128i c1 = _mm_set1_epi16(1), c255 = _mm_set1_epi16(255), c256 = _mm_set1_epi16(256);
+	const __m128i amask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+	__m128i da = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d16, 0xff), 0xff);
+	__m128i sainv = _mm_sub_epi16(c256, sa);
+	__m128i rgb = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s16, _mm_add_epi16(sa, c1)), _mm_mullo_epi16(d16, sainv)), 8);
+	__m128i a = _mm_sub_epi16(c255, _mm_srli_epi16(_mm_sub_epi16(_mm_mullo_epi16(sainv, _mm_sub_epi16(c256, da)), c1), 8));
+	return _mm_or_si128(_mm_andnot_si128(amask, rgb), _mm_and_si128(amask, a));
+}
+
+__attribute__((target("sse2")))
+void blendRowSSE2(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i amask = _mm_set1_epi32(0xff000000);
+	int32_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(source + i));
+		__m128i sa = _mm_and_si128(s, amask);
+		// if all the source pixels are transparent, there's nothing to do; if they're all opaque, just copy
+		__m128i stransparent = _mm_cmpeq_epi32(sa, zero);
+		if (_mm_movemask_epi8(stransparent) == 0xffff)
+			continue;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, amask)) == 0xffff)
+		{
+			_mm_storeu_si128((__m128i*)(dest + i), s);
+			continue;
+		}
+		__m128i d = _mm_loadu_si128((const __m128i*)(dest + i));
+		__m128i lo = blend16SSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+		__m128i hi = blend16SSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+		__m128i result = _mm_packus_epi16(lo, hi);
+		// where the dest is transparent and the source isn't, take the source
+		__m128i sel = _mm_andnot_si128(stransparent, _mm_cmpeq_epi32(_mm_and_si128(d, amask), zero));
+		result = _mm_or_si128(_mm_and_si128(sel, s), _mm_andnot_si128(sel, result));
+		_mm_storeu_si128((__m128i*)(dest + i), result);
+	}
+	blendRowScalar(dest + i, source + i, n - i);
+}
+
+// same as the SSE2 versions, but twice as wide (the unpacks, shuffles, and packs all work within
+//  128-bit halves, so the pixels come back out in the right order)
+__attribute__((target("avx2"))) static inline
+__m256i blend16AVX2(__m256i s16, __m256i d16)
+{
+	const __m256i c1 = _mm256_set1_epi16(1), c255 = _mm256_set1_epi16(255), c256 = _mm256_set1_epi16(256);
+	const __m256i amask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+	__m256i sa = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xff), 0xff);
+	__m256i da = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d16, 0xff), 0xff);
+	__m256i sainv = _mm256_sub_epi16(c256, sa);
+	__m256i rgb = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s16, _mm256_add_epi16(sa, c1)), _mm256_mullo_epi16(d16, sainv)), 8);
+	__m256i a = _mm256_sub_epi16(c255, _mm256_srli_epi16(_mm256_sub_epi16(_mm256_mullo_epi16(sainv, _mm256_sub_epi16(c256, da)), c1), 8));
+	return _mm256_blendv_epi8(rgb, a, amask);
+}
+
+__attribute__((target("avx2")))
+void blendRowAVX2(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i amask = _mm256_set1_epi32(0xff000000);
+	int32_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(source + i));
+		__m256i sa = _mm256_and_si256(s, amask);
+		__m256i stransparent = _mm256_cmpeq_epi32(sa, zero);
+		if (_mm256_movemask_epi8(stransparent) == -1)
+			continue;
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, amask)) == -1)
+		{
+			_mm256_storeu_si256((__m256i*)(dest + i), s);
+			continue;
+		}
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dest + i));
+		__m256i lo = blend16AVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+		__m256i hi = blend16AVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+		__m256i result = _mm256_packus_epi16(lo, hi);
+		__m256i sel = _mm256_andnot_si256(stransparent, _mm256_cmpeq_epi32(_mm256_and_si256(d, amask), zero));
+		result = _mm256_blendv_epi8(result, s, sel);
+		_mm256_storeu_si256((__m256i*)(dest + i), result);
+	}
+	blendRowSSE2(dest + i, source + i, n - i);
+}
+
+// premultiplied blending is the same formula on every channel, so there's nothing to special-case; the
+//  products and the div255 rounding all fit in unsigned 16-bit lanes
+__attribute__((target("sse2"))) static inline
+__m128i blendPremultiplied16SSE2(__m128i s16, __m128i d16)
+{
+	const __m128i c128 = _mm_set1_epi16(128), c255 = _mm_set1_epi16(255);
+	__m128i sainv = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff));
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(d16, sainv), c128);
+	return _mm_add_epi16(s16, _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8));
+}
+
+__attribute__((target("sse2")))
+void blendRowPremultipliedSSE2(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int32_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(source + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dest + i));
+		__m128i lo = blendPremultiplied16SSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+		__m128i hi = blendPremultiplied16SSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+	}
+	blendRowPremultipliedScalar(dest + i, source + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline
+__m256i blendPremultiplied16AVX2(__m256i s16, __m256i d16)
+{
+	const __m256i c128 = _mm256_set1_epi16(128), c255 = _mm256_set1_epi16(255);
+	__m256i sainv = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xff), 0xff));
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d16, sainv), c128);
+	return _mm256_add_epi16(s16, _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8));
+}
+
+__attribute__((target("avx2")))
+void blendRowPremultipliedAVX2(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int32_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(source + i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dest + i));
+		__m256i lo = blendPremultiplied16AVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+		__m256i hi = blendPremultiplied16AVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_packus_epi16(lo, hi));
+	}
+	blendRowPremultipliedSSE2(dest + i, source + i, n - i);
+}
+
+bool cpuSupportsBlendImpl(int impl)
+{
+	__builtin_cpu_init();
+	if (impl == BLEND_SCALAR)
+		return true;
+	if (impl == BLEND_SSE2)
+		return __builtin_cpu_supports("sse2");
+	if (impl == BLEND_AVX2)
+		return __builtin_cpu_supports("avx2");
+	return false;
+}
+
+#else
+
+bool cpuSupportsBlendImpl(int impl)
+{
+	return impl == BLEND_SCALAR;
+}
+
+#endif // USE_X86_SIMD
+
+typedef void (*BlendRowFunc)(RGBAPixel *dest, const RGBAPixel *source, int32_t n);
+
+int blendimpl = BLEND_SCALAR;
+BlendRowFunc blendrowfunc = blendRowScalar;
+BlendRowFunc premultipliedblendrowfunc = blendRowPremultipliedScalar;
+
+bool setBlendImpl(int impl)
+{
+	if (!cpuSupportsBlendImpl(impl))
+		return false;
+	blendimpl = impl;
+#if USE_X86_SIMD
+	if (impl == BLEND_AVX2)
+	{
+		blendrowfunc = blendRowAVX2;
+		premultipliedblendrowfunc = blendRowPremultipliedAVX2;
+	}
+	else if (impl == BLEND_SSE2)
+	{
+		blendrowfunc = blendRowSSE2;
+		premultipliedblendrowfunc = blendRowPremultipliedSSE2;
+	}
+	else
+#endif
+	{
+		blendrowfunc = blendRowScalar;
+		premultipliedblendrowfunc = blendRowPremultipliedScalar;
+	}
+	return true;
+}
+
+int getBlendImpl()
+{
+	return blendimpl;
+}
+
+// pick the best implementation at startup, before any threads exist
+bool blendimplpicked = setBlendImpl(BLEND_AVX2) || setBlendImpl(BLEND_SSE2);
+
+void blendRow(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	blendrowfunc(dest, source, n);
+}
+
+void blendRowPremultiplied(RGBAPixel *dest, const RGBAPixel *source, int32_t n)
+{
+	premultipliedblendrowfunc(dest, source, n);
+}
+
 void alphablit(const RGBAImage& source, const ImageRect& srect, RGBAImage& dest, int32_t dxstart, int32_t dystart)
 {
 	int32_t ybegin = max(0, max(-srect.y, -dystart));
 	int32_t yend = min(srect.h, min(source.h-srect.y, dest.h-dystart));
 	int32_t xbegin = max(0, max(-srect.x, -dxstart));
 	int32_t xend = min(srect.w, min(source.w-srect.x, dest.w-dxstart));
+	if (xend <= xbegin)
+		return;
 	for (int32_t yoff = ybegin, sy = srect.y + ybegin, dy = dystart + ybegin; yoff < yend; yoff++, sy++, dy++)
-		for (int32_t xoff = xbegin, sx = srect.x + xbegin, dx = dxstart + xbegin; xoff < xend; xoff++, sx++, dx++)
-			blend(dest(dx,dy), source(sx,sy));
+		blendRow(&dest(dxstart + xbegin, dy), &source(srect.x + xbegin, sy), xend - xbegin);
+}
+
+// average a 2x2 block of pixels, rounding each channel to nearest (halves round up)
+static inline RGBAPixel average4(RGBAPixel p1, RGBAPixel p2, RGBAPixel p3, RGBAPixel p4)
+{
+	// add up the even and odd channels separately, so each sum gets 16 bits to work with
+	uint32_t even = (p1 & 0xff00ff) + (p2 & 0xff00ff) + (p3 & 0xff00ff) + (p4 & 0xff00ff) + 0x20002;
+	uint32_t odd = ((p1 >> 8) & 0xff00ff) + ((p2 >> 8) & 0xff00ff) + ((p3 >> 8) & 0xff00ff) + ((p4 >> 8) & 0xff00ff) + 0x20002;
+	return ((even >> 2) & 0xff00ff) | (((odd >> 2) & 0xff00ff) << 8);
+}
+
+// same, but with the color channels weighted by alpha, so the (meaningless) colors of transparent pixels
+//  don't bleed into their neighbors; the alpha channel is a plain average
+static inline RGBAPixel weightedAverage4(RGBAPixel p1, RGBAPixel p2, RGBAPixel p3, RGBAPixel p4)
+{
+	uint32_t a1 = ALPHA(p1), a2 = ALPHA(p2), a3 = ALPHA(p3), a4 = ALPHA(p4);
+	uint32_t a = a1 + a2 + a3 + a4;
+	if (a == 0)
+		return 0;
+	uint32_t r = (2 * (RED(p1)*a1 + RED(p2)*a2 + RED(p3)*a3 + RED(p4)*a4) + a) / (2 * a);
+	uint32_t g = (2 * (GREEN(p1)*a1 + GREEN(p2)*a2 + GREEN(p3)*a3 + GREEN(p4)*a4) + a) / (2 * a);
+	uint32_t b = (2 * (BLUE(p1)*a1 + BLUE(p2)*a2 + BLUE(p3)*a3 + BLUE(p4)*a4) + a) / (2 * a);
+	return makeRGBA(r, g, b, (a + 2) >> 2);
+}
+
+// reduce n pairs of source pixels from each of two rows into n dest pixels
+void reduceRowScalar(RGBAPixel *dest, const RGBAPixel *s0, const RGBAPixel *s1, int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+		dest[i] = average4(s0[2*i], s0[2*i+1], s1[2*i], s1[2*i+1]);
 }
 
-void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source)
+void reduceRowWeightedScalar(RGBAPixel *dest, const RGBAPixel *s0, const RGBAPixel *s1, int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+		dest[i] = weightedAverage4(s0[2*i], s0[2*i+1], s1[2*i], s1[2*i+1]);
+}
+
+#if USE_X86_SIMD
+
+// add up the 2x2 blocks in 4 pixels from each row, giving 2 pixels with 16-bit channels
+__attribute__((target("sse2"))) static inline
+__m128i sum2x2SSE2(__m128i top, __m128i bottom)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));  // columns 0, 1
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));  // columns 2, 3
+	return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+}
+
+__attribute__((target("sse2")))
+void reduceRowSSE2(RGBAPixel *dest, const RGBAPixel *s0, const RGBAPixel *s1, int32_t n)
+{
+	const __m128i c2 = _mm_set1_epi16(2);
+	int32_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i lo = sum2x2SSE2(_mm_loadu_si128((const __m128i*)(s0 + 2*i)), _mm_loadu_si128((const __m128i*)(s1 + 2*i)));
+		__m128i hi = sum2x2SSE2(_mm_loadu_si128((const __m128i*)(s0 + 2*i + 4)), _mm_loadu_si128((const __m128i*)(s1 + 2*i + 4)));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, c2), 2);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, c2), 2);
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+	}
+	reduceRowScalar(dest + i, s0 + 2*i, s1 + 2*i, n - i);
+}
+
+// the weighted version does one dest pixel at a time, with a channel in each lane; the products and their
+//  sums fit easily in 32 bits, and the division is done in floating point, which gives exactly the same
+//  rounded results as the integer version: a quotient with a denominator of at most 1020 is never closer
+//  than 1/2040 to a rounding boundary unless it's right on it, and single precision is far more accurate
+//  than that
+__attribute__((target("sse2")))
+void reduceRowWeightedSSE2(RGBAPixel *dest, const RGBAPixel *s0, const RGBAPixel *s1, int32_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i amask = _mm_set_epi32(-1, 0, 0, 0);
+	for (int32_t i = 0; i < n; i++)
+	{
+		__m128i top = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s0 + 2*i)), zero);
+		__m128i bottom = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s1 + 2*i)), zero);
+		__m128i ta = _mm_shufflehi_epi16(_mm_shufflelo_epi16(top, 0xff), 0xff);
+		__m128i ba = _mm_shufflehi_epi16(_mm_shufflelo_epi16(bottom, 0xff), 0xff);
+		// total alpha, in each 32-bit lane
+		__m128i a = _mm_add_epi16(ta, ba);
+		a = _mm_unpacklo_epi16(_mm_add_epi16(a, _mm_srli_si128(a, 8)), zero);
+		if (_mm_cvtsi128_si32(a) == 0)
+		{
+			dest[i] = 0;
+			continue;
+		}
+		// (the products are at most 255*255, so they still fit in unsigned 16-bit lanes)
+		__m128i tp = _mm_mullo_epi16(top, ta), bp = _mm_mullo_epi16(bottom, ba);
+		__m128i sums = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(tp, zero), _mm_unpackhi_epi16(tp, zero)),
+		                             _mm_add_epi32(_mm_unpacklo_epi16(bp, zero), _mm_unpackhi_epi16(bp, zero)));
+		__m128i result = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(sums), _mm_cvtepi32_ps(a)), _mm_set1_ps(0.5f)));
+		__m128i avga = _mm_srli_epi32(_mm_add_epi32(a, _mm_set1_epi32(2)), 2);
+		result = _mm_or_si128(_mm_andnot_si128(amask, result), _mm_and_si128(amask, avga));
+		result = _mm_packs_epi32(result, result);
+		dest[i] = _mm_cvtsi128_si32(_mm_packus_epi16(result, result));
+	}
+}
+
+// same as sum2x2SSE2, but with 8 pixels from each row; since the unpacks work within 128-bit halves, the
+//  4 sums come out in order
+__attribute__((target("avx2"))) static inline
+__m256i sum2x2AVX2(__m256i top, __m256i bottom)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(top, zero), _mm256_unpacklo_epi8(bottom, zero));
+	__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(top, zero), _mm256_unpackhi_epi8(bottom, zero));
+	return _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+}
+
+__attribute__((target("avx2")))
+void reduceRowAVX2(RGBAPixel *dest, const RGBAPixel *s0, const RGBAPixel *s1, int32_t n)
+{
+	const __m256i c2 = _mm256_set1_epi16(2);
+	int32_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i lo = sum2x2AVX2(_mm256_loadu_si256((const __m256i*)(s0 + 2*i)), _mm256_loadu_si256((const __m256i*)(s1 + 2*i)));
+		__m256i hi = sum2x2AVX2(_mm256_loadu_si256((const __m256i*)(s0 + 2*i + 8)), _mm256_loadu_si256((const __m256i*)(s1 + 2*i + 8)));
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, c2), 2);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, c2), 2);
+		// the pack interleaves the halves: 0 1 4 5 | 2 3 6 7
+		__m256i result = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i*)(dest + i), result);
+	}
+	reduceRowSSE2(dest + i, s0 + 2*i, s1 + 2*i, n - i);
+}
+
+#endif // USE_X86_SIMD
+
+typedef void (*ReduceRowFunc)(RGBAPixel *dest, const RGBAPixel *s0, const RGBAPixel *s1, int32_t n);
+
+void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source, bool alphaweighted)
 {
 	if (source.w != drect.w*2 || source.h != drect.h*2)
 		return;
+	// (there's no AVX2 version of the weighted kernel; it's limited by the division anyway)
+	ReduceRowFunc reducerow = alphaweighted ? reduceRowWeightedScalar : reduceRowScalar;
+#if USE_X86_SIMD
+	if (blendimpl == BLEND_AVX2 && !alphaweighted)
+		reducerow = reduceRowAVX2;
+	else if (blendimpl != BLEND_SCALAR)
+		reducerow = alphaweighted ? reduceRowWeightedSSE2 : reduceRowSSE2;
+#endif
 	for (int32_t dy = drect.y, sy = 0; sy < source.h; dy++, sy += 2)
-		for (int32_t dx = drect.x, sx = 0; sx < source.w; dx++, sx += 2)
-		{
-			RGBAPixel p1 = (source(sx, sy) >> 2) & 0x3f3f3f3f;
-			RGBAPixel p2 = (source(sx+1, sy) >> 2) & 0x3f3f3f3f;
-			RGBAPixel p3 = (source(sx, sy+1) >> 2) & 0x3f3f3f3f;
-			RGBAPixel p4 = (source(sx+1, sy+1) >> 2) & 0x3f3f3f3f;
-			dest(dx, dy) = p1 + p2 + p3 + p4;
-		}
+		reducerow(&dest(drect.x, dy), &source(0, sy), &source(0, sy + 1), drect.w);
 }
 
 
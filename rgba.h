@@ -22,6 +22,8 @@
 #include <string>
 #include <stdint.h>
 
+#include "utils.h"
+
 
 typedef uint32_t RGBAPixel;
 #define ALPHA(x) ((x & 0xff000000) >> 24)
@@ -52,6 +54,33 @@ struct RGBAImage
 	bool writePNG(const std::string& filename);
 };
 
+// writes PNGs with a choice of compression settings, keeping its zlib state and scratch buffers around
+//  between images instead of setting up libpng from scratch every time (so anything that writes lots of
+//  images, like each rendering thread, should keep one around)
+struct z_stream_s;
+struct PNGEncoder : private nocopy
+{
+	int level;  // zlib compression level: 1 (fastest) to 9 (smallest)
+	int strategy;  // zlib strategy: Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, etc.
+	int filter;  // PNG filter to use on every row (0-4: None, Sub, Up, Average, Paeth), or -1 to try them
+	             //  all on each row and keep the one that looks most compressible
+
+	bool premultiplied;  // images have premultiplied alpha, and are converted back to straight alpha as they're written
+
+	// settings come from a profile name: "default" (the same settings libpng uses by default), "fast", or "small"
+	PNGEncoder(const std::string& profile, bool premult = false);
+	~PNGEncoder();
+
+	static bool validProfile(const std::string& profile);
+
+	bool write(const RGBAImage& img, const std::string& filename);
+
+	z_stream_s *zs;  // NULL if zlib couldn't be initialized
+	std::vector<uint8_t> filtered;  // image data after filtering, with the filter type at the start of each row
+	std::vector<uint8_t> compressed;
+	std::vector<uint8_t> scratch;  // for trying all the filters on a row, and for byte-swapping on big-endian machines
+};
+
 struct ImageRect
 {
 	int32_t x, y, w, h;
@@ -68,12 +97,41 @@ struct ImageRect
 //  opaque one, the result stays opaque
 void blend(RGBAPixel& dest, const RGBAPixel& source);
 
+// blend a row of n source pixels onto a row of destination pixels; on x86, this uses SSE2 or AVX2 if
+//  the CPU has them, but the results are always exactly the same as calling blend() on each pixel
+void blendRow(RGBAPixel *dest, const RGBAPixel *source, int32_t n);
+
+// which implementation blendRow (and reduceHalf) uses; the best one available is picked at startup, but it
+//  can be changed (for testing); returns false if the CPU doesn't support the requested one
+#define BLEND_SCALAR 0
+#define BLEND_SSE2 1
+#define BLEND_AVX2 2
+bool setBlendImpl(int impl);
+int getBlendImpl();
+
+// premultiplied alpha: instead of straight RGBA, the color channels can be kept multiplied by alpha (rounded
+//  to nearest), which loses some color precision in translucent pixels, but makes blending a single
+//  multiply-add per channel (dest = source + dest * (255 - source alpha) / 255, with no special cases),
+//  and makes reduceHalf's plain average alpha-weighted (though only to within the rounding of the
+//  premultiplied values, so the lower the alpha, the further the colors can drift from reduceHalf's own
+//  alpha-weighted mode)
+// ...unpremultiply leaves fully transparent pixels as they are (they should be 0 anyway)
+RGBAPixel premultiply(RGBAPixel p);
+RGBAPixel unpremultiply(RGBAPixel p);
+void premultiplyImage(RGBAImage& img);
+void blendPremultiplied(RGBAPixel& dest, const RGBAPixel& source);
+// like blendRow, but premultiplied, and using the same implementation (scalar, SSE2, or AVX2)
+void blendRowPremultiplied(RGBAPixel *dest, const RGBAPixel *source, int32_t n);
+
 // alpha-blend source rect onto destination rect of same size
 void alphablit(const RGBAImage& source, const ImageRect& srect, RGBAImage& dest, int32_t dxstart, int32_t dystart);
 
-// reduce source image into destination rect half its size
+// reduce source image into destination rect half its size: each dest pixel is the average of a 2x2 block
+//  of source pixels, with each channel rounded to nearest; if alphaweighted is set, the color channels are
+//  weighted by alpha, so transparent pixels don't darken the edges of the opaque ones next to them
+// ...uses SSE2 or AVX2 if blendRow does, with exactly the same results
 // (does nothing if the ImageRect isn't exactly half the size of the source image)
-void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source);
+void reduceHalf(RGBAImage& dest, const ImageRect& drect, const RGBAImage& source, bool alphaweighted = false);
 
 
 //--------- these are used only to generate block images from terrain.png and may be crappy
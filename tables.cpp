@@ -23,20 +23,51 @@ using namespace std;
 
 
 
+// get the object a table slot points to, allocating it first if the slot is NULL; if several threads
+//  race to allocate the same slot, one of them wins and the others throw theirs away
+template <class T> T* getOrAllocate(T*& slot)
+{
+	T *p = slot;
+	if (p != NULL)
+		return p;
+	p = new T;
+	if (!__sync_bool_compare_and_swap(&slot, (T*)NULL, p))
+	{
+		delete p;
+		p = slot;
+	}
+	return p;
+}
+
+
+
+// pack every stride-th bit of a set's words (i.e. one of each item's bits) into bits-per-item words, and back
+template <size_t N> void packBits(const AtomicBitset<N>& bits, int stride, uint32_t *packed)
+{
+	memset(packed, 0, (N / stride + 31) / 32 * sizeof(uint32_t));
+	for (size_t i = 0; i < N / stride; i++)
+		if (bits[i * stride])
+			packed[i / 32] |= 1u << (i % 32);
+}
+
+template <size_t N> bool anyBits(const AtomicBitset<N>& bits, int stride)
+{
+	for (size_t i = 0; i < N; i += stride)
+		if (bits[i])
+			return true;
+	return false;
+}
+
+
+
 void ChunkGroup::setRequired(const PosChunkIdx& ci)
 {
-	int csi = chunkSetIdx(ci);
-	if (chunksets[csi] == NULL)
-		chunksets[csi] = new ChunkSet;
-	chunksets[csi]->setRequired(ci);
+	getOrAllocate(chunksets[chunkSetIdx(ci)])->setRequired(ci);
 }
 
 void ChunkGroup::setDiskState(const PosChunkIdx& ci, int state)
 {
-	int csi = chunkSetIdx(ci);
-	if (chunksets[csi] == NULL)
-		chunksets[csi] = new ChunkSet;
-	chunksets[csi]->setDiskState(ci, state);
+	getOrAllocate(chunksets[chunkSetIdx(ci)])->setDiskState(ci, state);
 }
 
 
@@ -56,36 +87,76 @@ PosChunkIdx ChunkTable::toPosChunkIdx(int cgi, int csi, int bi)
 
 void ChunkTable::setRequired(const PosChunkIdx& ci)
 {
-	int cgi = chunkGroupIdx(ci);
-	if (chunkgroups[cgi] == NULL)
-		chunkgroups[cgi] = new ChunkGroup;
-	chunkgroups[cgi]->setRequired(ci);
+	getOrAllocate(chunkgroups[chunkGroupIdx(ci)])->setRequired(ci);
 }
 
 void ChunkTable::setDiskState(const PosChunkIdx& ci, int state)
 {
-	int cgi = chunkGroupIdx(ci);
-	if (chunkgroups[cgi] == NULL)
-		chunkgroups[cgi] = new ChunkGroup;
-	chunkgroups[cgi]->setDiskState(ci, state);
+	getOrAllocate(chunkgroups[chunkGroupIdx(ci)])->setDiskState(ci, state);
 }
 
-void ChunkTable::copyFrom(const ChunkTable& ctable)
+void ChunkTable::clear()
 {
+	for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++)
+		if (chunkgroups[i] != NULL)
+		{
+			delete chunkgroups[i];
+			chunkgroups[i] = NULL;
+		}
+}
+
+int64_t ChunkTable::countRequired() const
+{
+	int64_t count = 0;
 	for (int cgi = 0; cgi < CTLEVEL3SIZE*CTLEVEL3SIZE; cgi++)
 	{
-		if (ctable.chunkgroups[cgi] != NULL)
+		if (chunkgroups[cgi] == NULL)
+			continue;
+		for (int csi = 0; csi < CTLEVEL2SIZE*CTLEVEL2SIZE; csi++)
 		{
-			chunkgroups[cgi] = new ChunkGroup;
-			for (int csi = 0; csi < CTLEVEL2SIZE*CTLEVEL2SIZE; csi++)
-			{
-				if (ctable.chunkgroups[cgi]->chunksets[csi] != NULL)
-				{
-					chunkgroups[cgi]->chunksets[csi] = new ChunkSet(*(ctable.chunkgroups[cgi]->chunksets[csi]));
-				}
-			}
+			ChunkSet *cs = chunkgroups[cgi]->chunksets[csi];
+			if (cs == NULL)
+				continue;
+			for (int w = 0; w < CTLEVEL1SIZE*CTLEVEL1SIZE*CTDATASIZE/32; w++)
+				count += __builtin_popcount(cs->bits.words[w] & 0x01010101);
 		}
 	}
+	return count;
+}
+
+#define CTPACKEDWORDS (CTLEVEL1SIZE*CTLEVEL1SIZE/32)
+
+void ChunkTable::saveRequired(vector<uint32_t>& words) const
+{
+	for (int cgi = 0; cgi < CTLEVEL3SIZE*CTLEVEL3SIZE; cgi++)
+	{
+		if (chunkgroups[cgi] == NULL)
+			continue;
+		for (int csi = 0; csi < CTLEVEL2SIZE*CTLEVEL2SIZE; csi++)
+		{
+			ChunkSet *cs = chunkgroups[cgi]->chunksets[csi];
+			if (cs == NULL || !anyBits(cs->bits, CTDATASIZE))
+				continue;
+			words.push_back(cgi);
+			words.push_back(csi);
+			words.resize(words.size() + CTPACKEDWORDS);
+			packBits(cs->bits, CTDATASIZE, &words[words.size() - CTPACKEDWORDS]);
+		}
+	}
+}
+
+bool ChunkTable::loadRequired(const vector<uint32_t>& words)
+{
+	for (size_t i = 0; i < words.size(); i += 2 + CTPACKEDWORDS)
+	{
+		if (words.size() - i < 2 + CTPACKEDWORDS || words[i] >= CTLEVEL3SIZE*CTLEVEL3SIZE || words[i+1] >= CTLEVEL2SIZE*CTLEVEL2SIZE)
+			return false;
+		ChunkSet *cs = getOrAllocate(getOrAllocate(chunkgroups[words[i]])->chunksets[words[i+1]]);
+		for (int bi = 0; bi < CTLEVEL1SIZE*CTLEVEL1SIZE; bi++)
+			if ((words[i + 2 + bi / 32] >> (bi % 32)) & 0x1)
+				cs->bits.set(bi * CTDATASIZE);
+	}
+	return true;
 }
 
 
@@ -141,21 +212,15 @@ void RequiredChunkIterator::advance()
 
 bool TileGroup::setRequired(const PosTileIdx& ti)
 {
-	int tsi = tileSetIdx(ti);
-	if (tilesets[tsi] == NULL)
-		tilesets[tsi] = new TileSet;
-	bool prevset = tilesets[tsi]->setRequired(ti);
+	bool prevset = getOrAllocate(tilesets[tileSetIdx(ti)])->setRequired(ti);
 	if (!prevset)
-		reqcount++;
+		__sync_fetch_and_add(&reqcount, 1);
 	return prevset;
 }
 
 void TileGroup::setDrawn(const PosTileIdx& ti)
 {
-	int tsi = tileSetIdx(ti);
-	if (tilesets[tsi] == NULL)
-		tilesets[tsi] = new TileSet;
-	tilesets[tsi]->setDrawn(ti);
+	getOrAllocate(tilesets[tileSetIdx(ti)])->setDrawn(ti);
 }
 
 PosTileIdx TileTable::toPosTileIdx(int tgi, int tsi, int bi)
@@ -172,21 +237,15 @@ PosTileIdx TileTable::toPosTileIdx(int tgi, int tsi, int bi)
 
 bool TileTable::setRequired(const PosTileIdx& ti)
 {
-	int tgi = tileGroupIdx(ti);
-	if (tilegroups[tgi] == NULL)
-		tilegroups[tgi] = new TileGroup;
-	bool prevset = tilegroups[tgi]->setRequired(ti);
+	bool prevset = getOrAllocate(tilegroups[tileGroupIdx(ti)])->setRequired(ti);
 	if (!prevset)
-		reqcount++;
+		__sync_fetch_and_add(&reqcount, 1);
 	return prevset;
 }
 
 void TileTable::setDrawn(const PosTileIdx& ti)
 {
-	int tgi = tileGroupIdx(ti);
-	if (tilegroups[tgi] == NULL)
-		tilegroups[tgi] = new TileGroup;
-	tilegroups[tgi]->setDrawn(ti);
+	getOrAllocate(tilegroups[tileGroupIdx(ti)])->setDrawn(ti);
 }
 
 bool TileTable::reject(const ZoomTileIdx& zti, const MapParams& mp) const
@@ -261,22 +320,54 @@ int64_t TileTable::getNumRequired(const ZoomTileIdx& zti, const MapParams& mp) c
 	return count;
 }
 
-void TileTable::copyFrom(const TileTable& ttable)
+void TileTable::clear()
+{
+	for (int i = 0; i < TTLEVEL3SIZE*TTLEVEL3SIZE; i++)
+		if (tilegroups[i] != NULL)
+		{
+			delete tilegroups[i];
+			tilegroups[i] = NULL;
+		}
+	reqcount = 0;
+}
+
+#define TTPACKEDWORDS (TTLEVEL1SIZE*TTLEVEL1SIZE/32)
+
+void TileTable::saveRequired(vector<uint32_t>& words) const
 {
 	for (int tgi = 0; tgi < TTLEVEL3SIZE*TTLEVEL3SIZE; tgi++)
 	{
-		if (ttable.tilegroups[tgi] != NULL)
+		if (tilegroups[tgi] == NULL)
+			continue;
+		for (int tsi = 0; tsi < TTLEVEL2SIZE*TTLEVEL2SIZE; tsi++)
 		{
-			tilegroups[tgi] = new TileGroup;
-			for (int tsi = 0; tsi < TTLEVEL2SIZE*TTLEVEL2SIZE; tsi++)
+			TileSet *ts = tilegroups[tgi]->tilesets[tsi];
+			if (ts == NULL || !anyBits(ts->bits, TTDATASIZE))
+				continue;
+			words.push_back(tgi);
+			words.push_back(tsi);
+			words.resize(words.size() + TTPACKEDWORDS);
+			packBits(ts->bits, TTDATASIZE, &words[words.size() - TTPACKEDWORDS]);
+		}
+	}
+}
+
+bool TileTable::loadRequired(const vector<uint32_t>& words)
+{
+	for (size_t i = 0; i < words.size(); i += 2 + TTPACKEDWORDS)
+	{
+		if (words.size() - i < 2 + TTPACKEDWORDS || words[i] >= TTLEVEL3SIZE*TTLEVEL3SIZE || words[i+1] >= TTLEVEL2SIZE*TTLEVEL2SIZE)
+			return false;
+		TileGroup *tg = getOrAllocate(tilegroups[words[i]]);
+		TileSet *ts = getOrAllocate(tg->tilesets[words[i+1]]);
+		for (int bi = 0; bi < TTLEVEL1SIZE*TTLEVEL1SIZE; bi++)
+			if (((words[i + 2 + bi / 32] >> (bi % 32)) & 0x1) && !ts->bits.testAndSet(bi * TTDATASIZE))
 			{
-				if (ttable.tilegroups[tgi]->tilesets[tsi] != NULL)
-				{
-					tilegroups[tgi]->tilesets[tsi] = new TileSet(*(ttable.tilegroups[tgi]->tilesets[tsi]));
-				}
+				tg->reqcount++;
+				reqcount++;
 			}
-		}
 	}
+	return true;
 }
 
 
@@ -411,21 +502,3 @@ void RegionTable::setDiskState(const PosRegionIdx& ri, int state)
 		regiongroups[rgi] = new RegionGroup;
 	regiongroups[rgi]->setDiskState(ri, state);
 }
-
-void RegionTable::copyFrom(const RegionTable& rtable)
-{
-	for (int rgi = 0; rgi < RTLEVEL3SIZE*RTLEVEL3SIZE; rgi++)
-	{
-		if (rtable.regiongroups[rgi] != NULL)
-		{
-			regiongroups[rgi] = new RegionGroup;
-			for (int rsi = 0; rsi < RTLEVEL2SIZE*RTLEVEL2SIZE; rsi++)
-			{
-				if (rtable.regiongroups[rgi]->regionsets[rsi] != NULL)
-				{
-					regiongroups[rgi]->regionsets[rsi] = new RegionSet(*(rtable.regiongroups[rgi]->regionsets[rsi]));
-				}
-			}
-		}
-	}
-}
@@ -19,6 +19,8 @@
 #define TABLES_H
 
 #include <bitset>
+#include <vector>
+#include <string.h>
 #include <stdint.h>
 
 #include "map.h"
@@ -26,7 +28,35 @@
 
 
 
-#define CTDATASIZE 3
+// fixed-size bitset with its words out in the open, so that bits can be updated atomically when a table is
+//  shared between threads (reads are plain loads; a reader racing with a writer sees either the old or the new
+//  word, which is all the tables need)
+template <size_t N> struct AtomicBitset
+{
+	uint32_t words[(N + 31) / 32];
+
+	AtomicBitset() {memset(words, 0, sizeof(words));}
+
+	bool operator[](size_t i) const {return (words[i / 32] >> (i % 32)) & 0x1;}
+	void set(size_t i) {__sync_fetch_and_or(&words[i / 32], 1u << (i % 32));}
+	// set a bit and return its previous value
+	bool testAndSet(size_t i) {return (__sync_fetch_and_or(&words[i / 32], 1u << (i % 32)) >> (i % 32)) & 0x1;}
+	size_t count() const {size_t c = 0; for (size_t i = 0; i < (N + 31) / 32; i++) c += __builtin_popcount(words[i]); return c;}
+	// replace some bits of a single word: the ones in mask get the corresponding ones from value
+	void assign(size_t word, uint32_t mask, uint32_t value)
+	{
+		uint32_t old;
+		do
+		{
+			old = words[word];
+		} while (!__sync_bool_compare_and_swap(&words[word], old, (old & ~mask) | (value & mask)));
+	}
+};
+
+
+
+// (the last three bits of each chunk are unused; they keep a chunk's bits from straddling two words)
+#define CTDATASIZE 8
 
 #define CTLEVEL1BITS 5
 #define CTLEVEL2BITS 5
@@ -64,23 +94,57 @@ struct PosChunkIdx
 //  whether it's even present on disk, etc.
 struct ChunkSet
 {
-	// each chunk gets 3 bits:
+	// each chunk gets 8 bits:
 	//  -first bit is 1 for required (must be drawn), 0 for not required
-	//  -last two bits describe state of chunk on disk:
+	//  -next two bits describe state of chunk on disk:
 	//    00: have not tried to find chunk on disk yet
 	//    01: have successfully read chunk from disk (i.e. it should be in the cache, if we still need it)
 	//    10: chunk does not exist on disk
 	//    11: chunk file is corrupted
+	//  -next two bits say how the chunk was last evicted from a ChunkCache, for the cache stats:
+	//    00: never
+	//    01: the cache was full, and enough other chunks may have been used since that it was among the
+	//        least recently used
+	//    10: there was room elsewhere in the cache, or it had been used too recently to be among the least
+	//        recently used (so a fully associative cache would have kept it)
+	//  -last three bits are unused
 	static const int CHUNK_UNKNOWN = 0;
 	static const int CHUNK_CACHED = 1;
 	static const int CHUNK_MISSING = 2;
 	static const int CHUNK_CORRUPTED = 3;
-	std::bitset<CTLEVEL1SIZE*CTLEVEL1SIZE*CTDATASIZE> bits;
+	static const int EVICTED_NEVER = 0;
+	static const int EVICTED_CAPACITY = 1;
+	static const int EVICTED_CONFLICT = 2;
+	AtomicBitset<CTLEVEL1SIZE*CTLEVEL1SIZE*CTDATASIZE> bits;
 
 	size_t bitIdx(const PosChunkIdx& ci) const {return (CTGETLEVEL1(ci.z) * CTLEVEL1SIZE + CTGETLEVEL1(ci.x)) * CTDATASIZE;}
 
+	int getDiskState(const PosChunkIdx& ci) const
+	{
+		size_t bi = bitIdx(ci);
+		uint32_t w = bits.words[bi / 32] >> (bi % 32);
+		return ((w & 0x2) ? 0x2 : 0) | ((w & 0x4) ? 0x1 : 0);
+	}
+
 	void setRequired(const PosChunkIdx& ci) {bits.set(bitIdx(ci));}
-	void setDiskState(const PosChunkIdx& ci, int state) {size_t bi = bitIdx(ci); bits[bi+1] = state & 0x2; bits[bi+2] = state & 0x1;}
+	// (the state bits are updated together, so other threads never see a half-changed state)
+	void setDiskState(const PosChunkIdx& ci, int state)
+	{
+		size_t bi = bitIdx(ci);
+		uint32_t value = ((state & 0x2) ? 0x2 : 0) | ((state & 0x1) ? 0x4 : 0);
+		bits.assign(bi / 32, 0x6 << (bi % 32), value << (bi % 32));
+	}
+
+	int getEviction(const PosChunkIdx& ci) const
+	{
+		size_t bi = bitIdx(ci);
+		return (bits.words[bi / 32] >> (bi % 32 + 3)) & 0x3;
+	}
+	void setEviction(const PosChunkIdx& ci, int eviction)
+	{
+		size_t bi = bitIdx(ci);
+		bits.assign(bi / 32, 0x18 << (bi % 32), (eviction << 3) << (bi % 32));
+	}
 };
 
 // first level of indirection: information about a 32x32 group of ChunkSets, and hence a 1024x1024 set of chunks
@@ -100,11 +164,17 @@ struct ChunkGroup
 };
 
 // second (and final) level of indirection: 256x256 groups, so 262144x262144 possible chunks
+// ...setRequired and setDiskState are safe to call from several threads at once (the groups and sets are
+//  allocated with compare-and-swap, and the bits are set atomically), so a single ChunkTable can be shared
+// ...a table can also be made on top of another one that already has the required bits (and won't change
+//  while we're using it); isRequired looks there, and only the disk states and such are our own, so each
+//  cache can have its own table without copying the whole world
 struct ChunkTable : private nocopy
 {
 	ChunkGroup *chunkgroups[CTLEVEL3SIZE*CTLEVEL3SIZE];
+	const ChunkTable *reqtable;  // if non-NULL, where the required bits live
 
-	ChunkTable() {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) chunkgroups[i] = NULL;}
+	ChunkTable(const ChunkTable *rt = NULL) : reqtable(rt) {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) chunkgroups[i] = NULL;}
 	~ChunkTable() {for (int i = 0; i < CTLEVEL3SIZE*CTLEVEL3SIZE; i++) if (chunkgroups[i] != NULL) delete chunkgroups[i];}
 
 	int chunkGroupIdx(const PosChunkIdx& ci) const {return CTGETLEVEL3(ci.z) * CTLEVEL3SIZE + CTGETLEVEL3(ci.x);}
@@ -114,18 +184,36 @@ struct ChunkTable : private nocopy
 	// given indices into the ChunkGroups/ChunkSets/bitset, construct a PosChunkIdx
 	static PosChunkIdx toPosChunkIdx(int cgi, int csi, int bi);
 	
-	bool isRequired(const PosChunkIdx& ci) const {ChunkSet *cs = getChunkSet(ci); return (cs == NULL) ? false : cs->bits[cs->bitIdx(ci)];}
-	int getDiskState(const PosChunkIdx& ci) const {ChunkSet *cs = getChunkSet(ci); return (cs == NULL) ? 0 : ((cs->bits[cs->bitIdx(ci)+1] ? 0x2 : 0) | (cs->bits[cs->bitIdx(ci)+2] ? 0x1 : 0));}
+	bool isRequired(const PosChunkIdx& ci) const
+	{
+		if (reqtable != NULL)
+			return reqtable->isRequired(ci);
+		ChunkSet *cs = getChunkSet(ci);
+		return (cs == NULL) ? false : cs->bits[cs->bitIdx(ci)];
+	}
+	int getDiskState(const PosChunkIdx& ci) const {ChunkSet *cs = getChunkSet(ci); return (cs == NULL) ? 0 : cs->getDiskState(ci);}
+	// (only chunks with disk states can have been evicted, so their ChunkSets will already exist)
+	int getEviction(const PosChunkIdx& ci) const {ChunkSet *cs = getChunkSet(ci); return (cs == NULL) ? 0 : cs->getEviction(ci);}
+	void setEviction(const PosChunkIdx& ci, int eviction) {ChunkSet *cs = getChunkSet(ci); if (cs != NULL) cs->setEviction(ci, eviction);}
 
 	void setRequired(const PosChunkIdx& ci);
 	void setDiskState(const PosChunkIdx& ci, int state);
 
-	void copyFrom(const ChunkTable& ctable);
+	void clear();
+
+	// count the required chunks
+	int64_t countRequired() const;
+	// append just the required bits to a list of words: for each ChunkSet with anything required, its
+	//  group index, its set index, and then one bit per chunk, packed into CTLEVEL1SIZE*CTLEVEL1SIZE/32 words
+	void saveRequired(std::vector<uint32_t>& words) const;
+	// set the chunks saved by saveRequired to required; returns false if the words don't make sense
+	bool loadRequired(const std::vector<uint32_t>& words);
 };
 
 
 // given a ChunkTable, iterates over the required chunks
-// ...this is obsolete and not used, except in some test functions
+// ...not used for rendering (the ChunkTable is accessed directly), but handy for ChunkUseCounts and some
+//  test functions
 struct RequiredChunkIterator
 {
 	bool end;  // true once we've reached the end
@@ -188,7 +276,7 @@ struct PosTileIdx
 struct TileSet
 {
 	// each tile gets two bits: first is whether it's required, second is whether it's been drawn
-	std::bitset<TTLEVEL1SIZE*TTLEVEL1SIZE*TTDATASIZE> bits;
+	AtomicBitset<TTLEVEL1SIZE*TTLEVEL1SIZE*TTDATASIZE> bits;
 
 	size_t bitIdx(const PosTileIdx& ti) const {return (TTGETLEVEL1(ti.y) * TTLEVEL1SIZE + TTGETLEVEL1(ti.x)) * TTDATASIZE;}
 
@@ -196,7 +284,7 @@ struct TileSet
 	bool isRequired(const PosTileIdx& ti) const {return bits[bitIdx(ti)];}
 
 	// set tile's required bit and return previous state of bit
-	bool setRequired(const PosTileIdx& ti) {size_t bi = bitIdx(ti); bool rv = bits[bi]; bits.set(bi); return rv;}
+	bool setRequired(const PosTileIdx& ti) {return bits.testAndSet(bitIdx(ti));}
 	void setDrawn(const PosTileIdx& ti) {bits.set(bitIdx(ti)+1);}
 };
 
@@ -220,6 +308,8 @@ struct TileGroup
 };
 
 // second (and final) level of indirection: a 65536x65536 set of tiles
+// ...like the ChunkTable, setRequired and setDrawn are safe to call from several threads at once (the
+//  required counts are updated atomically, too), so the world scan can fill in one TileTable in parallel
 struct TileTable : private nocopy
 {
 	TileGroup *tilegroups[TTLEVEL3SIZE*TTLEVEL3SIZE];
@@ -248,7 +338,11 @@ struct TileTable : private nocopy
 	// get the total number of base tiles required to draw a zoom tile
 	int64_t getNumRequired(const ZoomTileIdx& zti, const MapParams& mp) const;
 
-	void copyFrom(const TileTable& ttable);
+	void clear();
+
+	// same as for the ChunkTable (the required counts are kept up to date when loading)
+	void saveRequired(std::vector<uint32_t>& words) const;
+	bool loadRequired(const std::vector<uint32_t>& words);
 };
 
 
@@ -290,7 +384,7 @@ struct TileGroupIterator
 
 
 
-#define RTDATASIZE 3
+#define RTDATASIZE 5
 
 #define RTLEVEL1BITS 4
 #define RTLEVEL2BITS 4
@@ -324,23 +418,28 @@ struct PosRegionIdx
 
 struct RegionSet
 {
-	// each region gets 3 bits:
+	// each region gets 5 bits:
 	//  -first bit is 1 for required (must be drawn), 0 for not required
-	//  -last two bits describe state of region on disk:
+	//  -next two bits describe state of region on disk:
 	//    00: have not tried to find region on disk yet
 	//    01: have successfully read region from disk (i.e. it should be in the cache, if we still need it)
 	//    10: region does not exist on disk
 	//    11: region file is corrupted
+	//  -last two bits say how the region was last evicted from a RegionCache (same as for chunks; see ChunkSet)
 	static const int REGION_UNKNOWN = 0;
 	static const int REGION_CACHED = 1;
 	static const int REGION_MISSING = 2;
 	static const int REGION_CORRUPTED = 3;
+	static const int EVICTED_NEVER = 0;
+	static const int EVICTED_CAPACITY = 1;
+	static const int EVICTED_CONFLICT = 2;
 	std::bitset<RTLEVEL1SIZE*RTLEVEL1SIZE*RTDATASIZE> bits;
 
 	size_t bitIdx(const PosRegionIdx& ri) const {return (RTGETLEVEL1(ri.z) * RTLEVEL1SIZE + RTGETLEVEL1(ri.x)) * RTDATASIZE;}
 
 	void setRequired(const PosRegionIdx& ri) {bits.set(bitIdx(ri));}
 	void setDiskState(const PosRegionIdx& ri, int state) {size_t bi = bitIdx(ri); bits[bi+1] = state & 0x2; bits[bi+2] = state & 0x1;}
+	void setEviction(const PosRegionIdx& ri, int eviction) {size_t bi = bitIdx(ri); bits[bi+3] = eviction & 0x2; bits[bi+4] = eviction & 0x1;}
 };
 
 struct RegionGroup
@@ -357,11 +456,13 @@ struct RegionGroup
 	void setDiskState(const PosRegionIdx& ri, int state);
 };
 
+// (like the ChunkTable, this can be made on top of another one with the required bits)
 struct RegionTable : private nocopy
 {
 	RegionGroup *regiongroups[RTLEVEL3SIZE*RTLEVEL3SIZE];
+	const RegionTable *reqtable;  // if non-NULL, where the required bits live
 
-	RegionTable() {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) regiongroups[i] = NULL;}
+	RegionTable(const RegionTable *rt = NULL) : reqtable(rt) {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) regiongroups[i] = NULL;}
 	~RegionTable() {for (int i = 0; i < RTLEVEL3SIZE*RTLEVEL3SIZE; i++) if (regiongroups[i] != NULL) delete regiongroups[i];}
 
 	int regionGroupIdx(const PosRegionIdx& ri) const {return RTGETLEVEL3(ri.z) * RTLEVEL3SIZE + RTGETLEVEL3(ri.x);}
@@ -371,13 +472,19 @@ struct RegionTable : private nocopy
 	// given indices into the RegionGroups/RegionSets/bitset, construct a PosRegionIdx
 	static PosRegionIdx toPosRegionIdx(int rgi, int rsi, int bi);
 	
-	bool isRequired(const PosRegionIdx& ri) const {RegionSet *rs = getRegionSet(ri); return (rs == NULL) ? false : rs->bits[rs->bitIdx(ri)];}
+	bool isRequired(const PosRegionIdx& ri) const
+	{
+		if (reqtable != NULL)
+			return reqtable->isRequired(ri);
+		RegionSet *rs = getRegionSet(ri);
+		return (rs == NULL) ? false : rs->bits[rs->bitIdx(ri)];
+	}
 	int getDiskState(const PosRegionIdx& ri) const {RegionSet *rs = getRegionSet(ri); return (rs == NULL) ? 0 : ((rs->bits[rs->bitIdx(ri)+1] ? 0x2 : 0) | (rs->bits[rs->bitIdx(ri)+2] ? 0x1 : 0));}
+	int getEviction(const PosRegionIdx& ri) const {RegionSet *rs = getRegionSet(ri); return (rs == NULL) ? 0 : ((rs->bits[rs->bitIdx(ri)+3] ? 0x2 : 0) | (rs->bits[rs->bitIdx(ri)+4] ? 0x1 : 0));}
+	void setEviction(const PosRegionIdx& ri, int eviction) {RegionSet *rs = getRegionSet(ri); if (rs != NULL) rs->setEviction(ri, eviction);}
 
 	void setRequired(const PosRegionIdx& ri);
 	void setDiskState(const PosRegionIdx& ri, int state);
-
-	void copyFrom(const RegionTable& rtable);
 };
 
 
@@ -100,6 +100,16 @@ bool dirExists(const string& dirpath)
 	return true;
 }
 
+bool statFile(const string& filename, int64_t& mtime, int64_t& size)
+{
+	struct stat st;
+	if (0 != stat(filename.c_str(), &st) || !S_ISREG(st.st_mode))
+		return false;
+	mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	size = st.st_size;
+	return true;
+}
+
 uint64_t getHeapUsage()
 {
 #if USE_MALLINFO
@@ -281,6 +291,21 @@ int64_t interpolate(int64_t i, int64_t destrange, int64_t srcrange)
 
 
 
+SetGeometry::SetGeometry(int64_t entries, int w) : bitsx(0), bitsz(0), ways(w)
+{
+	// add bits while that gets us closer (in ratio) to the target; X gets the extra one if the total is odd
+	double target = (double)entries / (double)ways;
+	while (bitsx + bitsz < 24 && (double)sets() * 1.41421356 < target)
+	{
+		if (bitsx == bitsz)
+			bitsx++;
+		else
+			bitsz++;
+	}
+}
+
+
+
 // technically, these use "upside-down-N-order", not Z-order--that is, the Y-coord is incremented
 //  first, not the X-coord--because that way, no special way to detect the end of the array is
 //  needed; advancing past the final valid element leads to the index one past the end of the
@@ -21,6 +21,7 @@
 #include <vector>
 #include <string>
 #include <stdint.h>
+#include <pthread.h>
 
 
 // ensure that a directory exists (create any missing directories on path)
@@ -38,6 +39,10 @@ void listEntries(const std::string& dirpath, std::vector<std::string>& entries);
 
 bool dirExists(const std::string& dirpath);
 
+// get a file's modification time (in nanoseconds, since region files can be rewritten several times a second
+//  without changing size) and size; returns false if it doesn't exist
+bool statFile(const std::string& filename, int64_t& mtime, int64_t& size);
+
 // -read a gzipped file into a vector, overwriting its contents, and expanding it if necessary
 // -return 0 on success, -1 for nonexistent file, -2 for other errors
 int readGzFile(const std::string& filename, std::vector<uint8_t>& data);
@@ -76,6 +81,23 @@ int64_t mod64pos(int64_t a);
 int64_t interpolate(int64_t i, int64_t destrange, int64_t srcrange);
 
 
+// shape of a set-associative cache of things with 2D coords: 2^(bitsx+bitsz) sets of some number of ways,
+//  with the set picked by the low bits of X and Z, so that neighbors land in different sets
+// ...coords must be nonnegative (e.g. PosChunkIdx, PosRegionIdx)
+struct SetGeometry
+{
+	int bitsx, bitsz, ways;
+
+	// the power-of-2 number of sets that comes closest to filling the given number of entries (at least one)
+	SetGeometry(int64_t entries, int w);
+
+	int sets() const {return 1 << (bitsx + bitsz);}
+	int size() const {return sets() * ways;}
+	// index of the first entry in the set for some coords
+	int setStart(int64_t x, int64_t z) const {return ((int)(x & ((1 << bitsx) - 1)) << bitsz | (int)(z & ((1 << bitsz) - 1))) * ways;}
+};
+
+
 // take a row-major index into a SIZExSIZE array and convert it to Z-order
 uint32_t toZOrder(uint32_t i, const uint32_t SIZE);
 // ...and vice versa
@@ -115,6 +137,35 @@ private:
 };
 
 
+// thin wrappers around pthread mutexes and condition variables
+struct Mutex : private nocopy
+{
+	pthread_mutex_t mutex;
+	Mutex() {pthread_mutex_init(&mutex, NULL);}
+	~Mutex() {pthread_mutex_destroy(&mutex);}
+	void lock() {pthread_mutex_lock(&mutex);}
+	void unlock() {pthread_mutex_unlock(&mutex);}
+};
+
+struct Condition : private nocopy
+{
+	pthread_cond_t cond;
+	Condition() {pthread_cond_init(&cond, NULL);}
+	~Condition() {pthread_cond_destroy(&cond);}
+	void wait(Mutex& m) {pthread_cond_wait(&cond, &m.mutex);}
+	void signal() {pthread_cond_signal(&cond);}
+	void broadcast() {pthread_cond_broadcast(&cond);}
+};
+
+// holds a Mutex locked for as long as it exists
+struct MutexLocker : private nocopy
+{
+	Mutex& m;
+	MutexLocker(Mutex& mm) : m(mm) {m.lock();}
+	~MutexLocker() {m.unlock();}
+};
+
+
 template <class T> struct arrayDeleter
 {
 	T *array;
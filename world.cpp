@@ -18,6 +18,9 @@
 #include <iostream>
 #include <math.h>
 #include <fstream>
+#include <set>
+#include <pthread.h>
+#include <time.h>
 
 #include "world.h"
 #include "region.h"
@@ -35,101 +38,638 @@ bool detectRegionFormat(const string& inputdir)
 
 
 
+void ChunkTimestamps::set(const RegionIdx& ri, const RegionFileReader& rfreader)
+{
+	regions[make_pair(ri.x, ri.z)] = rfreader.timestamps;
+}
 
-bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount)
+uint32_t ChunkTimestamps::get(const ChunkIdx& ci) const
 {
-	bool findBaseZoom = mp.baseZoom == -1;
-	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
-	if (findBaseZoom)
-		mp.baseZoom = 0;
-	reqregioncount = 0;
-	// get all files in the region directory
-	RegionFileReader rfreader;
+	RegionIdx ri = ci.getRegionIdx();
+	map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator it = regions.find(make_pair(ri.x, ri.z));
+	if (it == regions.end())
+		return 0;
+	return fromBigEndian(it->second[RegionFileReader::getIdx(ChunkOffset(ci))]);
+}
+
+// file format: "pigmapts", then for each region its big-endian 32-bit X and Z, followed by its 4096 bytes
+//  of timestamps, just as they were in the region header
+bool ChunkTimestamps::readFile(const string& outputpath)
+{
+	regions.clear();
+	string filename = outputpath + "/pigmap.timestamps";
+	ifstream infile(filename.c_str(), ios::binary);
+	if (infile.fail())
+		return false;
+	char magic[8];
+	infile.read(magic, 8);
+	if (infile.fail() || string(magic, 8) != "pigmapts")
+		return false;
+	vector<uint32_t> ts(32 * 32);
+	while (true)
+	{
+		uint32_t coords[2];
+		infile.read((char*)coords, 8);
+		if (infile.eof())
+			break;
+		infile.read((char*)&(ts[0]), 4096);
+		if (infile.fail())
+		{
+			regions.clear();
+			return false;
+		}
+		regions[make_pair((int64_t)(int32_t)fromBigEndian(coords[0]), (int64_t)(int32_t)fromBigEndian(coords[1]))] = ts;
+	}
+	return true;
+}
+
+bool ChunkTimestamps::writeFile(const string& outputpath) const
+{
+	// write to a temporary file first, so that if we're interrupted, the old timestamps survive
+	string filename = outputpath + "/pigmap.timestamps";
+	{
+		ofstream outfile((filename + ".new").c_str(), ios::binary);
+		outfile.write("pigmapts", 8);
+		for (map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator it = regions.begin(); it != regions.end(); it++)
+		{
+			uint32_t coords[2] = {fromBigEndian((uint32_t)it->first.first), fromBigEndian((uint32_t)it->first.second)};
+			outfile.write((const char*)coords, 8);
+			outfile.write((const char*)&(it->second[0]), 4096);
+		}
+		if (outfile.fail())
+		{
+			cerr << "failed to write " << filename << endl;
+			return false;
+		}
+	}
+	renameFile(filename + ".new", filename);
+	return true;
+}
+
+
+
+
+void RegionIndex::Entry::setChunks(const RegionIdx& ri, const vector<ChunkIdx>& chunklist)
+{
+	fill(chunks, chunks + 32, 0);
+	ChunkIdx base = ri.baseChunk();
+	for (vector<ChunkIdx>::const_iterator it = chunklist.begin(); it != chunklist.end(); it++)
+		chunks[it->z - base.z] |= 1u << (it->x - base.x);
+}
+
+// how recently a region file can have been modified and still be trusted to change its mtime if it's written
+//  again (some filesystems only keep mtimes to the second, or even two seconds)
+#define RACYSECONDS 2
+
+bool RegionIndex::statRegion(const RegionIdx& ri, const string& inputdir, Entry& entry)
+{
+	entry.anvil = true;
+	if (!statFile(inputdir + "/region/" + ri.toAnvilFileName(), entry.mtime, entry.size))
+	{
+		entry.anvil = false;
+		if (!statFile(inputdir + "/region/" + ri.toOldFileName(), entry.mtime, entry.size))
+			return false;
+	}
+	return entry.mtime < ((int64_t)time(NULL) - RACYSECONDS) * 1000000000LL;
+}
+
+bool RegionIndex::getChunks(const RegionIdx& ri, const Entry& current, vector<ChunkIdx>& chunklist) const
+{
+	chunklist.clear();
+	map<pair<int64_t, int64_t>, Entry>::const_iterator it = regions.find(make_pair(ri.x, ri.z));
+	if (it == regions.end() || !it->second.sameFile(current))
+		return false;
+	// (same order as RegionFileReader::getContainedChunks)
+	for (RegionChunkIterator rcit(ri); !rcit.end; rcit.advance())
+	{
+		ChunkIdx base = ri.baseChunk();
+		if (it->second.chunks[rcit.current.z - base.z] & (1u << (rcit.current.x - base.x)))
+			chunklist.push_back(rcit.current);
+	}
+	return true;
+}
+
+// file format: "pigmapri", then for each region its big-endian 32-bit X and Z, a 32-bit flags word (1 for
+//  Anvil), the mtime and size as big-endian 64-bit values (high word first), and the 32 words of the chunk mask
+#define REGIONINDEXWORDS (2 + 1 + 4 + 32)
+
+bool RegionIndex::readFile(const string& outputpath)
+{
+	regions.clear();
+	string filename = outputpath + "/pigmap.regionindex";
+	ifstream infile(filename.c_str(), ios::binary);
+	if (infile.fail())
+		return false;
+	char magic[8];
+	infile.read(magic, 8);
+	if (infile.fail() || string(magic, 8) != "pigmapri")
+		return false;
+	uint32_t words[REGIONINDEXWORDS];
+	while (true)
+	{
+		infile.read((char*)words, 4);
+		if (infile.eof())
+			break;
+		infile.read((char*)(words + 1), (REGIONINDEXWORDS - 1) * 4);
+		if (infile.fail())
+		{
+			regions.clear();
+			return false;
+		}
+		for (int i = 0; i < REGIONINDEXWORDS; i++)
+			words[i] = fromBigEndian(words[i]);
+		Entry entry;
+		entry.anvil = words[2] & 0x1;
+		entry.mtime = (int64_t)(((uint64_t)words[3] << 32) | words[4]);
+		entry.size = (int64_t)(((uint64_t)words[5] << 32) | words[6]);
+		copy(words + 7, words + REGIONINDEXWORDS, entry.chunks);
+		regions[make_pair((int64_t)(int32_t)words[0], (int64_t)(int32_t)words[1])] = entry;
+	}
+	return true;
+}
+
+bool RegionIndex::writeFile(const string& outputpath) const
+{
+	string filename = outputpath + "/pigmap.regionindex";
+	{
+		ofstream outfile((filename + ".new").c_str(), ios::binary);
+		outfile.write("pigmapri", 8);
+		uint32_t words[REGIONINDEXWORDS];
+		for (map<pair<int64_t, int64_t>, Entry>::const_iterator it = regions.begin(); it != regions.end(); it++)
+		{
+			words[0] = (uint32_t)it->first.first;
+			words[1] = (uint32_t)it->first.second;
+			words[2] = it->second.anvil ? 1 : 0;
+			words[3] = (uint32_t)((uint64_t)it->second.mtime >> 32);
+			words[4] = (uint32_t)it->second.mtime;
+			words[5] = (uint32_t)((uint64_t)it->second.size >> 32);
+			words[6] = (uint32_t)it->second.size;
+			copy(it->second.chunks, it->second.chunks + 32, words + 7);
+			for (int i = 0; i < REGIONINDEXWORDS; i++)
+				words[i] = fromBigEndian(words[i]);
+			outfile.write((const char*)words, REGIONINDEXWORDS * 4);
+		}
+		if (outfile.fail())
+		{
+			cerr << "failed to write " << filename << endl;
+			return false;
+		}
+	}
+	renameFile(filename + ".new", filename);
+	return true;
+}
+
+
+
+void TableSnapshot::take(const ChunkTable& chunktable, const TileTable& tiletable, const MapParams& mp)
+{
+	B = mp.B;
+	T = mp.T;
+	baseZoom = mp.baseZoom;
+	minY = mp.minY;
+	maxY = mp.maxY;
+	chunkwords.clear();
+	chunktable.saveRequired(chunkwords);
+	tilewords.clear();
+	tiletable.saveRequired(tilewords);
+}
+
+// file format: "pigmaptb", then big-endian 32-bit words: B, T, baseZoom, minY, maxY, the number of regions,
+//  and the sizes of the chunk and tile lists; then X, Z, and the 32 mask words for each region; then the chunk
+//  and tile lists themselves
+#define TABLESNAPSHOTHEADERWORDS 8
+
+bool TableSnapshot::readFile(const string& outputpath, const MapParams& mp)
+{
+	loaded = false;
+	regions.clear();
+	string filename = outputpath + "/pigmap.tables";
+	ifstream infile(filename.c_str(), ios::binary);
+	if (infile.fail())
+		return false;
+	infile.seekg(0, ios::end);
+	int64_t filesize = infile.tellg();
+	infile.seekg(0, ios::beg);
+	if (infile.fail() || filesize < 8 + TABLESNAPSHOTHEADERWORDS * 4)
+		return false;
+	char magic[8];
+	infile.read(magic, 8);
+	if (infile.fail() || string(magic, 8) != "pigmaptb")
+		return false;
+	uint32_t header[TABLESNAPSHOTHEADERWORDS];
+	infile.read((char*)header, TABLESNAPSHOTHEADERWORDS * 4);
+	if (infile.fail())
+		return false;
+	for (int i = 0; i < TABLESNAPSHOTHEADERWORDS; i++)
+		header[i] = fromBigEndian(header[i]);
+	B = header[0];
+	T = header[1];
+	baseZoom = header[2];
+	minY = header[3];
+	maxY = header[4];
+	if (B != mp.B || T != mp.T || minY != mp.minY || maxY != mp.maxY)
+		return false;
+	// the counts must account for exactly the rest of the file (so a truncated or corrupt one is just
+	//  ignored, rather than making us allocate or read something silly)
+	uint64_t nwords = (uint64_t)header[5] * 34 + header[6] + header[7];
+	if (nwords * 4 != (uint64_t)(filesize - 8 - TABLESNAPSHOTHEADERWORDS * 4))
+		return false;
+	// read everything else in one go
+	vector<uint32_t> words(nwords);
+	if (!words.empty())
+		infile.read((char*)&(words[0]), words.size() * 4);
+	if (infile.fail())
+		return false;
+	for (vector<uint32_t>::iterator it = words.begin(); it != words.end(); it++)
+		*it = fromBigEndian(*it);
+	vector<uint32_t>::const_iterator w = words.begin();
+	for (uint32_t i = 0; i < header[5]; i++, w += 34)
+		regions[make_pair((int64_t)(int32_t)w[0], (int64_t)(int32_t)w[1])].assign(w + 2, w + 34);
+	chunkwords.assign(w, w + header[6]);
+	tilewords.assign(w + header[6], w + header[6] + header[7]);
+	loaded = true;
+	return true;
+}
+
+bool TableSnapshot::writeFile(const string& outputpath) const
+{
+	string filename = outputpath + "/pigmap.tables";
+	{
+		ofstream outfile((filename + ".new").c_str(), ios::binary);
+		outfile.write("pigmaptb", 8);
+		vector<uint32_t> words;
+		words.reserve(TABLESNAPSHOTHEADERWORDS + regions.size() * 34 + chunkwords.size() + tilewords.size());
+		words.push_back(B);
+		words.push_back(T);
+		words.push_back(baseZoom);
+		words.push_back(minY);
+		words.push_back(maxY);
+		words.push_back(regions.size());
+		words.push_back(chunkwords.size());
+		words.push_back(tilewords.size());
+		for (map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator it = regions.begin(); it != regions.end(); it++)
+		{
+			words.push_back((uint32_t)it->first.first);
+			words.push_back((uint32_t)it->first.second);
+			words.insert(words.end(), it->second.begin(), it->second.end());
+		}
+		words.insert(words.end(), chunkwords.begin(), chunkwords.end());
+		words.insert(words.end(), tilewords.begin(), tilewords.end());
+		for (vector<uint32_t>::iterator it = words.begin(); it != words.end(); it++)
+			*it = fromBigEndian(*it);
+		outfile.write((const char*)&(words[0]), words.size() * 4);
+		if (outfile.fail())
+		{
+			cerr << "failed to write " << filename << endl;
+			return false;
+		}
+	}
+	renameFile(filename + ".new", filename);
+	return true;
+}
+
+
+
+
+// the scans below can be run on several threads; they all mark chunks and tiles required directly in the
+//  shared ChunkTable and TileTable (which are both safe for that), and the threads take care not to write
+//  their complaints over each other
+Mutex scanoutputmutex;
+
+// set a chunk to required, along with any tiles it touches; returns 0 on success, -1 if baseZoom is too small
+//  to fit one of the tiles
+// ...if findBaseZoom is set, mp.baseZoom is raised as necessary instead
+// ...source is where the chunk came from, for the error messages (e.g. "region r.0.0.mca")
+int requireChunkAndTiles(const ChunkIdx& ci, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, bool findBaseZoom, int64_t& reqchunkcount, const string& source)
+{
+	PosChunkIdx pci(ci);
+	if (!pci.valid())
+	{
+		MutexLocker ml(scanoutputmutex);
+		cerr << "ignoring extremely-distant chunk " << ci.toFileName() << " (world may be corrupt)" << endl;
+		return 0;
+	}
+	chunktable.setRequired(pci);
+	reqchunkcount++;
+	vector<TileIdx> tiles = ci.getTiles(mp);
+	for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
+	{
+		// first check if this tile fits in the TileTable, whose size is fixed
+		PosTileIdx pti(*tile);
+		if (pti.valid())
+			tiletable.setRequired(pti);
+		else
+		{
+			MutexLocker ml(scanoutputmutex);
+			cerr << "ignoring extremely-distant tile [" << tile->x << "," << tile->y << "]" << endl;
+			cerr << "(world may be corrupt; is " << source << " supposed to exist?)" << endl;
+			continue;
+		}
+		// now see if the tile fits on the Google map
+		if (!tile->valid(mp))
+		{
+			// if we're supposed to be finding baseZoom, then bump it up until this tile fits
+			if (findBaseZoom)
+			{
+				while (!tile->valid(mp))
+					mp.baseZoom++;
+			}
+			// otherwise, abort
+			else
+			{
+				MutexLocker ml(scanoutputmutex);
+				cerr << "baseZoom too small!  can't fit tile [" << tile->x << "," << tile->y << "]" << endl;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// a full scan of the world, split into work items (regions, or chunk directories) that threads take in turn
+struct WorldScan : private nocopy
+{
+	string topdir;
+	ChunkTable& chunktable;
+	TileTable& tiletable;
+	MapParams mp;  // each thread works with its own copy, whose baseZoom it raises if findBaseZoom is set
+	bool findBaseZoom;
+	int64_t items;
+	int64_t nextitem;  // next work item to hand out (taken atomically)
+	volatile bool failed;  // set when baseZoom turns out to be too small; the threads stop early
+
+	// region scans only: the regions, and for each one, the number of chunks it has (or -1 if it couldn't
+	//  be read) and, if we're keeping them, its timestamps
+	vector<RegionIdx> regions;
 	vector<string> regionpaths;
-	listEntries(topdir + "/region", regionpaths);
-	for (vector<string>::const_iterator it = regionpaths.begin(); it != regionpaths.end(); it++)
+	vector<int> chunkcounts;
+	bool keeptimestamps;
+	vector<vector<uint32_t> > timestamps;
+	// ...and if we have a RegionIndex: each region's current entry, whether the entry is good enough to keep
+	//  (i.e. we got its chunks and know which file they came from), and whether we got them from the index
+	const RegionIndex *index;
+	const ChunkTimestamps *oldtimestamps;
+	vector<RegionIndex::Entry> entries;
+	vector<char> indexable, fromindex;
+	// ...and if we're making a snapshot, each region's current chunk mask; if the tables were started from
+	//  one, the old snapshot, how many of its regions we've seen again, and whether any of them has lost chunks
+	const TableSnapshot *snapshot;
+	vector<vector<uint32_t> > masks;
+	int64_t snapshotmatched;
+	volatile bool snapshotstale;
+
+	// results from all the threads (protected by mutex)
+	Mutex mutex;
+	int64_t reqchunkcount;
+	int baseZoom;  // largest needed by any thread
+
+	WorldScan(const string& td, ChunkTable& ctable, TileTable& ttable, const MapParams& mparams, bool fbz, int64_t n)
+		: topdir(td), chunktable(ctable), tiletable(ttable), mp(mparams), findBaseZoom(fbz), items(n), nextitem(0), failed(false),
+		  keeptimestamps(false), index(NULL), oldtimestamps(NULL), snapshot(NULL), snapshotmatched(0), snapshotstale(false),
+		  reqchunkcount(0), baseZoom(mparams.baseZoom) {}
+
+	// get the next work item for a thread; returns -1 when there are none left
+	int64_t next() {int64_t i = __sync_fetch_and_add(&nextitem, 1); return (i < items && !failed) ? i : -1;}
+	// record a thread's results
+	void finish(const MapParams& threadmp, int64_t threadreqchunkcount)
 	{
-		RegionIdx ri(0,0);
-		// if this is a proper region filename, use it
-		if (RegionIdx::fromFilePath(*it, ri))
+		MutexLocker ml(mutex);
+		reqchunkcount += threadreqchunkcount;
+		baseZoom = max(baseZoom, threadmp.baseZoom);
+	}
+};
+
+void *runRegionScanThread(void *arg)
+{
+	WorldScan& scan = *(WorldScan*)arg;
+	RegionFileReader rfreader;
+	MapParams mp = scan.mp;
+	int64_t reqchunkcount = 0;
+	for (int64_t i = scan.next(); i != -1; i = scan.next())
+	{
+		// get the chunks that currently exist in this region: from the index, if the file hasn't changed
+		//  (and we have its old timestamps, if we need them), or else from the region header
+		const RegionIdx& ri = scan.regions[i];
+		vector<ChunkIdx> chunks;
+		// (the file is stat'ed before it's read, so if it changes in between, the index won't match next time)
+		bool statted = scan.index != NULL && RegionIndex::statRegion(ri, scan.topdir, scan.entries[i]);
+		bool usable = statted;
+		map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator oldts;
+		if (usable && scan.keeptimestamps)
 		{
-			PosRegionIdx pri(ri);
-			if (!pri.valid())
+			oldts = scan.oldtimestamps->regions.find(make_pair(ri.x, ri.z));
+			usable = oldts != scan.oldtimestamps->regions.end();
+		}
+		if (usable && scan.index->getChunks(ri, scan.entries[i], chunks))
+		{
+			scan.entries[i].setChunks(ri, chunks);
+			scan.fromindex[i] = scan.indexable[i] = true;
+			if (scan.keeptimestamps)
+				scan.timestamps[i] = oldts->second;
+		}
+		else
+		{
+			if (0 != rfreader.getContainedChunks(ri, string84(scan.topdir), chunks))
 			{
-				cerr << "ignoring extremely-distant region " << *it << " (world may be corrupt)" << endl;
+				scan.chunkcounts[i] = -1;
 				continue;
 			}
-			// we might have found this region already, if the world data contains both .mca and .mcr files
-			if (regiontable.isRequired(pri))
-				continue;
-			// get the chunks that currently exist in this region; if there aren't any, ignore it
-			vector<ChunkIdx> chunks;
-			if (0 != rfreader.getContainedChunks(ri, string84(topdir), chunks))
+			if (scan.keeptimestamps)
+				scan.timestamps[i] = rfreader.timestamps;
+			// (if an Anvil file appeared after we stat'ed the old one, or vice versa, it won't go in the index)
+			if (statted && scan.entries[i].anvil == rfreader.anvil)
 			{
-				cerr << "can't open region " << *it << " to list chunks" << endl;
-				continue;
+				scan.entries[i].setChunks(ri, chunks);
+				scan.indexable[i] = true;
 			}
-			if (chunks.empty())
-				continue;
-			// mark the region required
-			regiontable.setRequired(pri);
-			reqregioncount++;
-			// go through the contained chunks
-			for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
+		}
+		scan.chunkcounts[i] = chunks.size();
+		// if the snapshot already has this region, only the chunks it's gained need marking
+		RegionIndex::Entry current;
+		if (!scan.masks.empty())
+		{
+			current.setChunks(ri, chunks);
+			scan.masks[i].assign(current.chunks, current.chunks + 32);
+		}
+		if (scan.snapshot != NULL)
+		{
+			map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator old = scan.snapshot->regions.find(make_pair(ri.x, ri.z));
+			if (old != scan.snapshot->regions.end())
 			{
-				// mark the chunk required
-				PosChunkIdx pci(*chunk);
-				if (pci.valid())
-				{
-					chunktable.setRequired(pci);
-					reqchunkcount++;
-				}
-				else
-				{
-					cerr << "ignoring extremely-distant chunk " << chunk->toFileName() << " (world may be corrupt)" << endl;
-					continue;
-				}
-				// get the tiles it touches and mark them required
-				vector<TileIdx> tiles = chunk->getTiles(mp);
-				for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
-				{
-					// first check if this tile fits in the TileTable, whose size is fixed
-					PosTileIdx pti(*tile);
-					if (pti.valid())
-						tiletable.setRequired(pti);
-					else
-					{
-						cerr << "ignoring extremely-distant tile [" << tile->x << "," << tile->y << "]" << endl;
-						cerr << "(world may be corrupt; is region " << *it << " supposed to exist?)" << endl;
-						continue;
-					}
-					// now see if the tile fits on the Google map
-					if (!tile->valid(mp))
-					{
-						// if we're supposed to be finding baseZoom, then bump it up until this tile fits
-						if (findBaseZoom)
-						{
-							while (!tile->valid(mp))
-								mp.baseZoom++;
-						}
-						// otherwise, abort
-						else
-						{
-							cerr << "baseZoom too small!  can't fit tile [" << tile->x << "," << tile->y << "]" << endl;
-							return false;
-						}
-					}
-				}
+				__sync_fetch_and_add(&scan.snapshotmatched, 1);
+				ChunkIdx base = ri.baseChunk();
+				vector<ChunkIdx> added;
+				for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
+					if (!(old->second[chunk->z - base.z] & (1u << (chunk->x - base.x))))
+						added.push_back(*chunk);
+				for (int w = 0; w < 32; w++)
+					if (old->second[w] & ~current.chunks[w])
+						scan.snapshotstale = true;
+				chunks.swap(added);
+			}
+		}
+		string source = "region " + scan.regionpaths[i];
+		for (vector<ChunkIdx>::const_iterator chunk = chunks.begin(); chunk != chunks.end(); chunk++)
+			if (0 != requireChunkAndTiles(*chunk, scan.chunktable, scan.tiletable, mp, scan.findBaseZoom, reqchunkcount, source))
+			{
+				scan.failed = true;
+				break;
 			}
+	}
+	scan.finish(mp, reqchunkcount);
+	return 0;
+}
+
+// run a scan on some threads, and wait for them to finish
+void runWorldScan(WorldScan& scan, int threads, void *(*func)(void*))
+{
+	vector<pthread_t> pthrs(max(threads, 1));
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		if (0 != pthread_create(&*it, NULL, func, (void*)&scan))
+			cerr << "failed to create world scan thread!" << endl;
+	for (vector<pthread_t>::iterator it = pthrs.begin(); it != pthrs.end(); it++)
+		pthread_join(*it, NULL);
+}
+
+bool makeAllRegionsRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkTimestamps *timestamps, int threads, RegionIndex *index, const ChunkTimestamps *oldtimestamps, TableSnapshot *snapshot)
+{
+	int origBaseZoom = mp.baseZoom;
+	bool findBaseZoom = mp.baseZoom == -1;
+	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
+	if (findBaseZoom)
+		mp.baseZoom = 0;
+	// start from the snapshot if we can; its tiles all fit at its baseZoom, so that's where we start looking
+	bool usesnapshot = snapshot != NULL && snapshot->loaded && snapshot->B == mp.B && snapshot->T == mp.T &&
+	                   snapshot->minY == mp.minY && snapshot->maxY == mp.maxY && (findBaseZoom || mp.baseZoom >= snapshot->baseZoom);
+	if (usesnapshot)
+	{
+		if (chunktable.loadRequired(snapshot->chunkwords) && tiletable.loadRequired(snapshot->tilewords))
+		{
+			if (findBaseZoom)
+				mp.baseZoom = snapshot->baseZoom;
+		}
+		else
+		{
+			chunktable.clear();
+			tiletable.clear();
+			usesnapshot = false;
+		}
+	}
+	if (snapshot != NULL)
+	{
+		// (the lists aren't needed again until they're refilled from the new tables)
+		vector<uint32_t>().swap(snapshot->chunkwords);
+		vector<uint32_t>().swap(snapshot->tilewords);
+	}
+	reqregioncount = 0;
+	// get all files in the region directory, and pick out the proper region filenames
+	vector<string> entries;
+	listEntries(topdir + "/region", entries);
+	vector<RegionIdx> regions;
+	vector<string> regionpaths;
+	set<pair<int64_t, int64_t> > seen;
+	for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); it++)
+	{
+		RegionIdx ri(0,0);
+		if (!RegionIdx::fromFilePath(*it, ri))
+			continue;
+		if (!PosRegionIdx(ri).valid())
+		{
+			cerr << "ignoring extremely-distant region " << *it << " (world may be corrupt)" << endl;
+			continue;
+		}
+		// we might have found this region already, if the world data contains both .mca and .mcr files
+		if (!seen.insert(make_pair(ri.x, ri.z)).second)
+			continue;
+		regions.push_back(ri);
+		regionpaths.push_back(*it);
+	}
+
+	// read the region headers and mark the chunks and tiles
+	WorldScan scan(topdir, chunktable, tiletable, mp, findBaseZoom, regions.size());
+	scan.regions.swap(regions);
+	scan.regionpaths.swap(regionpaths);
+	scan.chunkcounts.resize(scan.items, 0);
+	scan.keeptimestamps = timestamps != NULL;
+	if (scan.keeptimestamps)
+		scan.timestamps.resize(scan.items);
+	if (index != NULL && (!scan.keeptimestamps || oldtimestamps != NULL))
+	{
+		scan.index = index;
+		scan.oldtimestamps = oldtimestamps;
+		scan.entries.resize(scan.items);
+		scan.indexable.resize(scan.items, false);
+		scan.fromindex.resize(scan.items, false);
+	}
+	if (snapshot != NULL)
+	{
+		scan.snapshot = usesnapshot ? snapshot : NULL;
+		scan.masks.resize(scan.items);
+	}
+	runWorldScan(scan, threads, runRegionScanThread);
+	if (scan.failed)
+		return false;
+	// if anything in the snapshot has disappeared, its tables have tiles we don't want; start over without it
+	if (usesnapshot && (scan.snapshotstale || scan.snapshotmatched != (int64_t)snapshot->regions.size()))
+	{
+		cout << "world has lost chunks since the last full render; rescanning everything" << endl;
+		chunktable.clear();
+		tiletable.clear();
+		snapshot->loaded = false;
+		mp.baseZoom = origBaseZoom;
+		return makeAllRegionsRequired(topdir, chunktable, tiletable, regiontable, mp, reqchunkcount, reqtilecount, reqregioncount, timestamps, threads, index, oldtimestamps, snapshot);
+	}
+
+	// now go through the regions in order to mark them required and collect the timestamps (regions
+	//  without any chunks are ignored)
+	for (int64_t i = 0; i < scan.items; i++)
+	{
+		if (scan.chunkcounts[i] == -1)
+		{
+			cerr << "can't open region " << scan.regionpaths[i] << " to list chunks" << endl;
+			continue;
 		}
+		if (timestamps != NULL)
+			timestamps->regions[make_pair(scan.regions[i].x, scan.regions[i].z)].swap(scan.timestamps[i]);
+		if (scan.chunkcounts[i] == 0)
+			continue;
+		regiontable.setRequired(scan.regions[i]);
+		reqregioncount++;
 	}
+	// replace the index with one for the regions we have now
+	if (scan.index != NULL)
+	{
+		RegionIndex newindex;
+		int64_t unchanged = 0;
+		for (int64_t i = 0; i < scan.items; i++)
+		{
+			if (scan.indexable[i])
+				newindex.set(scan.regions[i], scan.entries[i]);
+			if (scan.fromindex[i])
+				unchanged++;
+		}
+		index->regions.swap(newindex.regions);
+		cout << unchanged << " of " << scan.items << " regions unchanged since last scan" << endl;
+	}
+	if (snapshot != NULL)
+	{
+		snapshot->regions.clear();
+		for (int64_t i = 0; i < scan.items; i++)
+			if (scan.chunkcounts[i] > 0)
+				snapshot->regions[make_pair(scan.regions[i].x, scan.regions[i].z)].swap(scan.masks[i]);
+	}
+	// (when starting from the snapshot, most of the chunks were never marked by the scan, so count them all)
+	reqchunkcount += usesnapshot ? chunktable.countRequired() : scan.reqchunkcount;
+	mp.baseZoom = scan.baseZoom;
 	reqtilecount = tiletable.reqcount;
+	if (usesnapshot)
+		cout << "started from tables of last full render" << endl;
 	if (findBaseZoom)
 		cout << "baseZoom set to " << mp.baseZoom << endl;
 	return true;
 }
 
-int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount)
+int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkTimestamps *timestamps, RegionIndex *index)
 {
 	ifstream infile(regionlist.c_str());
 	if (infile.fail())
@@ -157,10 +697,27 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 			if (regiontable.isRequired(pri))
 				continue;
 			vector<ChunkIdx> chunks;
-			if (0 != rfreader.getContainedChunks(ri, string84(inputdir), chunks))
+			RegionIndex::Entry entry;
+			bool statted = index != NULL && RegionIndex::statRegion(ri, inputdir, entry);
+			if (statted && (timestamps == NULL || timestamps->regions.count(make_pair(ri.x, ri.z)) != 0) &&
+			    index->getChunks(ri, entry, chunks))
+				;  // unchanged, so the timestamps we already have are still right
+			else
 			{
-				cerr << "can't open region " << regionfile << " to list chunks" << endl;
-				continue;
+				if (0 != rfreader.getContainedChunks(ri, string84(inputdir), chunks))
+				{
+					cerr << "can't open region " << regionfile << " to list chunks" << endl;
+					continue;
+				}
+				if (timestamps != NULL)
+					timestamps->set(ri, rfreader);
+				if (statted && entry.anvil == rfreader.anvil)
+				{
+					entry.setChunks(ri, chunks);
+					index->set(ri, entry);
+				}
+				else if (index != NULL)
+					index->regions.erase(make_pair(ri.x, ri.z));
 			}
 			if (chunks.empty())
 				continue;
@@ -208,78 +765,161 @@ int readRegionlist(const string& regionlist, const string& inputdir, ChunkTable&
 
 
 
+int findChangedChunks(const string& inputdir, const ChunkTimestamps& oldtimestamps, ChunkTimestamps& newtimestamps, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, RegionIndex *index)
+{
+	reqregioncount = 0;
+	MapParams fcmp = mp;
+	RegionFileReader rfreader;
+	vector<string> regionpaths;
+	listEntries(inputdir + "/region", regionpaths);
+	set<pair<int64_t, int64_t> > ondisk;
+	for (vector<string>::const_iterator it = regionpaths.begin(); it != regionpaths.end(); it++)
+	{
+		RegionIdx ri(0,0);
+		if (!RegionIdx::fromFilePath(*it, ri))
+			continue;
+		PosRegionIdx pri(ri);
+		if (!pri.valid())
+		{
+			cerr << "ignoring extremely-distant region " << *it << " (world may be corrupt)" << endl;
+			continue;
+		}
+		ondisk.insert(make_pair(ri.x, ri.z));
+		// we might have done this region already, if the world data contains both .mca and .mcr files
+		if (newtimestamps.regions.count(make_pair(ri.x, ri.z)) != 0)
+			continue;
+		// if the file hasn't changed since the index was made, neither have its timestamps
+		RegionIndex::Entry entry;
+		bool statted = index != NULL && RegionIndex::statRegion(ri, inputdir, entry);
+		if (statted)
+		{
+			map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator oldts = oldtimestamps.regions.find(make_pair(ri.x, ri.z));
+			vector<ChunkIdx> chunks;
+			if (oldts != oldtimestamps.regions.end() && index->getChunks(ri, entry, chunks))
+			{
+				newtimestamps.regions[oldts->first] = oldts->second;
+				continue;
+			}
+		}
+		if (0 != rfreader.loadHeaderOnly(ri, inputdir))
+		{
+			cerr << "can't open region " << *it << " to read timestamps" << endl;
+			continue;
+		}
+		newtimestamps.set(ri, rfreader);
+		if (statted && entry.anvil == rfreader.anvil)
+		{
+			vector<ChunkIdx> chunks;
+			for (RegionChunkIterator rcit(ri); !rcit.end; rcit.advance())
+				if (rfreader.containsChunk(rcit.current))
+					chunks.push_back(rcit.current);
+			entry.setChunks(ri, chunks);
+			index->set(ri, entry);
+		}
+		else if (index != NULL)
+			index->regions.erase(make_pair(ri.x, ri.z));
+		// any chunk whose timestamp doesn't match is required (deleted chunks have timestamp 0, so
+		//  they count too: their tiles need to be redrawn without them)
+		bool changed = false;
+		for (RegionChunkIterator rcit(ri); !rcit.end; rcit.advance())
+		{
+			if (rfreader.getTimestamp(RegionFileReader::getIdx(rcit.current)) == oldtimestamps.get(rcit.current))
+				continue;
+			changed = true;
+			if (0 != requireChunkAndTiles(rcit.current, chunktable, tiletable, fcmp, false, reqchunkcount, "region " + *it))
+				return -1;
+		}
+		if (changed)
+		{
+			regiontable.setRequired(pri);
+			reqregioncount++;
+		}
+	}
+
+	// regions that were there last time but have been deleted since: all of their chunks are gone, so
+	//  their tiles need to be redrawn without them (and they can be dropped from the index)
+	if (index != NULL)
+		for (map<pair<int64_t, int64_t>, RegionIndex::Entry>::iterator it = index->regions.begin(); it != index->regions.end(); )
+		{
+			if (ondisk.count(it->first) == 0)
+				index->regions.erase(it++);
+			else
+				it++;
+		}
+	for (map<pair<int64_t, int64_t>, vector<uint32_t> >::const_iterator oldts = oldtimestamps.regions.begin(); oldts != oldtimestamps.regions.end(); oldts++)
+	{
+		if (ondisk.count(oldts->first) != 0)
+			continue;
+		RegionIdx ri(oldts->first.first, oldts->first.second);
+		PosRegionIdx pri(ri);
+		if (!pri.valid())
+			continue;
+		bool changed = false;
+		for (RegionChunkIterator rcit(ri); !rcit.end; rcit.advance())
+		{
+			if (oldtimestamps.get(rcit.current) == 0)
+				continue;
+			changed = true;
+			if (0 != requireChunkAndTiles(rcit.current, chunktable, tiletable, fcmp, false, reqchunkcount, "deleted region " + ri.toAnvilFileName()))
+				return -1;
+		}
+		if (changed)
+		{
+			regiontable.setRequired(pri);
+			reqregioncount++;
+		}
+	}
+	reqtilecount = tiletable.reqcount;
+	return 0;
+}
+
+
+
+
+
 const char *chunkdirs[64] = {"/0", "/1", "/2", "/3", "/4", "/5", "/6", "/7", "/8", "/9", "/a", "/b", "/c", "/d", "/e", "/f",
                              "/g", "/h", "/i", "/j", "/k", "/l", "/m", "/n", "/o", "/p", "/q", "/r", "/s", "/t", "/u", "/v",
                              "/w", "/x", "/y", "/z", "/10", "/11", "/12", "/13", "/14", "/15", "/16", "/17", "/18", "/19", "/1a", "/1b",
                              "/1c", "/1d", "/1e", "/1f", "/1g", "/1h", "/1i", "/1j", "/1k", "/1l", "/1m", "/1n", "/1o", "/1p", "/1q", "/1r",};
 
-bool makeAllChunksRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount)
+void *runChunkScanThread(void *arg)
+{
+	WorldScan& scan = *(WorldScan*)arg;
+	MapParams mp = scan.mp;
+	int64_t reqchunkcount = 0;
+	for (int64_t i = scan.next(); i != -1; i = scan.next())
+	{
+		// get all files in the subdirectory
+		vector<string> chunkpaths;
+		listEntries(scan.topdir + chunkdirs[i / 64] + chunkdirs[i % 64], chunkpaths);
+		for (vector<string>::const_iterator it = chunkpaths.begin(); it != chunkpaths.end(); it++)
+		{
+			ChunkIdx ci(0,0);
+			// if this is a proper chunk filename, use it
+			if (ChunkIdx::fromFilePath(*it, ci) && 0 != requireChunkAndTiles(ci, scan.chunktable, scan.tiletable, mp, scan.findBaseZoom, reqchunkcount, "chunk " + ci.toFileName()))
+			{
+				scan.failed = true;
+				break;
+			}
+		}
+	}
+	scan.finish(mp, reqchunkcount);
+	return 0;
+}
+
+bool makeAllChunksRequired(const string& topdir, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int threads)
 {
 	bool findBaseZoom = mp.baseZoom == -1;
 	// if finding the baseZoom, we'll just start from 0 and increase it whenever we hit a tile that's out of bounds
 	if (findBaseZoom)
 		mp.baseZoom = 0;
-	reqchunkcount = 0;
 	// go through each world subdirectory
-	for (int x = 0; x < 64; x++)
-		for (int z = 0; z < 64; z++)
-		{
-			// get all files in the subdirectory
-			vector<string> chunkpaths;
-			string path = topdir + chunkdirs[x] + chunkdirs[z];
-			listEntries(path, chunkpaths);
-			for (vector<string>::const_iterator it = chunkpaths.begin(); it != chunkpaths.end(); it++)
-			{
-				ChunkIdx ci(0,0);
-				// if this is a proper chunk filename, use it
-				if (ChunkIdx::fromFilePath(*it, ci))
-				{
-					// mark the chunk required
-					PosChunkIdx pci(ci);
-					if (pci.valid())
-					{
-						chunktable.setRequired(pci);
-						reqchunkcount++;
-					}
-					else
-					{
-						cerr << "ignoring extremely-distant chunk " << ci.toFileName() << " (world may be corrupt)" << endl;
-						continue;
-					}
-					// get the tiles it touches and mark them required
-					vector<TileIdx> tiles = ci.getTiles(mp);
-					for (vector<TileIdx>::const_iterator tile = tiles.begin(); tile != tiles.end(); tile++)
-					{
-						// first check if this tile fits in the TileTable, whose size is fixed
-						PosTileIdx pti(*tile);
-						if (pti.valid())
-							tiletable.setRequired(pti);
-						else
-						{
-							cerr << "ignoring extremely-distant tile [" << tile->x << "," << tile->y << "]" << endl;
-							cerr << "(world may be corrupt; is chunk " << ci.toFileName() << " supposed to exist?)" << endl;
-							continue;
-						}
-						// now see if the tile fits on the Google map
-						if (!tile->valid(mp))
-						{
-							// if we're supposed to be finding baseZoom, then bump it up until this tile fits
-							if (findBaseZoom)
-							{
-								while (!tile->valid(mp))
-									mp.baseZoom++;
-							}
-							// otherwise, abort
-							else
-							{
-								cerr << "baseZoom too small!  can't fit tile [" << tile->x << "," << tile->y << "]" << endl;
-								return false;
-							}
-						}
-					}
-				}
-			}
-		}
+	WorldScan scan(topdir, chunktable, tiletable, mp, findBaseZoom, 64 * 64);
+	runWorldScan(scan, threads, runChunkScanThread);
+	if (scan.failed)
+		return false;
+	reqchunkcount = scan.reqchunkcount;
+	mp.baseZoom = scan.baseZoom;
 	reqtilecount = tiletable.reqcount;
 	if (findBaseZoom)
 		cout << "baseZoom set to " << mp.baseZoom << endl;
@@ -19,21 +19,104 @@
 #define WORLD_H
 
 #include <stdint.h>
+#include <map>
 
 #include "map.h"
 #include "tables.h"
 
+struct RegionFileReader;
+
 
 // see whether the input world is in region format
 bool detectRegionFormat(const std::string& inputdir);
 
 
+// the last-modified times of the chunks in a region-format world, as of the last render; these are kept
+//  in the output path as "pigmap.timestamps", so that automatic updates (-a) can tell which chunks have
+//  changed since then
+struct ChunkTimestamps
+{
+	// each region's timestamps are stored as they appear in the region header (big-endian, indexed by
+	//  Z*32 + X, and 0 for missing chunks)
+	std::map<std::pair<int64_t, int64_t>, std::vector<uint32_t> > regions;
+
+	// copy the timestamps from a region header that was read with RegionFileReader::loadHeaderOnly
+	void set(const RegionIdx& ri, const RegionFileReader& rfreader);
+	// get a chunk's timestamp, or 0 if we don't have it
+	uint32_t get(const ChunkIdx& ci) const;
+
+	bool readFile(const std::string& outputpath);
+	bool writeFile(const std::string& outputpath) const;
+};
+
+
+// what we knew about each region file at the last scan: its size and modification time, and which chunks it
+//  had; these are kept in the output path as "pigmap.regionindex" (and written whenever the timestamps are), so
+//  that later scans can stat the region files and only read the headers of the ones that have changed
+struct RegionIndex
+{
+	struct Entry
+	{
+		bool anvil;  // whether the file was the Anvil one (which is preferred when both exist)
+		int64_t mtime, size;
+		uint32_t chunks[32];  // bit X of word Z is set if the region has chunk [X,Z] (relative to the region)
+
+		// whether this describes the same file as another entry (ignoring the chunks)
+		bool sameFile(const Entry& e) const {return anvil == e.anvil && mtime == e.mtime && size == e.size;}
+		// fill in the chunks from a list
+		void setChunks(const RegionIdx& ri, const std::vector<ChunkIdx>& chunklist);
+	};
+	std::map<std::pair<int64_t, int64_t>, Entry> regions;
+
+	// stat the file for a region (the Anvil one, if there is one), filling in everything but the chunks;
+	//  returns false if there's no file at all, or if it was modified so recently (see RACYSECONDS) that another
+	//  write might not change its mtime, in which case it shouldn't be looked up in the index or put there
+	static bool statRegion(const RegionIdx& ri, const std::string& inputdir, Entry& entry);
+	// if we have an entry for a region that describes the same file as current, get its chunks and return true
+	bool getChunks(const RegionIdx& ri, const Entry& current, std::vector<ChunkIdx>& chunklist) const;
+	void set(const RegionIdx& ri, const Entry& entry) {regions[std::make_pair(ri.x, ri.z)] = entry;}
+
+	bool readFile(const std::string& outputpath);
+	bool writeFile(const std::string& outputpath) const;
+};
+
+
+// the required chunks and tiles from the last full render of a region-format world, along with which chunks
+//  each region had then; kept in the output path as "pigmap.tables", so that if the world has only grown since,
+//  the next full render can start from the old tables and mark just the new chunks
+struct TableSnapshot
+{
+	bool loaded;  // whether readFile succeeded (and the rest of this is good for anything)
+	int B, T, baseZoom, minY, maxY;  // (the tables are only good for the same map parameters)
+	std::map<std::pair<int64_t, int64_t>, std::vector<uint32_t> > regions;  // 32 words per region, like RegionIndex::Entry::chunks
+	std::vector<uint32_t> chunkwords, tilewords;  // from ChunkTable::saveRequired and TileTable::saveRequired
+
+	TableSnapshot() : loaded(false) {}
+
+	// fill in everything but the regions from the tables after a render
+	void take(const ChunkTable& chunktable, const TileTable& tiletable, const MapParams& mp);
+
+	// fails (leaving loaded false) if the file is missing or corrupt, or was made with different B, T, or
+	//  height limits
+	bool readFile(const std::string& outputpath, const MapParams& mp);
+	bool writeFile(const std::string& outputpath) const;
+};
+
+
 // find all regions on disk; set them to required in the RegionTable; set all chunks they contain to
 //  required in the ChunkTable; set all tiles touched by those chunks to required in the TileTable
 // returns false if the world is too big to fit in one of the tables
 // if mp.baseZoom is set to -1 coming in, then this function will set it to the smallest zoom
 //  that can fit everything
-bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount);
+// ...if timestamps is supplied, the chunk timestamps of all the regions are stored into it
+// ...the regions are read and their chunks marked on the given number of threads
+// ...if index is supplied, regions whose files haven't changed since it was made aren't read (but if we're
+//  also getting timestamps, their old ones must be in oldtimestamps); when we're done, the index describes
+//  the current regions
+// ...if snapshot is supplied and was loaded, the (empty) tables are started from it, and only chunks that
+//  weren't in it are marked (if any chunks have gone missing since, it's thrown away and everything is marked
+//  as usual); either way, its regions are replaced with the current ones, ready for it to be saved again
+bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkTimestamps *timestamps = NULL, int threads = 1, RegionIndex *index = NULL, const ChunkTimestamps *oldtimestamps = NULL, TableSnapshot *snapshot = NULL);
 
 // read a list of region filenames from a file; set the regions to required in the RegionTable; set the chunks they
 //  contain to required in the ChunkTable; set all tiles touched by those chunks to required in the TileTable
@@ -42,7 +125,22 @@ bool makeAllRegionsRequired(const std::string& inputdir, ChunkTable& chunktable,
 //  even if ".mcr" was used in this regionlist
 // returns 0 on success, -1 if baseZoom is too small, -2 for other errors (can't read regionlist, world too big
 //  for our internal data structures, etc.)
-int readRegionlist(const std::string& regionlist, const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqrchunkcount, int64_t& reqtilecount, int64_t& reqregioncount);
+// ...if timestamps is supplied, the chunk timestamps of the listed regions are stored into it
+// ...if index is supplied, it's used and updated as for makeAllRegionsRequired (regions that haven't changed
+//  keep whatever timestamps are already there)
+int readRegionlist(const std::string& regionlist, const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqrchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, ChunkTimestamps *timestamps = NULL, RegionIndex *index = NULL);
+
+// find all regions on disk and compare their chunk timestamps to the ones from the last render; set the chunks
+//  whose timestamps have changed (including chunks that have been created or deleted, and all the chunks of
+//  regions that were there last time but have been deleted since) to required in the
+//  ChunkTable, set their regions to required in the RegionTable, and set all tiles touched by those chunks
+//  to required in the TileTable
+// the current timestamps are stored into newtimestamps
+// returns 0 on success, -1 if baseZoom is too small, -2 for other errors
+// ...if index is supplied, regions whose files haven't changed since it was made are assumed to have the same
+//  timestamps as before, and aren't read at all; the index is updated for the ones that are, and regions that
+//  are no longer on disk are dropped from it
+int findChangedChunks(const std::string& inputdir, const ChunkTimestamps& oldtimestamps, ChunkTimestamps& newtimestamps, ChunkTable& chunktable, TileTable& tiletable, RegionTable& regiontable, const MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int64_t& reqregioncount, RegionIndex *index = NULL);
 
 
 // find all chunks on disk, set them to required in the ChunkTable, and set all tiles they
@@ -50,7 +148,8 @@ int readRegionlist(const std::string& regionlist, const std::string& inputdir, C
 // returns false if the world is too big to fit in one of the tables
 // if mp.baseZoom is set to -1 coming in, then this function will set it to the smallest zoom
 //  that can fit everything
-bool makeAllChunksRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount);
+// ...the world subdirectories are split among the given number of threads
+bool makeAllChunksRequired(const std::string& inputdir, ChunkTable& chunktable, TileTable& tiletable, MapParams& mp, int64_t& reqchunkcount, int64_t& reqtilecount, int threads = 1);
 
 // read a list of chunk filenames from a file and set the chunks to required in the ChunkTable, and set
 //  any tiles they touch to required in the TileTable